@@ -0,0 +1,83 @@
+//
+// ctx.c
+//
+// Per-operation contexts: options and error reporting
+//
+#include "internal.h"
+
+#define OPTIONS_DEFAULT {TAR_IO_POSIX, 32, NULL, 0, 0, 0, TAR_DURABLE_NONE, 256, 0, TAR_SORT_NONE, 0, TAR_RESUME_NONE, 0}
+
+// used by a thread that has not picked a context; one per thread, so threads
+// without contexts never share operation state
+static __thread struct tar_ctx tar_ctx_default = {OPTIONS_DEFAULT};
+
+static __thread struct tar_ctx *tar_ctx_active = NULL;
+
+void tar_ctx_init(struct tar_ctx *ctx)
+{
+    const struct tar_options defaults = OPTIONS_DEFAULT;
+    memset(ctx, 0, sizeof(struct tar_ctx));
+    ctx->options = defaults;
+}
+
+struct tar_ctx *tar_ctx_use(struct tar_ctx *ctx)
+{
+    struct tar_ctx *previous = tar_ctx_active;
+    tar_ctx_active = ctx;
+    return previous;
+}
+
+struct tar_ctx *tar_ctx_current(void)
+{
+    return tar_ctx_active ? tar_ctx_active : &tar_ctx_default;
+}
+
+void tar_error(const char *fmt, ...)
+{
+    char message[CTX_ERRBUF];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    struct tar_ctx *ctx = tar_ctx_current();
+    if (ctx->errbuf && ctx->errbuf_size)
+    {
+        snprintf(ctx->errbuf, ctx->errbuf_size, "%s", message);
+    }
+
+    if (ctx->error)
+    {
+        ctx->error(ctx->error_arg, message);
+    }
+    else
+    {
+        fprintf(stderr, "Error: %s\n", message);
+    }
+}
+
+void ctx_inherit(struct tar_ctx *worker, const struct tar_ctx *parent, char *errbuf)
+{
+    tar_ctx_init(worker);
+    worker->options = parent->options;
+    worker->error = parent->error;
+    worker->error_arg = parent->error_arg;
+    worker->stats = parent->stats;
+    worker->trace = parent->trace;
+
+    // errors wait in the worker's own buffer until ctx_join
+    if (parent->errbuf && parent->errbuf_size && errbuf)
+    {
+        errbuf[0] = '\0';
+        worker->errbuf = errbuf;
+        worker->errbuf_size = CTX_ERRBUF;
+    }
+}
+
+void ctx_join(struct tar_ctx *parent, const struct tar_ctx *worker)
+{
+    if (worker->errbuf && worker->errbuf[0])
+    {
+        snprintf(parent->errbuf, parent->errbuf_size, "%s", worker->errbuf);
+    }
+}
@@ -0,0 +1,557 @@
+//
+// dio.c
+//
+// Double-buffered O_DIRECT reader and writer for archive fds
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT, statx
+#endif
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "dio.h"
+#include "internal.h"
+#include "stats.h"
+
+#define DIO_BUF (8 << 20)      // octets per buffer (a multiple of 2 MiB huge pages)
+#define DIO_MIN (64 << 10)     // first window after a seek
+#define DIO_ALIGN 4096         // used when the filesystem does not report one
+
+struct dio
+{
+    int fd;
+    int flags;   // file status flags to restore
+    char mode;   // DIO_READ or DIO_WRITE
+    char direct; // cleared when the filesystem refuses O_DIRECT transfers
+    char verbosity;
+    size_t align;
+
+    char *map; // both buffers
+    size_t map_size;
+    char *bufs[2];
+    int cur;    // buffer being read from or filled
+    off_t base; // file offset of bufs[cur][0] (aligned)
+    size_t len; // valid (read) or filled (write) octets in bufs[cur]
+    off_t pos;  // stream position
+    size_t ra;  // reader window, grows while access is sequential
+    off_t ahead; // reader: offset being prefetched into the other buffer, -1 for none
+    struct tar_ctx *ctx; // of the opener; the worker counts its syscalls there
+    struct dio *next;    // next stream of the same context
+
+    // background transfer
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char pending; // a job was handed over and has not finished
+    char quit;
+    char *job_buf;
+    size_t job_len;
+    off_t job_off;
+    ssize_t job_ret;
+};
+
+// full pread/pwrite at an aligned offset, dropping O_DIRECT if it is refused
+static ssize_t transfer(struct dio *d, char *buf, const size_t len, const off_t off);
+
+// unaligned write with O_DIRECT cleared for the duration
+static ssize_t write_buffered(struct dio *d, const char *buf, const size_t len, const off_t off);
+
+// background thread running one transfer at a time
+static void *worker(void *arg);
+
+// hand a transfer to the worker
+static void submit(struct dio *d, char *buf, const size_t len, const off_t off);
+
+// wait for the worker; returns the result of the last transfer (-1 for a short write)
+static ssize_t await(struct dio *d);
+
+// writer: start buffering at pos, keeping the octets before it in its block
+static int writer_start(struct dio *d, const off_t pos);
+
+// writer: write everything buffered, the unaligned tail without O_DIRECT
+static int writer_flush(struct dio *d);
+
+// reader: make the window cover off
+static int reader_fill(struct dio *d, const off_t off);
+
+// flush, stop the worker, restore the fd and free the stream
+static int release(struct dio *d);
+
+int dio_open(const int fd, const int mode, const int huge, const char verbosity)
+{
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    const int flags = fcntl(fd, F_GETFL);
+    if ((flags < 0) || (!(flags & O_DIRECT) && (fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)))
+    {
+        V_PRINT(stderr, "O_DIRECT unavailable (%s); using buffered archive I/O", strerror(errno));
+        return -1;
+    }
+
+    struct dio *d = calloc(1, sizeof(struct dio));
+    if (!d)
+    {
+        fcntl(fd, F_SETFL, flags);
+        ERROR("Unable to allocate direct stream");
+    }
+    d->fd = fd;
+    d->flags = flags;
+    d->mode = mode;
+    d->direct = 1;
+    d->verbosity = verbosity;
+    d->align = DIO_ALIGN;
+    d->ra = DIO_MIN;
+    d->ahead = -1;
+    d->ctx = tar_ctx_current();
+
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align)
+    {
+        d->align = MAX(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+    }
+#endif
+
+    // mmap is page aligned, which covers the memory alignment
+    d->map_size = 2 * DIO_BUF;
+    d->map = huge ? mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) : MAP_FAILED;
+    if (d->map == MAP_FAILED)
+    {
+        if (huge)
+        {
+            V_PRINT(stderr, "No huge pages reserved; using transparent huge pages");
+        }
+
+        d->map = mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (d->map != MAP_FAILED)
+        {
+            madvise(d->map, d->map_size, MADV_HUGEPAGE);
+        }
+    }
+
+    if ((d->map == MAP_FAILED) || pthread_mutex_init(&d->lock, NULL) || pthread_cond_init(&d->cond, NULL))
+    {
+        const int rc = errno;
+        if (d->map != MAP_FAILED)
+        {
+            munmap(d->map, d->map_size);
+        }
+        fcntl(fd, F_SETFL, flags);
+        free(d);
+        ERROR("Unable to allocate direct buffers: %s", strerror(rc));
+    }
+    d->bufs[0] = d->map;
+    d->bufs[1] = d->map + DIO_BUF;
+
+    if (pthread_create(&d->thread, NULL, worker, d))
+    {
+        munmap(d->map, d->map_size);
+        fcntl(fd, F_SETFL, flags);
+        free(d);
+        ERROR("Unable to start direct I/O thread");
+    }
+
+    STATS_SYS(STATS_LSEEK);
+    const off_t pos = lseek(fd, 0, SEEK_CUR);
+    d->mode = DIO_READ; // nothing to flush until started
+    if ((pos < 0) || ((mode == DIO_WRITE) && (writer_start(d, pos) < 0)))
+    {
+        d->pos = MAX(pos, 0);
+        release(d);
+        return -1;
+    }
+    d->mode = mode;
+    d->pos = pos;
+    d->base = pos - pos % d->align;
+
+    // only the context's own thread looks streams up
+    d->next = d->ctx->dio;
+    d->ctx->dio = d;
+    return 0;
+}
+
+int dio_close(const int fd)
+{
+    for (struct dio **d = &tar_ctx_current()->dio; *d; d = &(*d)->next)
+    {
+        if ((*d)->fd == fd)
+        {
+            struct dio *found = *d;
+            *d = found->next;
+            return release(found);
+        }
+    }
+    return -1;
+}
+
+struct dio *dio_find(const int fd)
+{
+    struct dio *d = tar_ctx_current()->dio;
+    while (d && (d->fd != fd))
+    {
+        d = d->next;
+    }
+    return d;
+}
+
+int dio_read(struct dio *d, char *buf, int size)
+{
+    int got = 0;
+    while (got < size)
+    {
+        if ((d->pos < d->base) || (d->pos >= d->base + (off_t)d->len))
+        {
+            if (reader_fill(d, d->pos) < 0)
+            {
+                return got ? got : -1;
+            }
+
+            // end of file
+            if (d->pos >= d->base + (off_t)d->len)
+            {
+                break;
+            }
+        }
+
+        const size_t n = MIN((size_t)(size - got), d->base + d->len - d->pos);
+        memcpy(buf + got, d->bufs[d->cur] + (d->pos - d->base), n);
+        d->pos += n;
+        got += n;
+    }
+    STATS_BYTES(bytes_read, got);
+    return got;
+}
+
+int dio_write(struct dio *d, const char *buf, int size)
+{
+    int wrote = 0;
+    while (wrote < size)
+    {
+        const size_t n = MIN((size_t)(size - wrote), DIO_BUF - d->len);
+        memcpy(d->bufs[d->cur] + d->len, buf + wrote, n);
+        d->len += n;
+        d->pos += n;
+        wrote += n;
+
+        // full buffer: write it in the background and fill the other one
+        if (d->len == DIO_BUF)
+        {
+            if (await(d) < 0)
+            {
+                return -1;
+            }
+            submit(d, d->bufs[d->cur], DIO_BUF, d->base);
+            d->cur ^= 1;
+            d->base += DIO_BUF;
+            d->len = 0;
+        }
+    }
+    STATS_BYTES(bytes_written, wrote);
+    return wrote;
+}
+
+off_t dio_seek(struct dio *d, off_t offset, int whence)
+{
+    STATS_SYS(STATS_LSEEK);
+    off_t pos = offset;
+    if (whence == SEEK_CUR)
+    {
+        pos = d->pos + offset;
+    }
+    else if (whence == SEEK_END)
+    {
+        struct stat st;
+        if ((d->mode == DIO_WRITE) && (writer_flush(d) < 0))
+        {
+            return -1;
+        }
+        if (fstat(d->fd, &st) < 0)
+        {
+            return -1;
+        }
+        pos = st.st_size + offset;
+    }
+
+    if (pos < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((d->mode == DIO_WRITE) && (pos != d->pos))
+    {
+        if ((writer_flush(d) < 0) || (writer_start(d, pos) < 0))
+        {
+            return -1;
+        }
+    }
+    d->pos = pos;
+    return pos;
+}
+
+int dio_patch(struct dio *d, const char *buf, int size, const off_t offset)
+{
+    if ((d->mode != DIO_WRITE) || (offset < 0) || (offset + size > d->pos))
+    {
+        return -1;
+    }
+
+    // the part handed to the worker already goes to the file
+    const size_t written = (offset < d->base) ? MIN((off_t)size, d->base - offset) : 0;
+    if (written && ((await(d) < 0) || (write_buffered(d, buf, written, offset) < 0)))
+    {
+        return -1;
+    }
+
+    memcpy(d->bufs[d->cur] + (offset + written - d->base), buf + written, size - written);
+    return size;
+}
+
+ssize_t transfer(struct dio *d, char *buf, const size_t len, const off_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t rc;
+        if (d->mode == DIO_WRITE)
+        {
+            STATS_SYS(STATS_WRITE);
+            rc = pwrite(d->fd, buf + done, len - done, off + done);
+        }
+        else
+        {
+            STATS_SYS(STATS_READ);
+            rc = pread(d->fd, buf + done, len - done, off + done);
+        }
+
+        // some filesystems accept the flag but not the transfers
+        if ((rc < 0) && (errno == EINVAL) && __atomic_exchange_n(&d->direct, 0, __ATOMIC_ACQ_REL))
+        {
+            const char verbosity = d->verbosity;
+            V_PRINT(stderr, "O_DIRECT refused by the filesystem; using buffered archive I/O");
+            fcntl(d->fd, F_SETFL, d->flags);
+            continue;
+        }
+
+        if (rc < 0)
+        {
+            return -1;
+        }
+
+        // end of file (reads, or a short read past the last block)
+        if (!rc || ((d->mode != DIO_WRITE) && (done + rc < len) && ((done + rc) % d->align)))
+        {
+            done += rc;
+            break;
+        }
+        done += rc;
+    }
+    return done;
+}
+
+ssize_t write_buffered(struct dio *d, const char *buf, const size_t len, const off_t off)
+{
+    if (__atomic_load_n(&d->direct, __ATOMIC_ACQUIRE))
+    {
+        fcntl(d->fd, F_SETFL, d->flags);
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        STATS_SYS(STATS_WRITE);
+        const ssize_t rc = pwrite(d->fd, buf + done, len - done, off + done);
+        if (rc <= 0)
+        {
+            break;
+        }
+        done += rc;
+    }
+
+    if (__atomic_load_n(&d->direct, __ATOMIC_ACQUIRE))
+    {
+        fcntl(d->fd, F_SETFL, d->flags | O_DIRECT);
+    }
+    return (done == len) ? (ssize_t)done : -1;
+}
+
+void *worker(void *arg)
+{
+    struct dio *d = arg;
+    tar_ctx_use(d->ctx);
+    pthread_mutex_lock(&d->lock);
+    while (1)
+    {
+        while (!d->pending && !d->quit)
+        {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+
+        if (!d->pending)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&d->lock);
+        const ssize_t ret = transfer(d, d->job_buf, d->job_len, d->job_off);
+        pthread_mutex_lock(&d->lock);
+
+        d->job_ret = ret;
+        d->pending = 0;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+void submit(struct dio *d, char *buf, const size_t len, const off_t off)
+{
+    pthread_mutex_lock(&d->lock);
+    d->job_buf = buf;
+    d->job_len = len;
+    d->job_off = off;
+    d->job_ret = 0;
+    d->pending = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+ssize_t await(struct dio *d)
+{
+    pthread_mutex_lock(&d->lock);
+    while (d->pending)
+    {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    const ssize_t ret = d->job_ret;
+    const size_t len = d->job_len;
+    pthread_mutex_unlock(&d->lock);
+
+    // reads may stop at the end of the file, but a short write lost data
+    if ((d->mode == DIO_WRITE) && (ret >= 0) && ((size_t)ret != len))
+    {
+        errno = EIO;
+        return -1;
+    }
+    return ret;
+}
+
+int writer_start(struct dio *d, const off_t pos)
+{
+    d->base = pos - pos % d->align;
+    d->len = pos - d->base;
+    d->pos = pos;
+
+    // the block holding pos is rewritten whole, so keep what precedes pos
+    if (d->len)
+    {
+        memset(d->bufs[d->cur], 0, d->align);
+        const char mode = d->mode;
+        d->mode = DIO_READ;
+        const ssize_t got = transfer(d, d->bufs[d->cur], d->align, d->base);
+        d->mode = mode;
+        if (got < 0)
+        {
+            RC_ERROR("Unable to read archive block: %s", strerror(rc));
+        }
+    }
+    return 0;
+}
+
+int writer_flush(struct dio *d)
+{
+    if (await(d) < 0)
+    {
+        RC_ERROR("Unable to write to archive: %s", strerror(rc));
+    }
+
+    const size_t aligned = d->len - d->len % d->align;
+    if (aligned && (transfer(d, d->bufs[d->cur], aligned, d->base) != (ssize_t)aligned))
+    {
+        RC_ERROR("Unable to write to archive: %s", strerror(rc));
+    }
+
+    // the unaligned tail cannot go through O_DIRECT
+    if ((d->len > aligned) && (write_buffered(d, d->bufs[d->cur] + aligned, d->len - aligned, d->base + aligned) < 0))
+    {
+        RC_ERROR("Unable to write to archive: %s", strerror(rc));
+    }
+
+    // keep the tail block so later writes continue from it
+    if (aligned)
+    {
+        memmove(d->bufs[d->cur], d->bufs[d->cur] + aligned, d->len - aligned);
+        d->base += aligned;
+        d->len -= aligned;
+    }
+    return 0;
+}
+
+int release(struct dio *d)
+{
+    int ret = (d->mode == DIO_WRITE) ? writer_flush(d) : 0;
+    await(d);
+
+    pthread_mutex_lock(&d->lock);
+    d->quit = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    if (fcntl(d->fd, F_SETFL, d->flags) < 0)
+    {
+        ret = -1;
+    }
+    STATS_SYS(STATS_LSEEK);
+    lseek(d->fd, d->pos, SEEK_SET);
+
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    munmap(d->map, d->map_size);
+    free(d);
+    return ret;
+}
+
+int reader_fill(struct dio *d, const off_t off)
+{
+    const off_t aligned = off - off % d->align;
+    const int sequential = d->len && (aligned == d->base + (off_t)d->len);
+    ssize_t got;
+
+    if (d->ahead == aligned)
+    {
+        // the prefetched window
+        got = await(d);
+        d->cur ^= 1;
+        d->ra = MIN(d->ra * 2, DIO_BUF);
+    }
+    else
+    {
+        // discard a prefetch that went the wrong way; small windows for random access
+        await(d);
+        d->ra = sequential ? MIN(d->ra * 2, DIO_BUF) : DIO_MIN;
+        got = transfer(d, d->bufs[d->cur], d->ra, aligned);
+    }
+    d->ahead = -1;
+
+    if (got < 0)
+    {
+        d->len = 0;
+        RC_ERROR("Unable to read from archive: %s", strerror(rc));
+    }
+    d->base = aligned;
+    d->len = got;
+
+    // keep streaming while reads stay sequential
+    if ((sequential || (d->ra > DIO_MIN)) && (got == (ssize_t)d->ra))
+    {
+        const size_t next = MIN(d->ra * 2, DIO_BUF);
+        d->ahead = d->base + d->len;
+        submit(d, d->bufs[d->cur ^ 1], next, d->ahead);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+//
+// dio.h
+//
+// Direct (O_DIRECT) archive streams. While a stream is attached to an fd,
+// read_size, write_size and seek_fd on that fd under the same context go
+// through large aligned buffers that a background thread fills or drains, so
+// archive data bypasses the page cache
+//
+#ifndef __DIO__
+#define __DIO__
+
+#include <sys/types.h>
+
+#define DIO_READ 0
+#define DIO_WRITE 1
+
+struct dio;
+
+// attach a stream to fd at its current offset; returns -1 (fd untouched)
+// when O_DIRECT cannot be enabled, so callers just keep using the fd
+// huge asks for MAP_HUGETLB buffers (transparent huge pages otherwise)
+int dio_open(const int fd, const int mode, const int huge, const char verbosity);
+
+// flush, detach and leave the fd offset at the stream position
+int dio_close(const int fd);
+
+// stream attached to fd in the calling thread's context or NULL
+struct dio *dio_find(const int fd);
+
+int dio_read(struct dio *d, char *buf, int size);
+int dio_write(struct dio *d, const char *buf, int size);
+off_t dio_seek(struct dio *d, off_t offset, int whence);
+
+// writer: overwrite octets already written before the stream position
+// without moving it (in the buffer while they are still there)
+int dio_patch(struct dio *d, const char *buf, int size, const off_t offset);
+
+#endif
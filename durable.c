@@ -0,0 +1,328 @@
+//
+// durable.c
+//
+// Temp-file + renameat group commits and syncfs for crash-safe extraction
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syncfs, sync_file_range
+#endif
+
+#include "durable.h"
+#include "internal.h"
+#include "stats.h"
+
+// a file written under a temporary name
+struct pending
+{
+    int fd;
+    char *tmp;
+    char *name;
+    char done; // handed back complete; anything else is discarded at commit
+};
+
+// set of directory paths (open addressing; slots are NULL or owned strings)
+struct dir_set
+{
+    char **slots;
+    size_t mask;
+    size_t count;
+};
+
+// batch of the extraction running under a context (tar_ctx.durable)
+struct durable
+{
+    struct pending *batch;
+    size_t count;
+    struct dir_set touched; // synced; ancestors follow at the end
+    unsigned int tmp_counter;
+};
+
+// directory part of a path ("." for none)
+static char *parent_of(const char *path);
+
+// add a directory, taking ownership; returns 0 (and frees dir) when it was there
+static int dir_add(struct dir_set *set, char *dir);
+
+// release a set
+static void dir_free(struct dir_set *set);
+
+// hash of a directory path
+static size_t hash_dir(const char *dir);
+
+// fsync a directory
+static int sync_dir(const char *dir);
+
+int durable_create(const char *name, const mode_t mode)
+{
+    struct tar_ctx *ctx = tar_ctx_current();
+    const size_t size = ctx->options.durable_batch ? ctx->options.durable_batch : 1;
+    if (!ctx->durable && !(ctx->durable = calloc(1, sizeof(struct durable))))
+    {
+        return -1;
+    }
+
+    struct durable *d = ctx->durable;
+    if (!d->batch && !(d->batch = calloc(size, sizeof(struct pending))))
+    {
+        return -1;
+    }
+
+    // a file whose extraction failed was never handed back
+    if ((d->count == size) && (durable_commit() < 0))
+    {
+        return -1;
+    }
+
+    // same directory as the target so the rename cannot cross filesystems;
+    // the batch address keeps contexts of one process apart
+    const size_t len = strlen(name) + 48;
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s.wytar-%d-%lx-%u", name, (int)getpid(), (unsigned long)(uintptr_t)d, d->tmp_counter++);
+
+    STATS_SYS(STATS_OPEN);
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd < 0)
+    {
+        free(tmp);
+        return -1;
+    }
+
+    struct pending *p = &d->batch[d->count++];
+    p->fd = fd;
+    p->tmp = tmp;
+    p->name = strdup(name);
+    p->done = 0;
+    return fd;
+}
+
+int durable_done(const int fd)
+{
+    struct tar_ctx *ctx = tar_ctx_current();
+    struct durable *d = ctx->durable;
+    if (!d)
+    {
+        return 0;
+    }
+
+    if (d->count && (d->batch[d->count - 1].fd == fd))
+    {
+        d->batch[d->count - 1].done = 1;
+    }
+
+    const size_t size = ctx->options.durable_batch ? ctx->options.durable_batch : 1;
+    return (d->count >= size) ? durable_commit() : 0;
+}
+
+int durable_commit(void)
+{
+    struct durable *d = tar_ctx_current()->durable;
+    if (!d)
+    {
+        return 0;
+    }
+
+    int ret = 0;
+
+    // start writeback for the whole batch before waiting on any of it
+    for (size_t i = 0; i < d->count; i++)
+    {
+        if (d->batch[i].done)
+        {
+            sync_file_range(d->batch[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+
+    struct dir_set dirs = {NULL, 0, 0};
+    for (size_t i = 0; i < d->count; i++)
+    {
+        struct pending *p = &d->batch[i];
+        if (!p->done)
+        {
+            close(p->fd);
+            unlink(p->tmp);
+            free(p->tmp);
+            free(p->name);
+            continue;
+        }
+
+        if (fsync(p->fd) < 0)
+        {
+            tar_error("Unable to sync %s: %s", p->name, strerror(errno));
+            ret = -1;
+        }
+        close(p->fd);
+
+        if (!ret && (renameat(AT_FDCWD, p->tmp, AT_FDCWD, p->name) < 0))
+        {
+            tar_error("Unable to rename %s into place: %s", p->name, strerror(errno));
+            ret = -1;
+        }
+
+        // a failed batch leaves no temporary files behind
+        if (ret)
+        {
+            unlink(p->tmp);
+        }
+        else
+        {
+            dir_add(&dirs, parent_of(p->name));
+        }
+        free(p->tmp);
+        free(p->name);
+    }
+    d->count = 0;
+
+    // one fsync per directory makes the renames durable
+    for (size_t i = 0; dirs.slots && (i <= dirs.mask); i++)
+    {
+        if (dirs.slots[i])
+        {
+            if (sync_dir(dirs.slots[i]) < 0)
+            {
+                ret = -1;
+            }
+            dir_add(&d->touched, strdup(dirs.slots[i]));
+        }
+    }
+    dir_free(&dirs);
+    return ret;
+}
+
+int durable_finish(const char verbosity)
+{
+    struct tar_ctx *ctx = tar_ctx_current();
+    int ret = 0;
+    if (ctx->options.durability == TAR_DURABLE_SYNCFS)
+    {
+        const int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ((fd < 0) || (syncfs(fd) < 0))
+        {
+            ret = -1;
+            tar_error("syncfs failed: %s", strerror(errno));
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return ret;
+    }
+
+    struct durable *d = ctx->durable;
+    if ((ctx->options.durability != TAR_DURABLE_BATCH) || !d)
+    {
+        return 0;
+    }
+
+    ret = durable_commit();
+
+    // directories created on the way are durable once their parents are
+    // synced; every ancestor is synced once
+    struct dir_set done = {NULL, 0, 0};
+    for (size_t i = 0; d->touched.slots && (i <= d->touched.mask); i++)
+    {
+        const char *dir = d->touched.slots[i];
+        while (dir && strcmp(dir, "."))
+        {
+            char *parent = parent_of(dir);
+            const char *key = parent;
+            if (!dir_add(&done, parent))
+            {
+                break;
+            }
+
+            if (sync_dir(key) < 0)
+            {
+                ret = -1;
+            }
+            dir = key;
+        }
+    }
+
+    dir_free(&done);
+    dir_free(&d->touched);
+    free(d->batch);
+    free(d);
+    ctx->durable = NULL;
+    return ret;
+}
+
+char *parent_of(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    while (slash && (slash > path) && (slash[-1] == '/'))
+    {
+        slash--;
+    }
+    return slash ? ((slash == path) ? strdup("/") : strndup(path, slash - path)) : strdup(".");
+}
+
+int dir_add(struct dir_set *set, char *dir)
+{
+    // keep the table at most half full
+    if (2 * (set->count + 1) > (set->slots ? set->mask + 1 : 0))
+    {
+        const size_t size = set->slots ? 2 * (set->mask + 1) : 64;
+        char **slots = calloc(size, sizeof(char *));
+        for (size_t i = 0; set->slots && (i <= set->mask); i++)
+        {
+            if (set->slots[i])
+            {
+                size_t j = hash_dir(set->slots[i]) & (size - 1);
+                while (slots[j])
+                {
+                    j = (j + 1) & (size - 1);
+                }
+                slots[j] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = size - 1;
+    }
+
+    size_t i = hash_dir(dir) & set->mask;
+    for (; set->slots[i]; i = (i + 1) & set->mask)
+    {
+        if (!strcmp(set->slots[i], dir))
+        {
+            free(dir);
+            return 0;
+        }
+    }
+    set->slots[i] = dir;
+    set->count++;
+    return 1;
+}
+
+void dir_free(struct dir_set *set)
+{
+    for (size_t i = 0; set->slots && (i <= set->mask); i++)
+    {
+        free(set->slots[i]);
+    }
+    free(set->slots);
+    memset(set, 0, sizeof(struct dir_set));
+}
+
+size_t hash_dir(const char *dir)
+{
+    // FNV-1a
+    size_t h = 14695981039346656037ull;
+    for (; *dir; dir++)
+    {
+        h = (h ^ (unsigned char)*dir) * 1099511628211ull;
+    }
+    return h;
+}
+
+int sync_dir(const char *dir)
+{
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    const int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
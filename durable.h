@@ -0,0 +1,39 @@
+//
+// durable.h
+//
+// Crash safety for extraction (tar_options.durability)
+//
+// TAR_DURABLE_NONE   - files are left in the page cache; fastest, nothing
+//                      survives a crash until the kernel writes it back
+// TAR_DURABLE_SYNCFS - one syncfs() on the target filesystem after extraction;
+//                      close to full speed, everything is durable once
+//                      tar_extract returns, but a crash during extraction can
+//                      leave partially written files under their final names
+// TAR_DURABLE_BATCH  - each file is written to a temporary name in its
+//                      directory; every tar_options.durable_batch files the
+//                      batch has writeback started together, is fsync'ed,
+//                      renamed into place and each parent directory is fsync'ed
+//                      once. A file is either absent or complete after a crash,
+//                      and committed batches are durable. Costs about one
+//                      group commit per batch instead of one fsync per file
+//
+#ifndef __DURABLE__
+#define __DURABLE__
+
+#include <sys/types.h>
+
+// open a temporary file that becomes name at the next commit
+int durable_create(const char *name, const mode_t mode);
+
+// hand a file from durable_create back once its data is written
+// commits the batch when it is full
+int durable_done(const int fd);
+
+// commit the pending batch now (e.g. before a hard link to a pending file)
+int durable_commit(void);
+
+// end of an extraction: commit what is pending and make new directories
+// durable (batch), or syncfs the target (syncfs)
+int durable_finish(const char verbosity);
+
+#endif
@@ -0,0 +1,144 @@
+//
+// internal.h
+//
+// Helpers shared by the tar sources; not part of the library interface
+//
+#ifndef __TAR_INTERNAL__
+#define __TAR_INTERNAL__
+
+#include "match.h"
+#include "tar.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+// only print in verbose mode
+#define V_PRINT(f, fmt, ...)                 \
+    if (verbosity)                           \
+    {                                        \
+        fprintf(f, fmt "\n", ##__VA_ARGS__); \
+    }
+// error only reported in verbose mode, through the thread's context
+#define V_ERROR(fmt, ...)              \
+    if (verbosity)                     \
+    {                                  \
+        tar_error(fmt, ##__VA_ARGS__); \
+    }
+// generic error, reported through the thread's context
+#define ERROR(fmt, ...)                 \
+    tar_error(fmt, ##__VA_ARGS__);      \
+    return -1;
+// capture errno when erroring
+#define RC_ERROR(fmt, ...)     \
+    const int rc = errno;      \
+    ERROR(fmt, ##__VA_ARGS__); \
+    return -1;
+#define WRITE_ERROR(fmt, ...)      \
+    {                              \
+        ERROR(fmt, ##__VA_ARGS__); \
+        tar_free(*archive);        \
+        *archive = NULL;           \
+        return -1;                 \
+    }
+#define EXIST_ERROR(fmt, ...)      \
+    const int rc = errno;          \
+    if (rc != EEXIST)              \
+    {                              \
+        ERROR(fmt, ##__VA_ARGS__); \
+        return -1;                 \
+    }
+
+// error messages kept by a worker context (the longest tar_error formats)
+#define CTX_ERRBUF 1024
+
+// set up the context of a worker thread of the operation running under parent:
+// its options, error callback, stats and trace, but operation state of its own
+// errbuf (CTX_ERRBUF octets, or NULL) holds the worker's errors until ctx_join
+void ctx_inherit(struct tar_ctx *worker, const struct tar_ctx *parent, char *errbuf);
+
+// after the worker is joined, hand its last error to the parent's errbuf
+void ctx_join(struct tar_ctx *parent, const struct tar_ctx *worker);
+
+// force read() to complete
+int read_size(int fd, char *buf, int size);
+
+// force write() to complete
+int write_size(int fd, char *buf, int size);
+
+// pwrite() over octets already written, without moving the offset
+int patch_size(int fd, char *buf, int size, const off_t offset);
+
+// lseek() with accounting
+off_t seek_fd(int fd, off_t offset, int whence);
+
+// convert octal string to unsigned integer
+unsigned int oct2uint(char *oct, unsigned int size);
+
+// convert octal string (or a base-256 field) to a 64 bit size
+off_t oct2size(const char *oct, unsigned int size);
+
+// fill a 12 octet size field: octal below 8 GiB, base-256 from there
+void format_size(char *field, const off_t size);
+
+// whether the checksum field of a raw header block matches its contents
+int header_checksum_ok(const char *block);
+
+// check if a buffer is zeroed
+int iszeroed(char *buf, size_t size);
+
+// zero padding up to the next block boundary
+int write_padding(int fd, const off_t size);
+
+// fill in a header from caller supplied metadata
+int format_tar_member(struct tar_t *entry, const struct tar_member *member, const off_t size);
+
+// directory entry read ahead of traversal
+struct walk_entry
+{
+    char *name;
+    ino_t ino;
+    unsigned long long physical; // first extent on disk (TAR_SORT_EXTENT); ~0 when unknown
+    unsigned char type;          // DT_* from readdir
+};
+
+// every entry of a directory except . and .., in tar_options.sort order
+// NULL when the directory cannot be read
+struct walk_entry *walk_list(const char *path, size_t *count, const char verbosity);
+
+// release a walk_list result
+void walk_list_free(struct walk_entry *entries, const size_t count);
+
+// directory being walked
+struct walk_dir
+{
+    struct walk_entry *entries;
+    size_t count;
+    size_t next;
+    char *path;
+};
+
+// yields paths in the same order as the write_entries recursion
+struct walker
+{
+    const char **files;
+    size_t filecount;
+    size_t next;
+    struct walk_dir *stack;
+    size_t depth;
+    size_t cap;
+    char failed; // a directory could not be opened
+};
+
+// next path in traversal order (caller frees); NULL when done
+// type gets the DT_* kind of the path (DT_UNKNOWN when it could not be stat'ed)
+char *walk_next(struct walker *w, unsigned char *type, const char verbosity);
+
+// release walker state
+void walk_free(struct walker *w);
+
+// whether an entry passes the member names and tar_options.match
+int select_entry(const struct tar_match *names, const struct tar_t *entry);
+
+// make directory recursively
+int recursive_mkdir(const char *dir, const unsigned int mode, const char verbosity);
+
+#endif
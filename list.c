@@ -0,0 +1,464 @@
+//
+// list.c
+//
+// Member listing in text, NDJSON and CSV
+//
+#include <sys/mman.h>
+
+#include "internal.h"
+#include "list.h"
+#include "stats.h"
+#include "verify.h"
+
+#define LIST_ENTRY_MAX (64 << 10) // room kept free for one line (escaped names grow up to 6x)
+#define LIST_NAME_MAX 4096        // longest GNU long name kept
+
+// formatted output waiting for write()
+struct list_out
+{
+    int fd;
+    char *buf;
+    size_t used;
+    enum tar_list_format format;
+    char verbosity;
+    time_t minute;  // minute of the cached date; -1 when none
+    char date[17];  // "YYYY-MM-DD HH:MM"
+};
+
+// long names from GNU 'L'/'K' records, for the member after them
+struct list_names
+{
+    char name[LIST_NAME_MAX];
+    char link[LIST_NAME_MAX];
+    char has_name;
+    char has_link;
+};
+
+// write the buffer out
+static int flush_out(struct list_out *o);
+
+// append octets, a string, an unsigned number or zero padded digits
+static void put(struct list_out *o, const char *str, const size_t len);
+static void put_str(struct list_out *o, const char *str);
+static void put_u64(struct list_out *o, unsigned long long value);
+static void put_digits(char *dst, unsigned int value, int width);
+
+// append a string quoted for the output format
+static void put_quoted(struct list_out *o, const char *str, const size_t len);
+
+// format one member
+static int list_entry(struct list_out *o, const struct tar_t *entry, const char *name, const char *link);
+
+// whether a header is a record for the member after it; keeps long names
+static int take_record(const struct tar_t *entry, const char *data, const size_t size, struct list_names *names);
+
+// full member name: long name, or ustar prefix and name
+static void entry_name(const struct tar_t *entry, const struct list_names *names, char *name);
+
+// scan headers in a mapping of fd
+static int list_mapped(struct list_out *o, const char *base, const size_t len, off_t offset, const struct tar_match *names);
+
+// scan headers with a streaming read
+static int list_stream(struct list_out *o, const int fd, const struct tar_match *names);
+
+int tar_list(const int out, const int fd, const size_t filecount, const char *files[], const enum tar_list_format format, const char verbosity)
+{
+    STATS_PHASE(PHASE_READ);
+
+    if ((fd < 0) || (out < 0))
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    struct tar_match *names = tar_match_names(filecount, files);
+    if (filecount && !names)
+    {
+        ERROR("Unable to compile member names");
+    }
+
+    struct list_out o = {out, malloc(LIST_BUFFER), 0, format, verbosity, -1, {0}};
+    if (!o.buf)
+    {
+        tar_match_free(names);
+        ERROR("Unable to allocate list buffer");
+    }
+
+    if (format == TAR_LIST_CSV)
+    {
+        put_str(&o, "name,type,mode,uid,gid,owner,group,size,mtime,link,offset\n");
+    }
+
+    // regular files are mapped; anything else (pipes, failed maps) is streamed
+    struct stat st;
+    const off_t start = seek_fd(fd, 0, SEEK_CUR);
+    void *map = MAP_FAILED;
+    STATS_SYS(STATS_STAT);
+    if ((start >= 0) && !fstat(fd, &st) && S_ISREG(st.st_mode) && (st.st_size > start))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    int ret;
+    if (map != MAP_FAILED)
+    {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        ret = list_mapped(&o, map, st.st_size, start, names);
+        munmap(map, st.st_size);
+    }
+    else
+    {
+        ret = list_stream(&o, fd, names);
+    }
+
+    if (flush_out(&o) < 0)
+    {
+        ret = -1;
+    }
+    free(o.buf);
+    tar_match_free(names);
+    return ret;
+}
+
+int flush_out(struct list_out *o)
+{
+    if (o->used && (write_size(o->fd, o->buf, o->used) != (int)o->used))
+    {
+        o->used = 0;
+        RC_ERROR("Unable to write listing: %s", strerror(rc));
+    }
+    o->used = 0;
+    return 0;
+}
+
+void put(struct list_out *o, const char *str, const size_t len)
+{
+    memcpy(o->buf + o->used, str, len);
+    o->used += len;
+}
+
+void put_str(struct list_out *o, const char *str)
+{
+    put(o, str, strlen(str));
+}
+
+void put_u64(struct list_out *o, unsigned long long value)
+{
+    char digits[20];
+    int i = sizeof(digits);
+    do
+    {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    put(o, digits + i, sizeof(digits) - i);
+}
+
+void put_digits(char *dst, unsigned int value, int width)
+{
+    while (width--)
+    {
+        dst[width] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+void put_quoted(struct list_out *o, const char *str, const size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *dst = o->buf + o->used;
+    *dst++ = '"';
+    for (size_t i = 0; i < len; i++)
+    {
+        const unsigned char c = str[i];
+        if (o->format == TAR_LIST_CSV)
+        {
+            // quotes are doubled; everything else is literal inside quotes
+            if (c == '"')
+            {
+                *dst++ = '"';
+            }
+            *dst++ = c;
+        }
+        else if ((c == '"') || (c == '\\'))
+        {
+            *dst++ = '\\';
+            *dst++ = c;
+        }
+        else if (c < 0x20)
+        {
+            memcpy(dst, "\\u00", 4);
+            dst[4] = hex[c >> 4];
+            dst[5] = hex[c & 15];
+            dst += 6;
+        }
+        else
+        {
+            // other octets pass through; names are not necessarily UTF-8
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+    o->used = dst - o->buf;
+}
+
+int list_entry(struct list_out *o, const struct tar_t *entry, const char *name, const char *link)
+{
+    if ((LIST_BUFFER - o->used < LIST_ENTRY_MAX) && (flush_out(o) < 0))
+    {
+        return -1;
+    }
+
+    const char type = entry->type ? entry->type : NORMAL;
+    const char *link_to = ((type == HARDLINK) || (type == SYMLINK)) ? link : "";
+    const off_t size = oct2size(entry->size, 11);
+    const time_t mtime = oct2size(entry->mtime, 11);
+
+    // owner and group fill all 32 octets without a terminator
+    char owner[33] = {0}, group[33] = {0};
+    memcpy(owner, entry->owner, 32);
+    memcpy(group, entry->group, 32);
+
+    if (o->format != TAR_LIST_TEXT)
+    {
+        static const char *type_names[] = {"file", "hardlink", "symlink", "char", "block", "directory", "fifo", "file"};
+        const char *kind = ((type >= '0') && (type <= '7')) ? type_names[type - '0'] : "other";
+        const unsigned int mode = oct2uint((char *)entry->mode, 7) & 07777;
+        char mode_str[5];
+        put_digits(mode_str, ((mode >> 9) & 7) * 1000 + ((mode >> 6) & 7) * 100 + ((mode >> 3) & 7) * 10 + (mode & 7), 4);
+
+        const int json = (o->format == TAR_LIST_NDJSON);
+        put_str(o, json ? "{\"name\":" : "");
+        put_quoted(o, name, strlen(name));
+        put_str(o, json ? ",\"type\":\"" : ",");
+        put_str(o, kind);
+        put_str(o, json ? "\",\"mode\":\"" : ",");
+        put(o, mode_str, 4);
+        put_str(o, json ? "\",\"uid\":" : ",");
+        put_u64(o, oct2size(entry->uid, 7));
+        put_str(o, json ? ",\"gid\":" : ",");
+        put_u64(o, oct2size(entry->gid, 7));
+        put_str(o, json ? ",\"owner\":" : ",");
+        put_quoted(o, owner, strlen(owner));
+        put_str(o, json ? ",\"group\":" : ",");
+        put_quoted(o, group, strlen(group));
+        put_str(o, json ? ",\"size\":" : ",");
+        put_u64(o, size);
+        put_str(o, json ? ",\"mtime\":" : ",");
+        put_u64(o, (mtime < 0) ? 0 : mtime);
+        put_str(o, json ? ",\"link\":" : ",");
+        put_quoted(o, link_to, strlen(link_to));
+        put_str(o, json ? ",\"offset\":" : ",");
+        put_u64(o, entry->begin);
+        put_str(o, json ? "}\n" : "\n");
+        return 0;
+    }
+
+    if (o->verbosity)
+    {
+        const mode_t mode = oct2uint((char *)entry->mode, 7);
+        const char line[11] = {((type >= '0') && (type <= '7')) ? "-hlcbdp-"[type - '0'] : '-',
+                               mode & S_IRUSR ? 'r' : '-',
+                               mode & S_IWUSR ? 'w' : '-',
+                               mode & S_IXUSR ? 'x' : '-',
+                               mode & S_IRGRP ? 'r' : '-',
+                               mode & S_IWGRP ? 'w' : '-',
+                               mode & S_IXGRP ? 'x' : '-',
+                               mode & S_IROTH ? 'r' : '-',
+                               mode & S_IWOTH ? 'w' : '-',
+                               mode & S_IXOTH ? 'x' : '-',
+                               ' '};
+        put(o, line, sizeof(line));
+        put_str(o, owner);
+        put(o, "/", 1);
+        put_str(o, group);
+        put(o, " ", 1);
+
+        if ((type == CHAR) || (type == BLOCK))
+        {
+            put_u64(o, oct2uint((char *)entry->major, 7));
+            put(o, ",", 1);
+            put_u64(o, oct2uint((char *)entry->minor, 7));
+        }
+        else
+        {
+            put_u64(o, size);
+        }
+
+        // archives mostly hold files written within the same minutes
+        const time_t minute = (mtime >= 0) ? mtime / 60 : -1;
+        if ((minute < 0) || (minute != o->minute))
+        {
+            struct tm tm;
+            localtime_r(&mtime, &tm);
+            put_digits(o->date, tm.tm_year + 1900, 4);
+            o->date[4] = '-';
+            put_digits(o->date + 5, tm.tm_mon + 1, 2);
+            o->date[7] = '-';
+            put_digits(o->date + 8, tm.tm_mday, 2);
+            o->date[10] = ' ';
+            put_digits(o->date + 11, tm.tm_hour, 2);
+            o->date[13] = ':';
+            put_digits(o->date + 14, tm.tm_min, 2);
+            o->date[16] = ' ';
+            o->minute = minute;
+        }
+        put(o, " ", 1);
+        put(o, o->date, sizeof(o->date));
+    }
+
+    put_str(o, name);
+    if (o->verbosity && (type == HARDLINK))
+    {
+        put_str(o, " link to ");
+        put_str(o, link);
+    }
+    else if (o->verbosity && (type == SYMLINK))
+    {
+        put_str(o, " -> ");
+        put_str(o, link);
+    }
+    put(o, "\n", 1);
+    return 0;
+}
+
+int take_record(const struct tar_t *entry, const char *data, const size_t size, struct list_names *names)
+{
+    if ((entry->type != 'L') && (entry->type != 'K'))
+    {
+        // PAX headers are skipped as elsewhere
+        return (entry->type == PAX_HEADER) || (entry->type == 'g');
+    }
+
+    char *dst = (entry->type == 'L') ? names->name : names->link;
+    const size_t len = data ? MIN(size, (size_t)LIST_NAME_MAX - 1) : 0;
+    memcpy(dst, data, len);
+    dst[len] = '\0';
+    *((entry->type == 'L') ? &names->has_name : &names->has_link) = (data != NULL);
+    return 1;
+}
+
+void entry_name(const struct tar_t *entry, const struct list_names *names, char *name)
+{
+    if (names->has_name)
+    {
+        strcpy(name, names->name);
+    }
+    else if (!memcmp(entry->ustar, "ustar\0", 6) && entry->prefix[0])
+    {
+        snprintf(name, LIST_NAME_MAX, "%.155s/%.100s", entry->prefix, entry->name);
+    }
+    else
+    {
+        snprintf(name, LIST_NAME_MAX, "%.100s", entry->name);
+    }
+}
+
+int list_mapped(struct list_out *o, const char *base, const size_t len, off_t offset, const struct tar_match *names)
+{
+    struct list_names records = {{0}, {0}, 0, 0};
+    struct tar_t entry;
+    char name[LIST_NAME_MAX], link[LIST_NAME_MAX];
+    while ((size_t)offset + 512 <= len)
+    {
+        const char *header = base + offset;
+        if (iszeroed((char *)header, 512))
+        {
+            // a zeroed block followed by another one (or nothing) ends the archive
+            if (((size_t)offset + 1024 > len) || iszeroed((char *)header + 512, 512))
+            {
+                return 0;
+            }
+            offset += 512;
+            continue;
+        }
+
+        if (!header_checksum_ok(header))
+        {
+            ERROR("Bad header checksum at offset %lld", (long long)offset);
+        }
+
+        memcpy(entry.block, header, 512);
+        entry.begin = offset;
+        const off_t size = oct2size(entry.size, 11);
+        const char *data = header + 512;
+        offset += 512 + (size + 511) / 512 * 512;
+        const int truncated = ((size_t)offset > len);
+        if (truncated)
+        {
+            tar_error("Archive ended inside entry data");
+            offset = len;
+        }
+
+        if (take_record(&entry, truncated ? NULL : data, size, &records))
+        {
+            continue;
+        }
+
+        entry_name(&entry, &records, name);
+        snprintf(link, sizeof(link), "%s", records.has_link ? records.link : "");
+        if (!records.has_link)
+        {
+            memcpy(link, entry.link_name, 100);
+            link[100] = '\0';
+        }
+        records.has_name = records.has_link = 0;
+
+        if (tar_match_test(names, name) && tar_match_test(tar_ctx_current()->options.match, name) && (list_entry(o, &entry, name, link) < 0))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int list_stream(struct list_out *o, const int fd, const struct tar_match *names)
+{
+    struct tar_iter it;
+    if (tar_iter_open(&it, fd, o->verbosity) < 0)
+    {
+        return -1;
+    }
+
+    struct list_names records = {{0}, {0}, 0, 0};
+    char name[LIST_NAME_MAX], link[LIST_NAME_MAX];
+    struct tar_t *entry;
+    int got, ret = 0;
+    while (!ret && ((got = tar_iter_next(&it, &entry)) > 0))
+    {
+        // long names are read whole; their headers say how long they are
+        if ((entry->type == 'L') || (entry->type == 'K'))
+        {
+            const size_t want = MIN(it.remaining, (off_t)LIST_NAME_MAX - 1);
+            ret = (tar_iter_read(&it, name, want) == (ssize_t)want) ? 0 : -1;
+            take_record(entry, name, want, &records);
+            continue;
+        }
+
+        if (take_record(entry, NULL, 0, &records))
+        {
+            continue;
+        }
+
+        entry_name(entry, &records, name);
+        snprintf(link, sizeof(link), "%s", records.has_link ? records.link : "");
+        if (!records.has_link)
+        {
+            memcpy(link, entry->link_name, 100);
+            link[100] = '\0';
+        }
+        records.has_name = records.has_link = 0;
+
+        if (tar_match_test(names, name) && tar_match_test(tar_ctx_current()->options.match, name))
+        {
+            ret = list_entry(o, entry, name, link);
+        }
+    }
+
+    tar_iter_close(&it);
+    return ((got < 0) || ret) ? -1 : 0;
+}
@@ -0,0 +1,27 @@
+//
+// list.h
+//
+// Fast member listing. Headers are scanned in place through a read-only
+// mapping (streamed for pipes), lines are formatted by hand into a large
+// buffer flushed with write(), and the local time of the last minute seen is
+// reused, so listing costs about as much as walking the headers
+//
+#ifndef __LIST__
+#define __LIST__
+
+#include "tar.h"
+
+#define LIST_BUFFER (1 << 20) // octets formatted before each write
+
+enum tar_list_format
+{
+    TAR_LIST_TEXT,   // names; with verbosity, mode owner/group size date time name
+    TAR_LIST_NDJSON, // one JSON object per line
+    TAR_LIST_CSV     // header row, then one row per member (RFC 4180 quoting)
+};
+
+// write the members of the archive on fd, from its current offset, to out
+// members are selected by exact names (none: all) and tar_options.match
+TAR_API int tar_list(const int out, const int fd, const size_t filecount, const char *files[], const enum tar_list_format format, const char verbosity);
+
+#endif
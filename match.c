@@ -0,0 +1,510 @@
+//
+// match.c
+//
+// Include/exclude pattern matcher for member selection and create excludes
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // getline
+#endif
+
+#include <stdint.h>
+
+#include "internal.h"
+#include "match.h"
+
+#define GLOB_TOKENS 63 // one bit per token plus the accept state
+
+// byte trie node (first child / next sibling)
+struct trie_node
+{
+    char c;
+    char end; // a pattern ends here
+    struct trie_node *child;
+    struct trie_node *sibling;
+};
+
+// glob compiled to a Shift-And automaton: bit i set means i tokens matched
+struct glob
+{
+    uint64_t accept[256]; // tokens that consume each octet
+    uint64_t star;        // tokens that are '*'
+    uint64_t final;       // accept state
+    char component;       // match path components instead of the whole name
+};
+
+struct pattern_set
+{
+    struct trie_node paths;      // literal names anchored at the start
+    struct trie_node components; // literal names matching any component
+    struct glob *globs;
+    size_t globcount;
+    size_t count; // patterns added
+};
+
+struct tar_match
+{
+    struct pattern_set include;
+    struct pattern_set exclude;
+};
+
+// skip "./" and '/' at the start of a name
+static const char *skip_leading(const char *name);
+
+// add a literal to a trie
+static int trie_insert(struct trie_node *root, const char *str, const size_t len);
+
+// whether the trie holds name or a directory prefix of it
+static int trie_prefix(const struct trie_node *root, const char *name);
+
+// whether the trie holds exactly [str, str + len)
+static int trie_exact(const struct trie_node *root, const char *str, const size_t len);
+
+// release trie nodes below root
+static void trie_free(struct trie_node *root);
+
+// compile a glob; -1 when it does not fit the automaton
+static int glob_compile(struct glob *g, const char *pattern, const size_t len);
+
+// run a compiled glob over a name
+static int glob_test(const struct glob *g, const char *name);
+
+// whether any pattern of a set matches
+static int set_test(const struct pattern_set *set, const char *name);
+
+// add a normalized pattern to a set
+static int set_add(struct pattern_set *set, const char *pattern, const size_t len, const int component);
+
+struct tar_match *tar_match_new(void)
+{
+    return calloc(1, sizeof(struct tar_match));
+}
+
+int tar_match_add(struct tar_match *m, const char *pattern, const int exclude)
+{
+    if (!m || !pattern)
+    {
+        ERROR("Bad matcher");
+    }
+
+    // "./dir/" and "dir" are the same pattern
+    pattern = skip_leading(pattern);
+    size_t len = strlen(pattern);
+    while (len && (pattern[len - 1] == '/'))
+    {
+        len--;
+    }
+
+    if (!len)
+    {
+        ERROR("Empty pattern");
+    }
+
+    const int component = exclude && !memchr(pattern, '/', len);
+    if (set_add(exclude ? &m->exclude : &m->include, pattern, len, component) < 0)
+    {
+        ERROR("Pattern too long: %.*s", (int)len, pattern);
+    }
+    return 0;
+}
+
+int tar_match_add_file(struct tar_match *m, const char *filename, const int exclude)
+{
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!f)
+    {
+        RC_ERROR("Unable to open %s: %s", filename, strerror(rc));
+    }
+
+    int ret = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) >= 0)
+    {
+        while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+        {
+            line[--len] = '\0';
+        }
+
+        if (len && (tar_match_add(m, line, exclude) < 0))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+    return ret;
+}
+
+struct tar_match *tar_match_names(const size_t filecount, const char *files[])
+{
+    if (!filecount || !files)
+    {
+        return NULL;
+    }
+
+    struct tar_match *m = tar_match_new();
+    if (!m)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < filecount; i++)
+    {
+        const char *name = skip_leading(files[i]);
+        size_t len = strlen(name);
+        while (len && (name[len - 1] == '/'))
+        {
+            len--;
+        }
+
+        // names that do not compile are still selected literally
+        if (len && (set_add(&m->include, name, len, 0) < 0))
+        {
+            trie_insert(&m->include.paths, name, len);
+            m->include.count++;
+        }
+    }
+
+    // every name was empty; select nothing rather than everything
+    if (!m->include.count)
+    {
+        trie_insert(&m->include.paths, "\0", 1);
+        m->include.count++;
+    }
+    return m;
+}
+
+int tar_match_test(const struct tar_match *m, const char *name)
+{
+    if (!m)
+    {
+        return 1;
+    }
+
+    name = skip_leading(name);
+    if (m->include.count && !set_test(&m->include, name))
+    {
+        return 0;
+    }
+    return !m->exclude.count || !set_test(&m->exclude, name);
+}
+
+int tar_match_excluded(const struct tar_match *m, const char *path)
+{
+    return m && m->exclude.count && set_test(&m->exclude, skip_leading(path));
+}
+
+void tar_match_free(struct tar_match *m)
+{
+    if (!m)
+    {
+        return;
+    }
+
+    struct pattern_set *sets[] = {&m->include, &m->exclude};
+    for (int i = 0; i < 2; i++)
+    {
+        trie_free(&sets[i]->paths);
+        trie_free(&sets[i]->components);
+        free(sets[i]->globs);
+    }
+    free(m);
+}
+
+const char *skip_leading(const char *name)
+{
+    while (1)
+    {
+        if (name[0] == '/')
+        {
+            name++;
+        }
+        else if ((name[0] == '.') && (name[1] == '/'))
+        {
+            name += 2;
+        }
+        else
+        {
+            return name;
+        }
+    }
+}
+
+int trie_insert(struct trie_node *root, const char *str, const size_t len)
+{
+    struct trie_node *node = root;
+    for (size_t i = 0; i < len; i++)
+    {
+        struct trie_node **link = &node->child;
+        while (*link && ((*link)->c != str[i]))
+        {
+            link = &(*link)->sibling;
+        }
+
+        if (!*link)
+        {
+            if (!(*link = calloc(1, sizeof(struct trie_node))))
+            {
+                return -1;
+            }
+            (*link)->c = str[i];
+        }
+        node = *link;
+    }
+    node->end = 1;
+    return 0;
+}
+
+int trie_prefix(const struct trie_node *root, const char *name)
+{
+    const struct trie_node *node = root;
+    for (size_t i = 0;; i++)
+    {
+        // a pattern that ends on a component boundary covers the rest
+        if (node->end && ((name[i] == '/') || (name[i] == '\0')))
+        {
+            return 1;
+        }
+
+        if (!name[i])
+        {
+            return 0;
+        }
+
+        for (node = node->child; node && (node->c != name[i]); node = node->sibling)
+            ;
+
+        if (!node)
+        {
+            return 0;
+        }
+    }
+}
+
+int trie_exact(const struct trie_node *root, const char *str, const size_t len)
+{
+    const struct trie_node *node = root;
+    for (size_t i = 0; node && (i < len); i++)
+    {
+        for (node = node->child; node && (node->c != str[i]); node = node->sibling)
+            ;
+    }
+    return node && node->end;
+}
+
+void trie_free(struct trie_node *root)
+{
+    struct trie_node *node = root->child;
+    while (node)
+    {
+        struct trie_node *next = node->sibling;
+        trie_free(node);
+        free(node);
+        node = next;
+    }
+    root->child = NULL;
+}
+
+int glob_compile(struct glob *g, const char *pattern, const size_t len)
+{
+    memset(g, 0, sizeof(struct glob));
+
+    int n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        // repeated stars are one token
+        if ((pattern[i] == '*') && n && (g->star & (1ull << (n - 1))))
+        {
+            continue;
+        }
+
+        if (n == GLOB_TOKENS)
+        {
+            return -1;
+        }
+
+        const uint64_t bit = 1ull << n++;
+        if (pattern[i] == '*')
+        {
+            g->star |= bit;
+            for (int c = 0; c < 256; c++)
+            {
+                g->accept[c] |= bit;
+            }
+        }
+        else if (pattern[i] == '?')
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                g->accept[c] |= bit;
+            }
+        }
+        else if ((pattern[i] == '[') && memchr(pattern + i + 1, ']', len - i - 1))
+        {
+            // bracket expression: [abc], [a-z], [!x] or [^x]; a leading ']' is literal
+            size_t j = i + 1;
+            const int negate = (pattern[j] == '!') || (pattern[j] == '^');
+            j += negate;
+            char set[256] = {0};
+            for (size_t first = j; (j < len) && ((pattern[j] != ']') || (j == first)); j++)
+            {
+                const unsigned char lo = pattern[j];
+                if ((j + 2 < len) && (pattern[j + 1] == '-') && (pattern[j + 2] != ']'))
+                {
+                    for (int c = lo; c <= (unsigned char)pattern[j + 2]; c++)
+                    {
+                        set[c] = 1;
+                    }
+                    j += 2;
+                }
+                else
+                {
+                    set[lo] = 1;
+                }
+            }
+
+            if (j == len)
+            {
+                // "[]" or "[!]" with no closing bracket after it; take '[' literally
+                g->accept['['] |= bit;
+                continue;
+            }
+
+            for (int c = 0; c < 256; c++)
+            {
+                if (set[c] != negate)
+                {
+                    g->accept[c] |= bit;
+                }
+            }
+            i = j;
+        }
+        else
+        {
+            // a backslash quotes the next octet
+            if ((pattern[i] == '\\') && (i + 1 < len))
+            {
+                i++;
+            }
+            g->accept[(unsigned char)pattern[i]] |= bit;
+        }
+    }
+
+    g->final = 1ull << n;
+    return 0;
+}
+
+int glob_test(const struct glob *g, const char *name)
+{
+    // a star may match nothing, so its state also enables the next token
+    const uint64_t start = 1 | ((1 & g->star) << 1);
+    uint64_t state = start;
+    size_t comp_len = 0;
+    for (const unsigned char *c = (const unsigned char *)name;; c++)
+    {
+        if ((*c == '/') || !*c)
+        {
+            // whole names: a match up to a '/' selects a directory and its contents
+            if ((state & g->final) && (!g->component || comp_len))
+            {
+                return 1;
+            }
+
+            if (!*c)
+            {
+                return 0;
+            }
+
+            if (g->component)
+            {
+                state = start;
+                comp_len = 0;
+                continue;
+            }
+        }
+
+        const uint64_t step = state & g->accept[*c];
+        state = ((step & ~g->star) << 1) | (step & g->star);
+        state |= (state & g->star) << 1;
+        comp_len++;
+
+        if (!state && !g->component)
+        {
+            return 0;
+        }
+    }
+}
+
+int set_test(const struct pattern_set *set, const char *name)
+{
+    if (trie_prefix(&set->paths, name))
+    {
+        return 1;
+    }
+
+    if (set->components.child)
+    {
+        for (const char *comp = name; *comp;)
+        {
+            const char *slash = strchr(comp, '/');
+            const size_t len = slash ? (size_t)(slash - comp) : strlen(comp);
+            if (len && trie_exact(&set->components, comp, len))
+            {
+                return 1;
+            }
+            comp += len + !!slash;
+        }
+    }
+
+    for (size_t i = 0; i < set->globcount; i++)
+    {
+        if (glob_test(&set->globs[i], name))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int set_add(struct pattern_set *set, const char *pattern, const size_t len, const int component)
+{
+    // plain names go into a trie; anything with glob syntax gets an automaton
+    const char *c = pattern;
+    while ((c < pattern + len) && !strchr("*?[\\", *c))
+    {
+        c++;
+    }
+
+    if (c == pattern + len)
+    {
+        if (trie_insert(component ? &set->components : &set->paths, pattern, len) < 0)
+        {
+            return -1;
+        }
+        set->count++;
+        return 0;
+    }
+
+    struct glob g;
+    if (glob_compile(&g, pattern, len) < 0)
+    {
+        return -1;
+    }
+    g.component = component;
+
+    struct glob *globs = realloc(set->globs, (set->globcount + 1) * sizeof(struct glob));
+    if (!globs)
+    {
+        return -1;
+    }
+    set->globs = globs;
+    set->globs[set->globcount++] = g;
+    set->count++;
+    return 0;
+}
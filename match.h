@@ -0,0 +1,40 @@
+//
+// match.h
+//
+// Member selection: include/exclude patterns compiled once into prefix tries
+// (literal names) and bit-parallel automata (globs with * ? [...])
+//
+#ifndef __MATCH__
+#define __MATCH__
+
+#include <stddef.h>
+
+#include "tar.h"
+
+struct tar_match;
+
+// empty matcher (selects everything)
+TAR_API struct tar_match *tar_match_new(void);
+
+// add a pattern
+// includes are anchored at the start of the member name; excludes without a
+// '/' match any path component, as with GNU tar
+// a pattern naming a directory also covers everything below it
+TAR_API int tar_match_add(struct tar_match *m, const char *pattern, const int exclude);
+
+// add one pattern per line from a file ("-" for stdin)
+TAR_API int tar_match_add_file(struct tar_match *m, const char *filename, const int exclude);
+
+// matcher with the given member names as includes; NULL when filecount is 0
+TAR_API struct tar_match *tar_match_names(const size_t filecount, const char *files[]);
+
+// whether a member name is selected (a NULL matcher selects everything)
+TAR_API int tar_match_test(const struct tar_match *m, const char *name);
+
+// whether a source path is excluded; used to prune the create walk
+TAR_API int tar_match_excluded(const struct tar_match *m, const char *path);
+
+// release a matcher
+TAR_API void tar_match_free(struct tar_match *m);
+
+#endif
@@ -0,0 +1,277 @@
+//
+// memtar.c
+//
+// Archive index over a memory span with zero-copy member views
+//
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "internal.h"
+#include "memtar.h"
+#include "verify.h"
+
+// location of a header field inside a raw 512 octet block
+#define FIELD(header, field) ((header) + offsetof(struct tar_t, field) - offsetof(struct tar_t, block))
+
+// FNV-1a over a member name
+static uint32_t hash_name(const char *name, const size_t len);
+
+// add an entry to the open addressing table
+static void index_entry(struct tar_mem *m, const size_t i);
+
+int tar_mem_open(struct tar_mem *m, const void *base, const size_t len, const char verbosity)
+{
+    if (!m || (len && !base))
+    {
+        ERROR("Bad memory archive");
+    }
+
+    memset(m, 0, sizeof(struct tar_mem));
+    m->base = base;
+    m->len = len;
+
+    size_t cap = 0;
+    size_t offset = 0;
+    while (offset + 512 <= len)
+    {
+        const char *header = m->base + offset;
+
+        // two zeroed blocks end the archive; a single one is skipped like tar_read does
+        if (iszeroed((char *)header, 512))
+        {
+            if ((offset + 1024 > len) || iszeroed((char *)header + 512, 512))
+            {
+                break;
+            }
+            offset += 512;
+            continue;
+        }
+
+        if (!header_checksum_ok(header))
+        {
+            tar_error("Bad header checksum at offset %zu", offset);
+            tar_mem_close(m);
+            return -1;
+        }
+
+        const size_t size = oct2size(FIELD(header, size), 11);
+        if (size > len - offset - 512)
+        {
+            tar_error("Member at offset %zu runs past the end of the span", offset);
+            tar_mem_close(m);
+            return -1;
+        }
+
+        // extension records describe the next member and are not members themselves
+        if (PAX_EXTENSION(*FIELD(header, type)))
+        {
+            offset += 512 + size + (512 - size % 512) % 512;
+            continue;
+        }
+
+        if (m->count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            struct tar_mem_entry *entries = realloc(m->entries, cap * sizeof(struct tar_mem_entry));
+            if (!entries)
+            {
+                tar_mem_close(m);
+                ERROR("Unable to allocate index");
+            }
+            m->entries = entries;
+        }
+
+        struct tar_mem_entry *entry = &m->entries[m->count++];
+        entry->header = header;
+        entry->name = FIELD(header, name);
+        entry->name_len = strnlen(entry->name, 100);
+        entry->data = header + 512;
+        entry->size = size;
+        entry->mode = oct2size(FIELD(header, mode), 7);
+        entry->mtime = oct2size(FIELD(header, mtime), 11);
+        entry->type = *FIELD(header, type);
+        entry->hash = hash_name(entry->name, entry->name_len);
+
+        offset += 512 + size + (512 - size % 512) % 512;
+    }
+
+    // size the table to at most half full
+    size_t slots = 16;
+    while (slots < m->count * 2)
+    {
+        slots <<= 1;
+    }
+    m->table = calloc(slots, sizeof(uint32_t));
+    if (!m->table)
+    {
+        tar_mem_close(m);
+        ERROR("Unable to allocate index");
+    }
+    m->mask = slots - 1;
+
+    for (size_t i = 0; i < m->count; i++)
+    {
+        index_entry(m, i);
+    }
+
+    return m->count;
+}
+
+int tar_mem_map(struct tar_mem *m, const char *filename, const char verbosity)
+{
+    if (!m || !filename)
+    {
+        ERROR("Bad memory archive");
+    }
+
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        RC_ERROR("Unable to open %s: %s", filename, strerror(rc));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        const int rc = errno;
+        close(fd);
+        ERROR("Unable to stat %s: %s", filename, strerror(rc));
+    }
+
+    void *map = NULL;
+    if (st.st_size)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            const int rc = errno;
+            close(fd);
+            ERROR("Unable to map %s: %s", filename, strerror(rc));
+        }
+    }
+    close(fd);
+
+    if (tar_mem_open(m, map, st.st_size, verbosity) < 0)
+    {
+        if (map)
+        {
+            munmap(map, st.st_size);
+        }
+        return -1;
+    }
+
+    m->map = map;
+    return m->count;
+}
+
+const struct tar_mem_entry *tar_mem_find(const struct tar_mem *m, const char *name)
+{
+    if (!m || !m->table || !name)
+    {
+        return NULL;
+    }
+
+    const size_t len = strlen(name);
+    const uint32_t hash = hash_name(name, len);
+    for (size_t slot = hash & m->mask; m->table[slot]; slot = (slot + 1) & m->mask)
+    {
+        const struct tar_mem_entry *entry = &m->entries[m->table[slot] - 1];
+        if ((entry->hash == hash) && (entry->name_len == len) && !memcmp(entry->name, name, len))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int tar_mem_extract_sink(const struct tar_mem *m, const size_t filecount, const char *files[], const struct tar_sink *sink, void *ctx, const char verbosity)
+{
+    if (!m || !sink || !sink->data)
+    {
+        ERROR("Bad sink");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Received non-zero file count but got NULL file list");
+    }
+
+    struct tar_match *names = tar_match_names(filecount, files);
+    if (filecount && !names)
+    {
+        ERROR("Unable to compile member names");
+    }
+
+    int ret = 0;
+    struct tar_t entry;
+    for (size_t i = 0; i < m->count; i++)
+    {
+        const struct tar_mem_entry *e = &m->entries[i];
+
+        // only the header is copied so callbacks get the usual structure
+        memcpy(entry.block, e->header, 512);
+        entry.begin = e->header - m->base;
+        entry.next = NULL;
+        if (!select_entry(names, &entry))
+        {
+            continue;
+        }
+
+        V_PRINT(stdout, "%s", entry.name);
+        const int rc = sink->begin ? sink->begin(ctx, &entry) : 0;
+        const int data = (e->type == REGULAR) || (e->type == NORMAL) || (e->type == CONTIGUOUS);
+        if ((rc < 0) ||
+            (!rc && data && e->size && (sink->data(ctx, &entry, e->data, e->size) < 0)) ||
+            (sink->end && (sink->end(ctx, &entry) < 0)))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    tar_match_free(names);
+    return ret;
+}
+
+void tar_mem_close(struct tar_mem *m)
+{
+    if (!m)
+    {
+        return;
+    }
+
+    free(m->entries);
+    free(m->table);
+    if (m->map)
+    {
+        munmap(m->map, m->len);
+    }
+    memset(m, 0, sizeof(struct tar_mem));
+}
+
+uint32_t hash_name(const char *name, const size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void index_entry(struct tar_mem *m, const size_t i)
+{
+    const struct tar_mem_entry *entry = &m->entries[i];
+    size_t slot = entry->hash & m->mask;
+    while (m->table[slot])
+    {
+        // later members replace earlier ones with the same name
+        const struct tar_mem_entry *other = &m->entries[m->table[slot] - 1];
+        if ((other->hash == entry->hash) && (other->name_len == entry->name_len) && !memcmp(other->name, entry->name, entry->name_len))
+        {
+            break;
+        }
+        slot = (slot + 1) & m->mask;
+    }
+    m->table[slot] = i + 1;
+}
@@ -0,0 +1,56 @@
+//
+// memtar.h
+//
+// Read-only archive index over a memory span (embedded data, shared memory or
+// an mmap'd file). Member data is returned as pointers into the span, so
+// lookups never read or copy
+//
+#ifndef __MEMTAR__
+#define __MEMTAR__
+
+#include <stdint.h>
+
+#include "tar.h"
+
+// one member inside the span
+struct tar_mem_entry
+{
+    const char *header; // 512 octet header inside the span
+    const char *name;   // not terminated when exactly 100 octets long
+    size_t name_len;
+    const char *data;   // first data octet inside the span
+    size_t size;        // data octets
+    mode_t mode;
+    time_t mtime;
+    char type;
+    uint32_t hash;
+};
+
+struct tar_mem
+{
+    const char *base;
+    size_t len;
+    struct tar_mem_entry *entries; // archive order
+    size_t count;
+    uint32_t *table; // open addressing index; slot holds entry index + 1
+    size_t mask;
+    void *map; // set when the span was mapped by tar_mem_map
+};
+
+// index an archive in [base, base + len); PAX extension records are left out
+// the span must outlive the index
+TAR_API int tar_mem_open(struct tar_mem *m, const void *base, const size_t len, const char verbosity);
+
+// mmap a file read-only and index it
+TAR_API int tar_mem_map(struct tar_mem *m, const char *filename, const char verbosity);
+
+// find a member by name (the last one wins when names repeat)
+TAR_API const struct tar_mem_entry *tar_mem_find(const struct tar_mem *m, const char *name);
+
+// hand members to a sink; data is passed as one view per member
+TAR_API int tar_mem_extract_sink(const struct tar_mem *m, const size_t filecount, const char *files[], const struct tar_sink *sink, void *ctx, const char verbosity);
+
+// release the index (and the mapping from tar_mem_map)
+TAR_API void tar_mem_close(struct tar_mem *m);
+
+#endif
@@ -0,0 +1,205 @@
+//
+// prefetch.c
+//
+// Lookahead thread opening and read-hinting upcoming source files
+//
+#include <pthread.h>
+
+#include "internal.h"
+#include "prefetch.h"
+#include "stats.h"
+
+// a file opened ahead of the writer
+struct prefetched
+{
+    char *path;
+    int fd;
+};
+
+struct prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walker walker;
+    struct prefetched *queue; // ring of depth entries
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    char quit;
+    char done; // the walk is finished
+    char verbosity;
+    struct tar_ctx ctx; // derived from the writer's; the walk follows its options
+};
+
+// walk and open files while the queue has room
+static void *lookahead(void *arg);
+
+// close and forget the oldest queued file (lock held)
+static void drop_head(struct prefetch *p);
+
+struct prefetch *prefetch_start(const size_t filecount, const char *files[], const unsigned int depth, const char verbosity)
+{
+    struct prefetch *p = calloc(1, sizeof(struct prefetch));
+    if (!p || !depth || !(p->queue = calloc(depth, sizeof(struct prefetched))))
+    {
+        free(p);
+        return NULL;
+    }
+
+    p->walker.files = files;
+    p->walker.filecount = filecount;
+    p->depth = depth;
+    p->verbosity = verbosity;
+    // the writer meets the same paths and records their errors, so the lookahead keeps no errbuf
+    ctx_inherit(&p->ctx, tar_ctx_current(), NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, lookahead, p))
+    {
+        V_PRINT(stderr, "Unable to start prefetch thread");
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        free(p->queue);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+int prefetch_take(struct prefetch *p, const char *path)
+{
+    if (!p)
+    {
+        return -1;
+    }
+
+    int fd = -1;
+    pthread_mutex_lock(&p->lock);
+
+    // the lookahead only stays useful while it is in front of the writer
+    while (!p->count && !p->done)
+    {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+
+    unsigned int i = 0;
+    while ((i < p->count) && strcmp(p->queue[(p->head + i) % p->depth].path, path))
+    {
+        i++;
+    }
+
+    // the writer has moved past everything in front of a match; a path that
+    // is not queued was skipped by the lookahead (e.g. it could not be opened)
+    if (i < p->count)
+    {
+        while (i--)
+        {
+            drop_head(p);
+        }
+
+        struct prefetched *item = &p->queue[p->head];
+        fd = item->fd;
+        free(item->path);
+        item->path = NULL;
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return fd;
+}
+
+void prefetch_stop(struct prefetch *p)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    while (p->count)
+    {
+        drop_head(p);
+    }
+    walk_free(&p->walker);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p->queue);
+    free(p);
+}
+
+void *lookahead(void *arg)
+{
+    struct prefetch *p = arg;
+    const char verbosity = p->verbosity;
+    tar_ctx_use(&p->ctx);
+    while (1)
+    {
+        pthread_mutex_lock(&p->lock);
+        while ((p->count == p->depth) && !p->quit)
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        const char quit = p->quit;
+        pthread_mutex_unlock(&p->lock);
+        if (quit)
+        {
+            break;
+        }
+
+        // only regular files; opening devices or fifos can have side effects
+        unsigned char type;
+        char *path = walk_next(&p->walker, &type, verbosity);
+        if (!path)
+        {
+            break;
+        }
+
+        if (type != DT_REG)
+        {
+            free(path);
+            continue;
+        }
+
+        STATS_SYS(STATS_OPEN);
+        const int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            free(path);
+            continue;
+        }
+
+        // start the device read now; the writer copies it later
+        posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+
+        pthread_mutex_lock(&p->lock);
+        struct prefetched *item = &p->queue[(p->head + p->count) % p->depth];
+        item->path = path;
+        item->fd = fd;
+        p->count++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void drop_head(struct prefetch *p)
+{
+    struct prefetched *item = &p->queue[p->head];
+    close(item->fd);
+    free(item->path);
+    item->path = NULL;
+    p->head = (p->head + 1) % p->depth;
+    p->count--;
+}
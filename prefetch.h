@@ -0,0 +1,27 @@
+//
+// prefetch.h
+//
+// Lookahead for the POSIX create path: a thread walks the sources ahead of
+// write_entries, opens the next regular files and asks the kernel to start
+// reading them, so device latency overlaps with archive output
+//
+#ifndef __PREFETCH__
+#define __PREFETCH__
+
+#include <stddef.h>
+
+#define PREFETCH_BYTES (4 << 20) // readahead requested per file
+
+struct prefetch;
+
+// start walking files[] with up to depth files open ahead of the writer
+struct prefetch *prefetch_start(const size_t filecount, const char *files[], const unsigned int depth, const char verbosity);
+
+// fd opened ahead for path, or -1 when the lookahead does not have it
+// (the caller then opens the file itself)
+int prefetch_take(struct prefetch *p, const char *path);
+
+// stop the thread and close files that were never taken
+void prefetch_stop(struct prefetch *p);
+
+#endif
@@ -0,0 +1,488 @@
+//
+// range.c
+//
+// Sharded LRU block cache and positional range reads of member data
+//
+#include <pthread.h>
+#include <stdint.h>
+
+#include "internal.h"
+#include "range.h"
+#include "stats.h"
+
+// a cached piece of an archive
+struct block
+{
+    int fd;
+    off_t index; // archive offset / RANGE_BLOCK
+    size_t len;  // short at the end of the archive
+    struct block *chain; // hash bucket
+    struct block *prev;  // LRU list, most recent first
+    struct block *next;
+    char data[];
+};
+
+struct cache_shard
+{
+    pthread_mutex_t lock;
+    struct block **buckets;
+    size_t mask;
+    struct block *head;
+    struct block *tail;
+    size_t bytes;
+    size_t limit;
+};
+
+struct tar_cache
+{
+    struct cache_shard shards[RANGE_SHARDS];
+    size_t limit;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+};
+
+// shard and bucket hash of a block key
+static uint64_t hash_block(const int fd, const off_t index);
+
+// find a block (lock held)
+static struct block *find_block(struct cache_shard *s, const uint64_t hash, const int fd, const off_t index);
+
+// unlink a block from its bucket and the LRU list (lock held)
+static void remove_block(struct cache_shard *s, struct block *b, const uint64_t hash);
+
+// move a block to the front of the LRU list (lock held)
+static void touch_block(struct cache_shard *s, struct block *b);
+
+// copy of a cached block into buf, counting the hit; -1 on a miss
+static ssize_t lookup(struct tar_cache *c, const int fd, const off_t index, const size_t skip, char *buf, const size_t len);
+
+// insert a block read from the archive, evicting as needed
+static void insert(struct tar_cache *c, const int fd, const off_t index, const char *data, const size_t len);
+
+// read one whole block (short at the end of the archive) and cache it; returns octets read
+static ssize_t fill_block(struct tar_cache *c, const int fd, const off_t index, char *data);
+
+// read exactly len octets at off
+static int read_exact(const int fd, char *buf, const size_t len, const off_t off);
+
+struct tar_cache *tar_cache_new(const size_t limit)
+{
+    struct tar_cache *c = calloc(1, sizeof(struct tar_cache));
+    if (!c)
+    {
+        return NULL;
+    }
+
+    const size_t per_shard = MAX(limit / RANGE_SHARDS, (size_t)RANGE_BLOCK);
+    size_t buckets = 16;
+    while (buckets < 2 * per_shard / RANGE_BLOCK)
+    {
+        buckets *= 2;
+    }
+
+    c->limit = per_shard * RANGE_SHARDS;
+    for (int i = 0; i < RANGE_SHARDS; i++)
+    {
+        struct cache_shard *s = &c->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->limit = per_shard;
+        s->mask = buckets - 1;
+        if (!(s->buckets = calloc(buckets, sizeof(struct block *))))
+        {
+            tar_cache_free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+void tar_cache_drop(struct tar_cache *c, const int fd)
+{
+    for (int i = 0; c && (i < RANGE_SHARDS); i++)
+    {
+        struct cache_shard *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        struct block *b = s->head;
+        while (b)
+        {
+            struct block *next = b->next;
+            if (b->fd == fd)
+            {
+                remove_block(s, b, hash_block(b->fd, b->index));
+                free(b);
+            }
+            b = next;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void tar_cache_free(struct tar_cache *c)
+{
+    if (!c)
+    {
+        return;
+    }
+
+    for (int i = 0; i < RANGE_SHARDS; i++)
+    {
+        struct cache_shard *s = &c->shards[i];
+        while (s->head)
+        {
+            struct block *next = s->head->next;
+            free(s->head);
+            s->head = next;
+        }
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(c);
+}
+
+void tar_cache_stats(struct tar_cache *c, struct tar_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(struct tar_cache_stats));
+    if (!c)
+    {
+        return;
+    }
+
+    stats->hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&c->evictions, __ATOMIC_RELAXED);
+    stats->limit = c->limit;
+    for (int i = 0; i < RANGE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&c->shards[i].lock);
+        stats->bytes += c->shards[i].bytes;
+        pthread_mutex_unlock(&c->shards[i].lock);
+    }
+}
+
+ssize_t tar_read_range(struct tar_cache *c, const int fd, const struct tar_t *member, const off_t offset, void *buf, const size_t len)
+{
+    if ((fd < 0) || !member || (offset < 0) || (len && !buf))
+    {
+        ERROR("Bad range");
+    }
+
+    const off_t size = oct2size(member->size, 11);
+    if (offset >= size)
+    {
+        return 0;
+    }
+
+    const size_t want = MIN((off_t)len, size - offset);
+    const off_t start = (off_t)member->begin + 512 + offset;
+    const off_t end = start + want;
+    char *out = buf;
+    size_t done = 0;
+
+    // uncached: one read straight into the caller's buffer
+    if (!c)
+    {
+        while (done < want)
+        {
+            STATS_SYS(STATS_READ);
+            const ssize_t got = pread(fd, out + done, want - done, start + done);
+            if (got <= 0)
+            {
+                ERROR("Archive ended inside entry data");
+            }
+            done += got;
+        }
+        return done;
+    }
+
+    // serve cached blocks until the first miss
+    off_t index = start / RANGE_BLOCK;
+    while (done < want)
+    {
+        const size_t skip = (start + done) % RANGE_BLOCK;
+        const ssize_t hit = lookup(c, fd, index, skip, out + done, want - done);
+        if (hit < 0)
+        {
+            break;
+        }
+        done += hit;
+        index++;
+    }
+
+    if (done == want)
+    {
+        return done;
+    }
+
+    const off_t first = index * RANGE_BLOCK;
+    const off_t last = (end + RANGE_BLOCK - 1) / RANGE_BLOCK * RANGE_BLOCK;
+
+    // more than a shard holds would only evict the cache: read the middle
+    // straight into the caller's buffer and keep just the two edge blocks
+    if (last - first > (off_t)c->shards[0].limit)
+    {
+        char *edge = malloc(RANGE_BLOCK);
+        if (!edge)
+        {
+            ERROR("Unable to allocate range buffer");
+        }
+
+        const size_t skip = start + done - first;
+        const off_t tail = (end - 1) / RANGE_BLOCK * RANGE_BLOCK;
+        ssize_t ret = -1;
+        ssize_t got = fill_block(c, fd, index, edge);
+        if ((got >= 0) && (got < RANGE_BLOCK))
+        {
+            tar_error("Archive ended inside entry data");
+        }
+        else if (got >= 0)
+        {
+            memcpy(out + done, edge + skip, RANGE_BLOCK - skip);
+            done += RANGE_BLOCK - skip;
+            if (!read_exact(fd, out + done, tail - (start + done), start + done))
+            {
+                done = tail - start;
+                got = fill_block(c, fd, tail / RANGE_BLOCK, edge);
+                if ((got >= 0) && (got < end - tail))
+                {
+                    tar_error("Archive ended inside entry data");
+                }
+                else if (got >= 0)
+                {
+                    memcpy(out + done, edge, want - done);
+                    ret = want;
+                }
+            }
+        }
+        free(edge);
+        return ret;
+    }
+
+    // the rest of the range in a single read of whole blocks, which are all cached
+    char *blocks = malloc(last - first);
+    if (!blocks)
+    {
+        ERROR("Unable to allocate range buffer");
+    }
+
+    off_t got = 0;
+    while (got < last - first)
+    {
+        STATS_SYS(STATS_READ);
+        const ssize_t r = pread(fd, blocks + got, last - first - got, first + got);
+        if (r < 0)
+        {
+            free(blocks);
+            RC_ERROR("Unable to read archive: %s", strerror(rc));
+        }
+
+        // the archive can end inside the last block
+        if (!r)
+        {
+            break;
+        }
+        got += r;
+    }
+
+    if (first + got < end)
+    {
+        free(blocks);
+        ERROR("Archive ended inside entry data");
+    }
+
+    for (off_t at = 0; at < got; at += RANGE_BLOCK)
+    {
+        insert(c, fd, (first + at) / RANGE_BLOCK, blocks + at, MIN(got - at, (off_t)RANGE_BLOCK));
+    }
+    memcpy(out + done, blocks + (start + done - first), want - done);
+    free(blocks);
+    return want;
+}
+
+ssize_t fill_block(struct tar_cache *c, const int fd, const off_t index, char *data)
+{
+    ssize_t got = 0;
+    while (got < RANGE_BLOCK)
+    {
+        STATS_SYS(STATS_READ);
+        const ssize_t r = pread(fd, data + got, RANGE_BLOCK - got, index * RANGE_BLOCK + got);
+        if (r < 0)
+        {
+            RC_ERROR("Unable to read archive: %s", strerror(rc));
+        }
+
+        // the archive can end inside the block
+        if (!r)
+        {
+            break;
+        }
+        got += r;
+    }
+
+    if (got)
+    {
+        insert(c, fd, index, data, got);
+    }
+    return got;
+}
+
+int read_exact(const int fd, char *buf, const size_t len, const off_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        STATS_SYS(STATS_READ);
+        const ssize_t r = pread(fd, buf + done, len - done, off + done);
+        if (r < 0)
+        {
+            RC_ERROR("Unable to read archive: %s", strerror(rc));
+        }
+        if (!r)
+        {
+            ERROR("Archive ended inside entry data");
+        }
+        done += r;
+    }
+    return 0;
+}
+
+uint64_t hash_block(const int fd, const off_t index)
+{
+    // splitmix64 finalizer
+    uint64_t x = ((uint64_t)fd << 40) ^ (uint64_t)index;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+struct block *find_block(struct cache_shard *s, const uint64_t hash, const int fd, const off_t index)
+{
+    struct block *b = s->buckets[(hash >> 8) & s->mask];
+    while (b && ((b->fd != fd) || (b->index != index)))
+    {
+        b = b->chain;
+    }
+    return b;
+}
+
+void remove_block(struct cache_shard *s, struct block *b, const uint64_t hash)
+{
+    struct block **link = &s->buckets[(hash >> 8) & s->mask];
+    while (*link != b)
+    {
+        link = &(*link)->chain;
+    }
+    *link = b->chain;
+
+    if (b->prev)
+    {
+        b->prev->next = b->next;
+    }
+    else
+    {
+        s->head = b->next;
+    }
+
+    if (b->next)
+    {
+        b->next->prev = b->prev;
+    }
+    else
+    {
+        s->tail = b->prev;
+    }
+    s->bytes -= b->len;
+}
+
+void touch_block(struct cache_shard *s, struct block *b)
+{
+    if (s->head == b)
+    {
+        return;
+    }
+
+    // unlink, then push to the front
+    b->prev->next = b->next;
+    if (b->next)
+    {
+        b->next->prev = b->prev;
+    }
+    else
+    {
+        s->tail = b->prev;
+    }
+
+    b->prev = NULL;
+    b->next = s->head;
+    s->head->prev = b;
+    s->head = b;
+}
+
+ssize_t lookup(struct tar_cache *c, const int fd, const off_t index, const size_t skip, char *buf, const size_t len)
+{
+    const uint64_t hash = hash_block(fd, index);
+    struct cache_shard *s = &c->shards[hash % RANGE_SHARDS];
+    pthread_mutex_lock(&s->lock);
+    struct block *b = find_block(s, hash, fd, index);
+    ssize_t copied = -1;
+    if (b && (skip < b->len))
+    {
+        copied = MIN(len, b->len - skip);
+        memcpy(buf, b->data + skip, copied);
+        touch_block(s, b);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    __atomic_fetch_add((copied < 0) ? &c->misses : &c->hits, 1, __ATOMIC_RELAXED);
+    return copied;
+}
+
+void insert(struct tar_cache *c, const int fd, const off_t index, const char *data, const size_t len)
+{
+    struct block *b = malloc(sizeof(struct block) + len);
+    if (!b)
+    {
+        return;
+    }
+    b->fd = fd;
+    b->index = index;
+    b->len = len;
+    memcpy(b->data, data, len);
+
+    const uint64_t hash = hash_block(fd, index);
+    struct cache_shard *s = &c->shards[hash % RANGE_SHARDS];
+    pthread_mutex_lock(&s->lock);
+
+    // another thread may have read the same block meanwhile
+    struct block *old = find_block(s, hash, fd, index);
+    if (old)
+    {
+        remove_block(s, old, hash);
+        free(old);
+    }
+
+    while (s->tail && (s->bytes + len > s->limit))
+    {
+        struct block *victim = s->tail;
+        remove_block(s, victim, hash_block(victim->fd, victim->index));
+        free(victim);
+        __atomic_fetch_add(&c->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+    struct block **bucket = &s->buckets[(hash >> 8) & s->mask];
+    b->chain = *bucket;
+    *bucket = b;
+    b->prev = NULL;
+    b->next = s->head;
+    if (s->head)
+    {
+        s->head->prev = b;
+    }
+    else
+    {
+        s->tail = b;
+    }
+    s->head = b;
+    s->bytes += len;
+    pthread_mutex_unlock(&s->lock);
+}
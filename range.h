@@ -0,0 +1,43 @@
+//
+// range.h
+//
+// Byte ranges of member data read with pread() through a block cache that
+// any number of threads can share. The cache holds RANGE_BLOCK sized pieces
+// of archives in RANGE_SHARDS independently locked LRU lists, so hot members
+// are served from memory and a cold range costs one read
+//
+#ifndef __RANGE__
+#define __RANGE__
+
+#include "tar.h"
+
+#define RANGE_BLOCK (64 << 10) // octets per cached block (archive aligned)
+#define RANGE_SHARDS 16        // independently locked parts of the cache
+
+struct tar_cache;
+
+struct tar_cache_stats
+{
+    unsigned long long hits;   // blocks served from memory
+    unsigned long long misses; // blocks read from the archive
+    unsigned long long evictions;
+    size_t bytes; // octets held
+    size_t limit;
+};
+
+// cache holding at most limit octets (at least one block per shard)
+TAR_API struct tar_cache *tar_cache_new(const size_t limit);
+
+// blocks are keyed by fd; drop them before the fd is closed or reused
+TAR_API void tar_cache_drop(struct tar_cache *c, const int fd);
+
+TAR_API void tar_cache_free(struct tar_cache *c);
+
+TAR_API void tar_cache_stats(struct tar_cache *c, struct tar_cache_stats *stats);
+
+// copy up to len octets of member's data starting at offset into buf
+// c may be NULL to read without caching; the fd offset is not used
+// returns octets copied (0 past the end of the data), -1 on error
+TAR_API ssize_t tar_read_range(struct tar_cache *c, const int fd, const struct tar_t *member, const off_t offset, void *buf, const size_t len);
+
+#endif
@@ -0,0 +1,416 @@
+//
+// repack.c
+//
+// Filter, rename and merge archives without extracting them
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // copy_file_range, splice
+#endif
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "internal.h"
+#include "repack.h"
+#include "stats.h"
+#include "verify.h"
+
+#define REPACK_EXTENSION_MAX (1 << 20) // largest extended header kept in memory
+
+// a record describing the member after it (PAX 'x', GNU 'L'/'K'), held until
+// it is known whether that member is kept
+struct extension
+{
+    struct tar_t header;
+    char *data; // padded to whole blocks
+    off_t size;
+};
+
+// full member name: ustar prefix and name
+static void member_name(const struct tar_t *entry, char *name);
+
+// apply the first matching rule; returns name or buf holding the new name
+static const char *rename_path(const char *name, const struct tar_rename *renames, const size_t renamecount, char *buf, const size_t size);
+
+// store name in the header, using the ustar prefix when the header has one
+static int set_name(struct tar_t *entry, const char *name);
+
+// move len octets at offset of in to the current offset of out
+static int copy_body(const int in, off_t offset, const int out, off_t len);
+
+// reflink the block aligned part of a region; returns octets cloned (0 when it cannot)
+static off_t clone_region(const int in, const off_t offset, const int out, const off_t len);
+
+// hold an extension record and its data
+static int hold_extension(struct tar_iter *it, const struct tar_t *entry, struct extension *ext);
+
+// write a held extension record in front of the member now named name
+static int write_extension(const int out, struct extension *ext, const char *name);
+
+int tar_repack(const int out, const size_t incount, const int in[], const struct tar_rename *renames, const size_t renamecount, const char verbosity)
+{
+    if (out < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if ((incount && !in) || (renamecount && !renames))
+    {
+        ERROR("Bad repack arguments");
+    }
+
+    off_t written = 0;
+    int members = 0;
+    int ret = 0;
+    struct extension ext;
+    memset(&ext, 0, sizeof(ext));
+    for (size_t i = 0; !ret && (i < incount); i++)
+    {
+        // records do not carry over from one archive to the next
+        ext.size = -1;
+
+        struct tar_iter it;
+        if (tar_iter_open(&it, in[i], verbosity) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        struct tar_t *entry;
+        int got;
+        while (!ret && ((got = tar_iter_next(&it, &entry)) > 0))
+        {
+            if ((entry->type == PAX_HEADER) || (entry->type == 'L') || (entry->type == 'K'))
+            {
+                ret = hold_extension(&it, entry, &ext);
+                continue;
+            }
+
+            // filters see the names in the source archive
+            char name[257], renamed[257], link[257];
+            member_name(entry, name);
+            if (!tar_match_test(tar_ctx_current()->options.match, name))
+            {
+                V_PRINT(stdout, "Dropping %s", name);
+                ext.size = -1;
+                continue;
+            }
+
+            struct tar_t header = *entry;
+            const char *target = rename_path(name, renames, renamecount, renamed, sizeof(renamed));
+            if (set_name(&header, target) < 0)
+            {
+                tar_error("Renamed path too long: %s", target);
+                ret = -1;
+                break;
+            }
+
+            // hard links name another member, which was renamed the same way
+            if (entry->type == HARDLINK)
+            {
+                char old[101] = {0};
+                memcpy(old, entry->link_name, 100);
+                const char *to = rename_path(old, renames, renamecount, link, sizeof(link));
+                if (strlen(to) > 100)
+                {
+                    tar_error("Renamed link target too long: %s", to);
+                    ret = -1;
+                    break;
+                }
+                memset(header.link_name, 0, sizeof(header.link_name));
+                memcpy(header.link_name, to, strlen(to));
+            }
+            calculate_checksum(&header);
+            V_PRINT(stdout, "%s%s%s", name, (target != name) ? " -> " : "", (target != name) ? target : "");
+
+            if (ext.size >= 0)
+            {
+                if (write_extension(out, &ext, target) < 0)
+                {
+                    ret = -1;
+                    break;
+                }
+                written += 512 + ext.size;
+                ext.size = -1;
+            }
+
+            if (write_size(out, header.block, 512) != 512)
+            {
+                RC_ERROR("Could not write to archive: %s", strerror(rc));
+            }
+
+            // data and padding go across as one run; pipes are read through
+            const off_t size = it.remaining;
+            if (it.seekable)
+            {
+                ret = copy_body(it.fd, it.offset, out, size + it.padding);
+            }
+            else
+            {
+                char buf[BLOCKSIZE * BLOCKING_FACTOR];
+                ssize_t r;
+                while ((r = tar_iter_read(&it, buf, sizeof(buf))) > 0)
+                {
+                    if (write_size(out, buf, r) != r)
+                    {
+                        ret = -1;
+                    }
+                }
+                ret = ((r < 0) || ret || (write_padding(out, size) < 0)) ? -1 : 0;
+            }
+
+            written += 512 + size + it.padding;
+            members++;
+        }
+
+        if (got < 0)
+        {
+            ret = -1;
+        }
+        tar_iter_close(&it);
+    }
+    free(ext.data);
+
+    if (ret || (write_end_data(out, written % RECORDSIZE, verbosity) < 0))
+    {
+        ERROR("Repack failed");
+    }
+    return members;
+}
+
+off_t tar_concat(const int out, const size_t incount, const int in[], const char verbosity)
+{
+    if (out < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if (incount && !in)
+    {
+        ERROR("Bad concatenate arguments");
+    }
+
+    off_t written = 0;
+    for (size_t i = 0; i < incount; i++)
+    {
+        // the headers give where the members end and the trailer starts
+        struct tar_t *archive = NULL;
+        const int count = tar_read(in[i], &archive, verbosity);
+        if (count < 0)
+        {
+            tar_free(archive);
+            ERROR("Unable to read source archive %zu", i + 1);
+        }
+
+        off_t end = 0;
+        for (struct tar_t *entry = archive; entry; entry = entry->next)
+        {
+            const off_t size = oct2size(entry->size, 11);
+            end = (off_t)entry->begin + 512 + (size + 511) / 512 * 512;
+        }
+        tar_free(archive);
+        V_PRINT(stdout, "Appending %d members (%lld octets) from source %zu", count, (long long)end, i + 1);
+
+        const off_t cloned = clone_region(in[i], 0, out, end);
+        if ((cloned < end) && (copy_body(in[i], cloned, out, end - cloned) < 0))
+        {
+            ERROR("Unable to copy source archive %zu", i + 1);
+        }
+        written += end;
+    }
+
+    const int trailer = write_end_data(out, written % RECORDSIZE, verbosity);
+    if (trailer < 0)
+    {
+        ERROR("Failed to write end data");
+    }
+    return written + trailer;
+}
+
+void member_name(const struct tar_t *entry, char *name)
+{
+    // POSIX ustar keeps the leading directories in prefix; GNU headers use it for other things
+    if (!memcmp(entry->ustar, "ustar\0", 6) && entry->prefix[0])
+    {
+        snprintf(name, 257, "%.155s/%.100s", entry->prefix, entry->name);
+    }
+    else
+    {
+        snprintf(name, 257, "%.100s", entry->name);
+    }
+}
+
+const char *rename_path(const char *name, const struct tar_rename *renames, const size_t renamecount, char *buf, const size_t size)
+{
+    for (size_t i = 0; i < renamecount; i++)
+    {
+        const size_t len = strlen(renames[i].from);
+        if (!strncmp(name, renames[i].from, len))
+        {
+            snprintf(buf, size, "%s%s", renames[i].to, name + len);
+            return buf;
+        }
+    }
+    return name;
+}
+
+int set_name(struct tar_t *entry, const char *name)
+{
+    const size_t len = strlen(name);
+    const int ustar = !memcmp(entry->ustar, "ustar\0", 6);
+    if (len <= 100)
+    {
+        memset(entry->name, 0, sizeof(entry->name));
+        memcpy(entry->name, name, len);
+        if (ustar)
+        {
+            memset(entry->prefix, 0, sizeof(entry->prefix));
+        }
+        return 0;
+    }
+
+    // split at the last '/' that leaves both parts in their fields
+    const char *slash = ustar ? name + MIN(len - 1, 155) : NULL;
+    while (slash && (slash > name) && ((*slash != '/') || (strlen(slash + 1) > 100)))
+    {
+        slash--;
+    }
+
+    if (!slash || (slash == name) || !slash[1])
+    {
+        return -1;
+    }
+
+    memset(entry->prefix, 0, sizeof(entry->prefix));
+    memcpy(entry->prefix, name, slash - name);
+    memset(entry->name, 0, sizeof(entry->name));
+    memcpy(entry->name, slash + 1, strlen(slash + 1));
+    return 0;
+}
+
+int copy_body(const int in, off_t offset, const int out, off_t len)
+{
+    // copy_file_range between files; splice when out is a pipe; a plain copy otherwise
+    int method = 0;
+    char buf[BLOCKSIZE * BLOCKING_FACTOR];
+    while (len)
+    {
+        ssize_t n;
+        STATS_SYS(STATS_WRITE);
+        if (method == 0)
+        {
+            n = copy_file_range(in, &offset, out, NULL, len, 0);
+        }
+        else if (method == 1)
+        {
+            n = splice(in, &offset, out, NULL, len, 0);
+        }
+        else
+        {
+            STATS_SYS(STATS_READ);
+            n = pread(in, buf, MIN(len, (off_t)sizeof(buf)), offset);
+            if ((n > 0) && (write_size(out, buf, n) != n))
+            {
+                RC_ERROR("Could not write to archive: %s", strerror(rc));
+            }
+            offset += (n > 0) ? n : 0;
+        }
+
+        if ((n < 0) && (method < 2) && ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP) || (errno == ESPIPE) || (errno == EBADF)))
+        {
+            method++;
+            continue;
+        }
+
+        if (n < 0)
+        {
+            RC_ERROR("Could not copy member data: %s", strerror(rc));
+        }
+
+        if (!n)
+        {
+            ERROR("Archive ended inside entry data");
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+off_t clone_region(const int in, const off_t offset, const int out, const off_t len)
+{
+#ifdef FICLONERANGE
+    // both offsets and the length have to be multiples of the filesystem block
+    struct stat st;
+    const off_t at = lseek(out, 0, SEEK_CUR);
+    if ((at < 0) || (fstat(out, &st) < 0) || (st.st_blksize <= 0) || (at % st.st_blksize) || (offset % st.st_blksize))
+    {
+        return 0;
+    }
+
+    struct file_clone_range range = {in, offset, len - len % st.st_blksize, at};
+    if (!range.src_length || (ioctl(out, FICLONERANGE, &range) < 0))
+    {
+        return 0;
+    }
+
+    // the ioctl leaves the offset alone
+    if (lseek(out, at + range.src_length, SEEK_SET) < 0)
+    {
+        return 0;
+    }
+    return range.src_length;
+#else
+    return 0;
+#endif
+}
+
+int hold_extension(struct tar_iter *it, const struct tar_t *entry, struct extension *ext)
+{
+    const off_t size = it->remaining;
+    const off_t padded = size + it->padding;
+    if (padded > REPACK_EXTENSION_MAX)
+    {
+        ERROR("Extended header of %ld octets is too large", (long)size);
+    }
+
+    char *data = realloc(ext->data, padded + 1);
+    if (!data)
+    {
+        ERROR("Unable to hold extended header");
+    }
+    ext->data = data;
+    memset(ext->data, 0, padded + 1);
+
+    for (off_t got = 0; got < size;)
+    {
+        const ssize_t r = tar_iter_read(it, ext->data + got, size - got);
+        if (r <= 0)
+        {
+            ERROR("Archive ended inside an extended header");
+        }
+        got += r;
+    }
+
+    ext->header = *entry;
+    ext->size = padded;
+    return 0;
+}
+
+int write_extension(const int out, struct extension *ext, const char *name)
+{
+    // PAX headers are named after their member; GNU long name records keep theirs
+    if (ext->header.type == PAX_HEADER)
+    {
+        char pax[257];
+        snprintf(pax, sizeof(pax), "PaxHeaders/%s", name);
+        memset(ext->header.name, 0, sizeof(ext->header.name));
+        memcpy(ext->header.name, pax, MIN(strlen(pax), 99));
+        calculate_checksum(&ext->header);
+    }
+
+    if ((write_size(out, ext->header.block, 512) != 512) || (write_size(out, ext->data, ext->size) != ext->size))
+    {
+        RC_ERROR("Could not write to archive: %s", strerror(rc));
+    }
+    return 0;
+}
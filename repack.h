@@ -0,0 +1,33 @@
+//
+// repack.h
+//
+// Archive to archive copies: members of one or more source archives are
+// filtered (tar_options.match) and renamed in their headers, while member
+// data moves between the files in the kernel (copy_file_range, or splice when
+// the output is a pipe) without being extracted. Concatenation copies whole
+// member regions and skips the headers entirely
+//
+#ifndef __REPACK__
+#define __REPACK__
+
+#include "tar.h"
+
+// names starting with from start with to instead (the first matching rule wins);
+// hard link targets are renamed the same way
+struct tar_rename
+{
+    const char *from;
+    const char *to;
+};
+
+// append the selected members of every input to out and end the archive
+// returns the number of members written, -1 on error
+TAR_API int tar_repack(const int out, const size_t incount, const int in[], const struct tar_rename *renames, const size_t renamecount, const char verbosity);
+
+// append every input's member region (up to its end-of-archive blocks) to out
+// as is and end the archive once; regions are reflinked (FICLONERANGE) where
+// the filesystem shares blocks and offsets line up, copy_file_range otherwise
+// returns the archive size, -1 on error
+TAR_API off_t tar_concat(const int out, const size_t incount, const int in[], const char verbosity);
+
+#endif
@@ -0,0 +1,199 @@
+//
+// resume.c
+//
+// Skip checks for members already on disk and the extraction journal
+//
+#include "durable.h"
+#include "internal.h"
+#include "resume.h"
+#include "stats.h"
+#include "verify.h"
+
+// fixed width so a checkpoint overwrites the line in place
+#define RESUME_FORMAT RESUME_MAGIC " %020lld %020lld %020lld\n"
+#define RESUME_LINE (sizeof(RESUME_MAGIC) + 3 * 21)
+
+// journal of the extraction running under a context (tar_ctx.resume)
+struct resume
+{
+    int fd;
+    char *path;
+    long long archive_size;
+    long long archive_mtime;
+    unsigned int members; // since the last checkpoint
+    off_t octets;
+};
+
+// write a checkpoint line
+static int journal_write(struct resume *r, const off_t offset);
+
+// CRC32C of a file's contents
+static int file_crc32c(const char *name, uint32_t *crc);
+
+int resume_open(const char *path, const int fd, off_t *start, const char verbosity)
+{
+    *start = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        RC_ERROR("Unable to stat archive: %s", strerror(rc));
+    }
+
+    struct tar_ctx *ctx = tar_ctx_current();
+    if (ctx->resume)
+    {
+        ERROR("A journal is already open");
+    }
+
+    struct resume *r = calloc(1, sizeof(struct resume));
+    if (!r)
+    {
+        ERROR("Unable to allocate journal");
+    }
+
+    if ((r->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+    {
+        const int rc = errno;
+        free(r);
+        ERROR("Unable to open journal %s: %s", path, strerror(rc));
+    }
+    r->path = strdup(path);
+    r->archive_size = st.st_size;
+    r->archive_mtime = st.st_mtime;
+    ctx->resume = r;
+
+    // a checkpoint only counts for the archive it was written against
+    char line[RESUME_LINE + 1] = {0};
+    long long size = 0, mtime = 0, offset = 0;
+    if ((pread(r->fd, line, RESUME_LINE, 0) == RESUME_LINE) &&
+        (sscanf(line, RESUME_MAGIC " %lld %lld %lld", &size, &mtime, &offset) == 3) &&
+        (size == r->archive_size) && (mtime == r->archive_mtime) && (offset >= 0) && (offset < size) && !(offset % 512))
+    {
+        V_PRINT(stdout, "Resuming at offset %lld", offset);
+        *start = offset;
+        return 0;
+    }
+    return journal_write(r, 0);
+}
+
+int resume_skip(const int fd, const struct tar_t *pax, const struct tar_t *entry, const char verbosity)
+{
+    if ((entry->type != REGULAR) && (entry->type != NORMAL) && (entry->type != CONTIGUOUS))
+    {
+        return 0;
+    }
+
+    struct stat st;
+    STATS_SYS(STATS_STAT);
+    if ((lstat(entry->name, &st) < 0) || !S_ISREG(st.st_mode))
+    {
+        return 0;
+    }
+
+    const time_t mtime = oct2size(entry->mtime, 11);
+    if (tar_ctx_current()->options.keep_newer && (st.st_mtime > mtime))
+    {
+        V_PRINT(stdout, "Keeping newer %s", entry->name);
+        return 1;
+    }
+
+    if (!tar_ctx_current()->options.resume || (st.st_size != oct2size(entry->size, 11)) || (st.st_mtime != mtime))
+    {
+        return 0;
+    }
+
+    // size and mtime are only set once a file is complete; the data can be checked too
+    uint32_t recorded, crc;
+    if ((tar_ctx_current()->options.resume == TAR_RESUME_CHECKSUM) && pax && !pax_read_crc32c(fd, pax, &recorded) &&
+        ((file_crc32c(entry->name, &crc) < 0) || (crc != recorded)))
+    {
+        return 0;
+    }
+
+    V_PRINT(stdout, "Unchanged %s", entry->name);
+    return 1;
+}
+
+int resume_progress(const off_t next, const off_t size)
+{
+    struct resume *r = tar_ctx_current()->resume;
+    if (!r)
+    {
+        return 0;
+    }
+
+    r->octets += size;
+    if ((++r->members < RESUME_INTERVAL) && (r->octets < RESUME_BYTES))
+    {
+        return 0;
+    }
+    r->members = 0;
+    r->octets = 0;
+
+    // the checkpoint must not get ahead of committed files
+    if ((tar_ctx_current()->options.durability == TAR_DURABLE_BATCH) && (durable_commit() < 0))
+    {
+        return -1;
+    }
+    return journal_write(r, next);
+}
+
+int resume_close(const int complete)
+{
+    struct tar_ctx *ctx = tar_ctx_current();
+    struct resume *r = ctx->resume;
+    if (!r)
+    {
+        return 0;
+    }
+
+    int ret = 0;
+    if (complete && (unlink(r->path) < 0))
+    {
+        ret = -1;
+    }
+    close(r->fd);
+    free(r->path);
+    free(r);
+    ctx->resume = NULL;
+    return ret;
+}
+
+int journal_write(struct resume *r, const off_t offset)
+{
+    char line[RESUME_LINE + 1];
+    snprintf(line, sizeof(line), RESUME_FORMAT, r->archive_size, r->archive_mtime, (long long)offset);
+    STATS_SYS(STATS_WRITE);
+    if (pwrite(r->fd, line, RESUME_LINE, 0) != RESUME_LINE)
+    {
+        RC_ERROR("Unable to write journal: %s", strerror(rc));
+    }
+
+    if ((tar_ctx_current()->options.durability == TAR_DURABLE_BATCH) && (fdatasync(r->fd) < 0))
+    {
+        RC_ERROR("Unable to sync journal: %s", strerror(rc));
+    }
+    return 0;
+}
+
+int file_crc32c(const char *name, uint32_t *crc)
+{
+    STATS_SYS(STATS_OPEN);
+    const int f = open(name, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+    {
+        return -1;
+    }
+
+    char buf[1 << 16];
+    ssize_t got;
+    *crc = 0;
+    STATS_SYS(STATS_READ);
+    while ((got = read(f, buf, sizeof(buf))) > 0)
+    {
+        *crc = crc32c(*crc, buf, got);
+        STATS_SYS(STATS_READ);
+    }
+    close(f);
+    return got ? -1 : 0;
+}
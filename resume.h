@@ -0,0 +1,38 @@
+//
+// resume.h
+//
+// Restartable extraction. tar_options.resume skips regular files whose
+// existing copy already has the member's size and mtime (and CRC32C with
+// TAR_RESUME_CHECKSUM when the archive recorded one); tar_options.keep_newer
+// leaves files newer than the member alone. A journal records the archive
+// offset of the first member not known to be complete, so a restarted run can
+// start reading headers there. With --durable=batch the journal only moves
+// past committed files; otherwise it can run ahead of data lost in a crash
+// of the machine (not of the process)
+//
+#ifndef __RESUME__
+#define __RESUME__
+
+#include "tar.h"
+
+#define RESUME_MAGIC "wytar-journal 1"
+#define RESUME_INTERVAL 1024      // members between checkpoints
+#define RESUME_BYTES (64ll << 20) // or data octets between checkpoints
+
+// open (or create) the journal for the archive on fd in the calling thread's context
+// start gets the offset to read headers from: the checkpoint when the journal
+// belongs to this archive, 0 otherwise
+int resume_open(const char *path, const int fd, off_t *start, const char verbosity);
+
+// whether the existing file makes extracting entry unnecessary
+// pax is the extended header in front of entry (NULL for none)
+int resume_skip(const int fd, const struct tar_t *pax, const struct tar_t *entry, const char verbosity);
+
+// everything before next is on disk; checkpoints every RESUME_INTERVAL members
+// or RESUME_BYTES octets (no-op without a journal)
+int resume_progress(const off_t next, const off_t size);
+
+// close the journal; a complete extraction removes it
+int resume_close(const int complete);
+
+#endif
@@ -0,0 +1,625 @@
+//
+// serve.c
+//
+// epoll loop, request handling and latency histograms of the archive server
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "internal.h"
+#include "memtar.h"
+#include "serve.h"
+#include "stats.h"
+
+enum serve_kind
+{
+    SERVE_LIST,
+    SERVE_STAT,
+    SERVE_READ,
+    SERVE_OPEN,
+    SERVE_STATS,
+    SERVE_KINDS
+};
+
+static const char *kind_names[SERVE_KINDS] = {"list", "stat", "read", "open", "stats"};
+
+// an indexed archive
+struct served
+{
+    const char *name;
+    int fd; // sent to clients and used for sendfile
+    struct tar_mem mem;
+};
+
+struct client
+{
+    int fd;
+    char in[SERVE_LINE];
+    size_t in_used;
+    char *out; // reply text
+    size_t out_used;
+    size_t out_sent;
+    size_t out_cap;
+    int pass_fd;      // sent along with the first octet of out; -1 for none
+    int file;         // member data sent after out; -1 for none
+    off_t file_off;
+    size_t file_left;
+    char closing;     // drop once out is sent
+};
+
+struct server
+{
+    struct served *archives;
+    size_t count;
+    int epoll;
+    unsigned int clients;
+    uint64_t hist[SERVE_KINDS][STATS_BUCKETS]; // request service time, log2 ns buckets
+    uint64_t requests[SERVE_KINDS];
+    uint64_t errors;
+    char verbosity;
+};
+
+// epoll tags of the two non-client descriptors
+static char listen_tag, signal_tag;
+
+// bind and listen, replacing a stale socket
+static int listen_on(const char *path);
+
+// accept every pending connection
+static void accept_clients(struct server *s, const int sock);
+
+// read requests and answer the complete ones; -1 drops the client
+static int client_read(struct server *s, struct client *c);
+
+// send pending replies and data; 1 when everything went out, 0 when the socket is full, -1 on error
+static int client_flush(struct client *c);
+
+// answer buffered requests while nothing is pending; -1 drops the client
+static int client_serve(struct server *s, struct client *c);
+
+// wait for EPOLLOUT only while output is pending
+static void client_watch(struct server *s, struct client *c);
+
+static void client_close(struct server *s, struct client *c);
+
+// append to the reply
+static int reply(struct client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// answer one request line
+static int handle(struct server *s, struct client *c, char *line);
+
+// archive by position or name
+static struct served *find_archive(struct server *s, const char *name);
+
+// print the histograms
+static int print_hist(struct server *s, struct client *c, FILE *f);
+
+int tar_serve(const char *path, const size_t count, const char *archives[], const char verbosity)
+{
+    if (!path || (count && !archives))
+    {
+        ERROR("Bad serve arguments");
+    }
+
+    struct server s;
+    memset(&s, 0, sizeof(s));
+    s.verbosity = verbosity;
+    s.epoll = -1;
+    if (!(s.archives = calloc(count + 1, sizeof(struct served))))
+    {
+        ERROR("Unable to allocate archive table");
+    }
+
+    int ret = 0;
+    for (size_t i = 0; !ret && (i < count); i++)
+    {
+        struct served *a = &s.archives[i];
+        a->name = archives[i];
+        if (((a->fd = open(archives[i], O_RDONLY | O_CLOEXEC)) < 0) || (tar_mem_map(&a->mem, archives[i], verbosity) < 0))
+        {
+            tar_error("Unable to index %s", archives[i]);
+            ret = -1;
+            break;
+        }
+        s.count++;
+        V_PRINT(stderr, "Indexed %s: %zu members", archives[i], a->mem.count);
+    }
+
+    // SIGPIPE becomes EPIPE; SIGINT and SIGTERM arrive through the loop
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    sigdelset(&mask, SIGPIPE);
+
+    const int sock = ret ? -1 : listen_on(path);
+    const int sig = (sock < 0) ? -1 : signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ((sock >= 0) && ((sig < 0) || ((s.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)))
+    {
+        tar_error("Unable to set up the event loop: %s", strerror(errno));
+    }
+
+    struct epoll_event ev = {EPOLLIN, {.ptr = &listen_tag}};
+    if ((s.epoll < 0) || epoll_ctl(s.epoll, EPOLL_CTL_ADD, sock, &ev) ||
+        ((ev.data.ptr = &signal_tag), epoll_ctl(s.epoll, EPOLL_CTL_ADD, sig, &ev)))
+    {
+        ret = -1;
+    }
+    else
+    {
+        V_PRINT(stderr, "Serving %zu archives on %s", s.count, path);
+    }
+
+    struct epoll_event events[SERVE_EVENTS];
+    char stop = 0;
+    while (!ret && !stop)
+    {
+        const int n = epoll_wait(s.epoll, events, SERVE_EVENTS, -1);
+        if ((n < 0) && (errno != EINTR))
+        {
+            tar_error("epoll_wait failed: %s", strerror(errno));
+            ret = -1;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &listen_tag)
+            {
+                accept_clients(&s, sock);
+                continue;
+            }
+
+            if (events[i].data.ptr == &signal_tag)
+            {
+                // consume the signal so restoring the mask does not deliver it
+                struct signalfd_siginfo info;
+                stop = read(sig, &info, sizeof(info)) == sizeof(info);
+                continue;
+            }
+
+            struct client *c = events[i].data.ptr;
+            int rc = 0;
+            if (events[i].events & EPOLLOUT)
+            {
+                rc = client_flush(c);
+                rc = (rc > 0) ? client_serve(&s, c) : rc;
+            }
+
+            if ((rc >= 0) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                rc = client_read(&s, c);
+            }
+
+            if ((rc < 0) || (c->closing && (c->out_sent == c->out_used) && !c->file_left))
+            {
+                client_close(&s, c);
+            }
+            else
+            {
+                client_watch(&s, c);
+            }
+        }
+    }
+
+    if (stop)
+    {
+        V_PRINT(stderr, "Stopping");
+        print_hist(&s, NULL, stderr);
+    }
+
+    // clients still connected are cut off with the process
+    if (sock >= 0)
+    {
+        close(sock);
+        unlink(path);
+    }
+    if (sig >= 0)
+    {
+        close(sig);
+    }
+    if (s.epoll >= 0)
+    {
+        close(s.epoll);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (s.archives[i].name)
+        {
+            tar_mem_close(&s.archives[i].mem);
+            close(s.archives[i].fd);
+        }
+    }
+    free(s.archives);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ret;
+}
+
+int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        ERROR("Socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    // only a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        RC_ERROR("Unable to create socket: %s", strerror(rc));
+    }
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, SOMAXCONN))
+    {
+        const int rc = errno;
+        close(sock);
+        ERROR("Unable to listen on %s: %s", path, strerror(rc));
+    }
+    return sock;
+}
+
+void accept_clients(struct server *s, const int sock)
+{
+    int fd;
+    while ((fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        struct client *c = (s->clients < SERVE_CLIENTS) ? calloc(1, sizeof(struct client)) : NULL;
+        struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+        if (!c || epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev))
+        {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->pass_fd = -1;
+        c->file = -1;
+        s->clients++;
+    }
+}
+
+int client_read(struct server *s, struct client *c)
+{
+    while (1)
+    {
+        if (c->in_used == sizeof(c->in))
+        {
+            // pipelined requests: answer the complete ones to make room
+            if (client_serve(s, c) < 0)
+            {
+                return -1;
+            }
+
+            if (c->in_used == sizeof(c->in))
+            {
+                // replies are still going out; reading resumes once they have
+                if (memchr(c->in, '\n', c->in_used))
+                {
+                    return 0;
+                }
+
+                // no newline in a full buffer
+                reply(c, "ERR\trequest too long\n");
+                c->closing = 1;
+                c->in_used = 0;
+                return client_flush(c) < 0 ? -1 : 0;
+            }
+        }
+
+        const ssize_t got = read(c->fd, c->in + c->in_used, sizeof(c->in) - c->in_used);
+        if (got < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EINTR)) ? client_serve(s, c) : -1;
+        }
+
+        if (!got)
+        {
+            // answer what was asked before the client hung up
+            c->closing = 1;
+            return client_serve(s, c);
+        }
+        c->in_used += got;
+    }
+}
+
+int client_flush(struct client *c)
+{
+    while (c->out_sent < c->out_used)
+    {
+        ssize_t sent;
+        if ((c->pass_fd >= 0) && !c->out_sent)
+        {
+            // the fd travels with the first octet of the reply
+            char control[CMSG_SPACE(sizeof(int))];
+            memset(control, 0, sizeof(control));
+            struct iovec iov = {c->out, c->out_used};
+            struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &c->pass_fd, sizeof(int));
+            sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        }
+        else
+        {
+            sent = send(c->fd, c->out + c->out_sent, c->out_used - c->out_sent, MSG_NOSIGNAL);
+        }
+
+        if (sent < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+        }
+        c->out_sent += sent;
+    }
+    c->pass_fd = -1;
+
+    while (c->file_left)
+    {
+        STATS_SYS(STATS_READ);
+        const ssize_t sent = sendfile(c->fd, c->file, &c->file_off, c->file_left);
+        if (sent < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+        }
+
+        // the archive shrank underneath us; the client sees a short reply
+        if (!sent)
+        {
+            return -1;
+        }
+        c->file_left -= sent;
+    }
+
+    c->out_used = c->out_sent = 0;
+    c->file = -1;
+    return 1;
+}
+
+int client_serve(struct server *s, struct client *c)
+{
+    char *newline;
+    while (!c->out_used && !c->file_left && (newline = memchr(c->in, '\n', c->in_used)))
+    {
+        *newline = '\0';
+        const size_t len = newline + 1 - c->in;
+        if (handle(s, c, c->in) < 0)
+        {
+            return -1;
+        }
+        memmove(c->in, c->in + len, c->in_used - len);
+        c->in_used -= len;
+
+        if (client_flush(c) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void client_watch(struct server *s, struct client *c)
+{
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    if ((c->out_sent < c->out_used) || c->file_left)
+    {
+        // stop reading until the reply is out, so a client cannot queue unbounded work
+        ev.events = EPOLLOUT;
+    }
+    epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_close(struct server *s, struct client *c)
+{
+    epoll_ctl(s->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+    s->clients--;
+}
+
+int reply(struct client *c, const char *fmt, ...)
+{
+    va_list args;
+    while (1)
+    {
+        va_start(args, fmt);
+        const int len = vsnprintf(c->out + c->out_used, c->out_cap - c->out_used, fmt, args);
+        va_end(args);
+        if (len < 0)
+        {
+            return -1;
+        }
+
+        if (c->out_used + len < c->out_cap)
+        {
+            c->out_used += len;
+            return 0;
+        }
+
+        const size_t cap = MAX(c->out_cap * 2, c->out_used + len + 4096);
+        char *out = realloc(c->out, cap);
+        if (!out)
+        {
+            return -1;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+}
+
+int handle(struct server *s, struct client *c, char *line)
+{
+    const uint64_t start = stats_now();
+    char *fields[6] = {0};
+    int n = 0;
+    for (char *save = NULL, *field = strtok_r(line, "\t", &save); field && (n < 6); field = strtok_r(NULL, "\t", &save))
+    {
+        fields[n++] = field;
+    }
+
+    enum serve_kind kind = SERVE_KINDS;
+    for (int k = 0; (k < SERVE_KINDS) && n; k++)
+    {
+        kind = strcasecmp(fields[0], kind_names[k]) ? kind : (enum serve_kind)k;
+    }
+
+    static const int arity[SERVE_KINDS] = {2, 3, 5, 3, 1};
+    if ((kind == SERVE_KINDS) || (n != arity[kind]))
+    {
+        s->errors++;
+        return reply(c, "ERR\tbad request\n");
+    }
+
+    if (kind == SERVE_STATS)
+    {
+        s->requests[kind]++;
+        return print_hist(s, c, NULL);
+    }
+
+    struct served *a = find_archive(s, fields[1]);
+    const struct tar_mem_entry *entry = (a && (n > 2)) ? tar_mem_find(&a->mem, fields[2]) : NULL;
+    int rc = 0;
+    if (!a)
+    {
+        rc = reply(c, "ERR\tno archive %s\n", fields[1]);
+    }
+    else if ((n > 2) && !entry)
+    {
+        rc = reply(c, "ERR\tno member %s\n", fields[2]);
+    }
+    else if (kind == SERVE_LIST)
+    {
+        rc = reply(c, "OK\t%zu\n", a->mem.count);
+        for (size_t i = 0; !rc && (i < a->mem.count); i++)
+        {
+            const struct tar_mem_entry *e = &a->mem.entries[i];
+            rc = reply(c, "%.*s\t%c\t%zu\t%lld\t%04o\n", (int)e->name_len, e->name, e->type ? e->type : NORMAL, e->size, (long long)e->mtime, (unsigned int)(e->mode & 07777));
+        }
+    }
+    else if (kind == SERVE_STAT)
+    {
+        rc = reply(c, "OK\t%c\t%zu\t%04o\t%lld\t%lld\n", entry->type ? entry->type : NORMAL, entry->size, (unsigned int)(entry->mode & 07777), (long long)entry->mtime, (long long)(entry->data - a->mem.base));
+    }
+    else if (kind == SERVE_OPEN)
+    {
+        c->pass_fd = a->fd;
+        rc = reply(c, "OK\t%lld\t%zu\n", (long long)(entry->data - a->mem.base), entry->size);
+    }
+    else
+    {
+        char *end1 = NULL, *end2 = NULL;
+        const unsigned long long offset = strtoull(fields[3], &end1, 10);
+        const unsigned long long length = strtoull(fields[4], &end2, 10);
+        if (*end1 || *end2 || (end1 == fields[3]) || (end2 == fields[4]))
+        {
+            rc = reply(c, "ERR\tbad range\n");
+        }
+        else
+        {
+            const size_t count = (offset < entry->size) ? MIN(length, entry->size - offset) : 0;
+            c->file = a->fd;
+            c->file_off = (entry->data - a->mem.base) + offset;
+            c->file_left = count;
+            rc = reply(c, "OK\t%zu\n", count);
+        }
+    }
+
+    s->errors += (c->out_used >= 3) && !memcmp(c->out, "ERR", 3);
+    s->requests[kind]++;
+    uint64_t ns = stats_now() - start;
+    int bucket = 0;
+    while ((ns >>= 1) && (bucket < STATS_BUCKETS - 1))
+    {
+        bucket++;
+    }
+    s->hist[kind][bucket]++;
+    return rc;
+}
+
+struct served *find_archive(struct server *s, const char *name)
+{
+    char *end = NULL;
+    const unsigned long index = strtoul(name, &end, 10);
+    if ((end != name) && !*end)
+    {
+        return (index < s->count) ? &s->archives[index] : NULL;
+    }
+
+    for (size_t i = 0; i < s->count; i++)
+    {
+        if (!strcmp(s->archives[i].name, name))
+        {
+            return &s->archives[i];
+        }
+    }
+    return NULL;
+}
+
+int print_hist(struct server *s, struct client *c, FILE *f)
+{
+    // one line per kind with requests: count, then bucket upper bound (ns) = count
+    char line[4096];
+    int lines = 0;
+    for (int k = 0; k < SERVE_KINDS; k++)
+    {
+        lines += (s->requests[k] > 0);
+    }
+
+    if (c && (reply(c, "OK\t%d\n", lines + 1) < 0))
+    {
+        return -1;
+    }
+
+    for (int k = 0; k < SERVE_KINDS; k++)
+    {
+        if (!s->requests[k])
+        {
+            continue;
+        }
+
+        int len = snprintf(line, sizeof(line), "%s\t%llu", kind_names[k], (unsigned long long)s->requests[k]);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            if (s->hist[k][b])
+            {
+                len += snprintf(line + len, sizeof(line) - len, "\t%llu=%llu", (2ull << b) - 1, (unsigned long long)s->hist[k][b]);
+            }
+        }
+
+        if (c && (reply(c, "%s\n", line) < 0))
+        {
+            return -1;
+        }
+        if (f)
+        {
+            fprintf(f, "%s\n", line);
+        }
+    }
+
+    if (c)
+    {
+        return reply(c, "errors\t%llu\n", (unsigned long long)s->errors);
+    }
+    fprintf(f, "errors\t%llu\n", (unsigned long long)s->errors);
+    return 0;
+}
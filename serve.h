@@ -0,0 +1,37 @@
+//
+// serve.h
+//
+// Resident archive server. The archives are mapped and indexed once
+// (memtar.h), then one epoll loop answers requests from any number of local
+// clients over a Unix stream socket, so a lookup costs a hash probe instead
+// of a header scan. Member data leaves as the archive fd itself (SCM_RIGHTS,
+// for the client to pread) or is sent from the page cache with sendfile
+//
+// Requests and replies are lines of tab separated fields. Archives are named
+// by their position in the serve command (0, 1, ...) or the path given there
+//
+//     LIST  archive                  OK count, then per member:
+//                                       name type size mtime mode
+//     STAT  archive member           OK type size mode mtime offset
+//     READ  archive member off len   OK n, then n octets of data from off
+//     OPEN  archive member           OK offset size, with the archive fd
+//                                    attached to the reply
+//     STATS                          OK lines, then the latency histograms
+//
+// Failures reply ERR message. offset is where the member's data starts in
+// the archive
+//
+#ifndef __SERVE__
+#define __SERVE__
+
+#include "tar.h"
+
+#define SERVE_LINE 8192    // longest request
+#define SERVE_EVENTS 64    // epoll events handled per wakeup
+#define SERVE_CLIENTS 4096 // connections held at once
+
+// serve archives on a Unix socket at path until SIGINT or SIGTERM
+// a stale socket at path is replaced; the socket is removed on exit
+TAR_API int tar_serve(const char *path, const size_t count, const char *archives[], const char verbosity);
+
+#endif
@@ -0,0 +1,471 @@
+//
+// shard.c
+//
+// Parallel sharded create and extract driven by a manifest
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // getline
+#endif
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "shard.h"
+#include "stats.h"
+
+// a source path and the archive space it takes
+struct source
+{
+    char *path;
+    off_t load; // header plus padded data
+    unsigned int shard;
+    char dir;
+};
+
+struct source_list
+{
+    struct source *items;
+    size_t count;
+    size_t cap;
+};
+
+// one writer or extractor thread
+struct shard_job
+{
+    char *path;
+    const char **files;
+    size_t count;
+    off_t bytes;
+    char selected; // extract: the shard holds a selected member
+    char verbosity;
+    int ret;
+    struct tar_ctx ctx; // derived from the caller's (ctx_inherit)
+    char errbuf[CTX_ERRBUF];
+};
+
+// walk a source in write_entries order, skipping excluded paths
+static int collect(struct source_list *list, const char *path, const char verbosity);
+
+// order sources by load, largest first
+static int by_load(const void *a, const void *b);
+
+// write one shard archive
+static void *write_shard(void *arg);
+
+// extract one shard archive
+static void *extract_shard(void *arg);
+
+// run one thread per job and wait for all of them
+static int run_jobs(struct shard_job *jobs, const unsigned int count, void *(*fn)(void *));
+
+int tar_shard_write(const char *filename, const unsigned int shards, const size_t filecount, const char *files[], const char verbosity)
+{
+    if (!filename || !shards || (shards > SHARD_MAX))
+    {
+        ERROR("Bad shard count");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    struct source_list list = {NULL, 0, 0};
+    int ret = 0;
+    for (size_t i = 0; (i < filecount) && !ret; i++)
+    {
+        ret = collect(&list, files[i], verbosity);
+    }
+
+    // greedy largest-first placement onto the least loaded shard
+    struct source **order = malloc((list.count + 1) * sizeof(struct source *));
+    struct shard_job *jobs = calloc(shards, sizeof(struct shard_job));
+    off_t *loads = calloc(shards, sizeof(off_t));
+    if (!order || !jobs || !loads)
+    {
+        tar_error("Unable to allocate shards");
+        ret = -1;
+    }
+
+    for (size_t i = 0; !ret && (i < list.count); i++)
+    {
+        order[i] = &list.items[i];
+    }
+
+    if (!ret)
+    {
+        qsort(order, list.count, sizeof(struct source *), by_load);
+        for (size_t i = 0; i < list.count; i++)
+        {
+            unsigned int best = 0;
+            for (unsigned int s = 1; s < shards; s++)
+            {
+                if (loads[s] < loads[best])
+                {
+                    best = s;
+                }
+            }
+            order[i]->shard = best;
+            loads[best] += order[i]->load;
+            jobs[best].count++;
+        }
+
+        // each shard keeps walk order so directories come before their contents
+        const size_t name_len = strlen(filename) + 12;
+        for (unsigned int s = 0; s < shards; s++)
+        {
+            jobs[s].path = malloc(name_len);
+            jobs[s].files = malloc((jobs[s].count + 1) * sizeof(char *));
+            if (!jobs[s].path || !jobs[s].files)
+            {
+                tar_error("Unable to allocate shards");
+                ret = -1;
+                break;
+            }
+            snprintf(jobs[s].path, name_len, "%s.%u", filename, s);
+            jobs[s].count = 0;
+            jobs[s].verbosity = verbosity;
+        }
+    }
+
+    if (!ret)
+    {
+        for (size_t i = 0; i < list.count; i++)
+        {
+            struct shard_job *job = &jobs[list.items[i].shard];
+            job->files[job->count++] = list.items[i].path;
+        }
+
+        // the walk already expanded directories
+        const char recursion = tar_ctx_current()->options.no_recursion;
+        tar_ctx_current()->options.no_recursion = 1;
+        ret = run_jobs(jobs, shards, write_shard);
+        tar_ctx_current()->options.no_recursion = recursion;
+    }
+
+    // manifest: shard lines, then one line per member
+    FILE *f = ret ? NULL : fopen(filename, "w");
+    if (!ret && !f)
+    {
+        tar_error("Unable to write manifest %s", filename);
+        ret = -1;
+    }
+
+    if (f)
+    {
+        const char *base = strrchr(filename, '/');
+        base = base ? base + 1 : filename;
+        fprintf(f, SHARD_MAGIC "shards %u\n", shards);
+        for (unsigned int s = 0; s < shards; s++)
+        {
+            fprintf(f, "shard %u %ld %s.%u\n", s, (long)jobs[s].bytes, base, s);
+        }
+        for (size_t i = 0; i < list.count; i++)
+        {
+            fprintf(f, "member %u %.*s%s\n", list.items[i].shard, 100, list.items[i].path, list.items[i].dir ? "/" : "");
+        }
+        if (fclose(f))
+        {
+            ret = -1;
+        }
+    }
+
+    for (unsigned int s = 0; jobs && (s < shards); s++)
+    {
+        free(jobs[s].path);
+        free(jobs[s].files);
+    }
+    for (size_t i = 0; i < list.count; i++)
+    {
+        free(list.items[i].path);
+    }
+    free(list.items);
+    free(order);
+    free(jobs);
+    free(loads);
+    return ret;
+}
+
+int tar_shard_is_manifest(const int fd)
+{
+    char magic[sizeof(SHARD_MAGIC) - 1];
+    const off_t at = seek_fd(fd, 0, SEEK_CUR);
+    const int got = read_size(fd, magic, sizeof(magic));
+    seek_fd(fd, at, SEEK_SET);
+    return (got == sizeof(magic)) && !memcmp(magic, SHARD_MAGIC, sizeof(magic));
+}
+
+int tar_shard_extract(const char *filename, const size_t filecount, const char *files[], const char verbosity)
+{
+    if (filecount && !files)
+    {
+        ERROR("Received non-zero file count but got NULL file list");
+    }
+
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        RC_ERROR("Unable to open manifest %s: %s", filename, strerror(rc));
+    }
+
+    // shard paths are relative to the manifest
+    const char *slash = strrchr(filename, '/');
+    const int dir_len = slash ? (int)(slash - filename + 1) : 0;
+
+    struct tar_match *names = tar_match_names(filecount, files);
+    const int filtered = filecount || tar_ctx_current()->options.match;
+    struct shard_job *jobs = NULL;
+    unsigned int shards = 0;
+    int ret = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    for (size_t n = 0; (len = getline(&line, &cap, f)) >= 0; n++)
+    {
+        if (len && (line[len - 1] == '\n'))
+        {
+            line[--len] = '\0';
+        }
+
+        unsigned int index = 0;
+        int skip = 0;
+        if (!n)
+        {
+            if (((size_t)len != sizeof(SHARD_MAGIC) - 2) || strncmp(line, SHARD_MAGIC, len))
+            {
+                break;
+            }
+        }
+        else if (sscanf(line, "shards %u", &index) == 1)
+        {
+            if (jobs || !index || (index > SHARD_MAX))
+            {
+                break;
+            }
+            if (!(jobs = calloc(index, sizeof(struct shard_job))))
+            {
+                tar_error("Unable to allocate shards");
+                ret = -1;
+                break;
+            }
+            shards = index;
+        }
+        else if (jobs && (sscanf(line, "shard %u %*d %n", &index, &skip) == 1) && skip && (index < shards) && !jobs[index].path)
+        {
+            const char *path = line + skip;
+            const size_t size = dir_len + strlen(path) + 1;
+            if (!(jobs[index].path = malloc(size)))
+            {
+                tar_error("Unable to allocate shards");
+                ret = -1;
+                break;
+            }
+            snprintf(jobs[index].path, size, "%.*s%s", (*path == '/') ? 0 : dir_len, filename, path);
+            jobs[index].files = files;
+            jobs[index].count = filecount;
+            jobs[index].selected = !filtered;
+            jobs[index].verbosity = verbosity;
+        }
+        else if (jobs && (sscanf(line, "member %u %n", &index, &skip) == 1) && skip && (index < shards))
+        {
+            // the manifest lets unselected shards be skipped without reading them
+            if (!jobs[index].selected && tar_match_test(names, line + skip) && tar_match_test(tar_ctx_current()->options.match, line + skip))
+            {
+                jobs[index].selected = 1;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    tar_match_free(names);
+
+    char complete = !ret && shards;
+    for (unsigned int s = 0; complete && (s < shards); s++)
+    {
+        complete = (jobs[s].path != NULL);
+    }
+
+    if (!complete)
+    {
+        for (unsigned int s = 0; s < shards; s++)
+        {
+            free(jobs[s].path);
+        }
+        free(jobs);
+        if (ret)
+        {
+            return -1;
+        }
+        ERROR("Bad manifest %s", filename);
+    }
+
+    ret = run_jobs(jobs, shards, extract_shard);
+    for (unsigned int s = 0; s < shards; s++)
+    {
+        free(jobs[s].path);
+    }
+    free(jobs);
+    return ret;
+}
+
+int collect(struct source_list *list, const char *path, const char verbosity)
+{
+    if (tar_match_excluded(tar_ctx_current()->options.match, path))
+    {
+        V_PRINT(stdout, "Excluding %s", path);
+        return 0;
+    }
+
+    struct stat st;
+    STATS_SYS(STATS_STAT);
+    if (lstat(path, &st) < 0)
+    {
+        RC_ERROR("Cannot stat %s: %s", path, strerror(rc));
+    }
+
+    if (list->count == list->cap)
+    {
+        const size_t cap = list->cap ? list->cap * 2 : 256;
+        struct source *items = realloc(list->items, cap * sizeof(struct source));
+        if (!items)
+        {
+            ERROR("Unable to allocate source list");
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+
+    // counted only once the path is owned, so cleanup frees what exists
+    struct source *src = &list->items[list->count];
+    if (!(src->path = strdup(path)))
+    {
+        ERROR("Unable to allocate source list");
+    }
+    list->count++;
+    src->dir = S_ISDIR(st.st_mode);
+    src->shard = 0;
+    src->load = 512 + (S_ISREG(st.st_mode) ? (st.st_size + 511) / 512 * 512 : 0);
+    if (!src->dir || tar_ctx_current()->options.no_recursion)
+    {
+        return 0;
+    }
+
+    size_t count = 0;
+    struct walk_entry *entries = walk_list(path, &count, verbosity);
+    if (!entries)
+    {
+        ERROR("Cannot open directory %s", path);
+    }
+
+    int ret = 0;
+    for (size_t i = 0; !ret && (i < count); i++)
+    {
+        char *child = malloc(strlen(path) + strlen(entries[i].name) + 2);
+        if (!child)
+        {
+            tar_error("Unable to allocate path");
+            ret = -1;
+            break;
+        }
+        sprintf(child, "%s/%s", path, entries[i].name);
+        ret = collect(list, child, verbosity);
+        free(child);
+    }
+    walk_list_free(entries, count);
+    return ret;
+}
+
+int by_load(const void *a, const void *b)
+{
+    const off_t x = (*(const struct source **)a)->load;
+    const off_t y = (*(const struct source **)b)->load;
+    return (x < y) - (x > y);
+}
+
+void *write_shard(void *arg)
+{
+    struct shard_job *job = arg;
+    tar_ctx_use(&job->ctx);
+    const int fd = open(job->path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        tar_error("Unable to open file %s", job->path);
+        job->ret = -1;
+        return NULL;
+    }
+
+    struct tar_t *archive = NULL;
+    const int written = tar_write(fd, &archive, job->count, job->files, job->verbosity);
+    job->ret = (written < 0) ? -1 : 0;
+    job->bytes = (written < 0) ? 0 : seek_fd(fd, 0, SEEK_END);
+    tar_free(archive);
+    if (close(fd) < 0)
+    {
+        job->ret = -1;
+    }
+    return NULL;
+}
+
+void *extract_shard(void *arg)
+{
+    struct shard_job *job = arg;
+    tar_ctx_use(&job->ctx);
+    if (!job->selected)
+    {
+        return NULL;
+    }
+
+    const int fd = open(job->path, O_RDONLY);
+    if (fd < 0)
+    {
+        tar_error("Unable to open file %s", job->path);
+        job->ret = -1;
+        return NULL;
+    }
+
+    struct tar_t *archive = NULL;
+    if ((tar_read(fd, &archive, job->verbosity) < 0) || (tar_extract(fd, archive, job->count, job->files, job->verbosity) < 0))
+    {
+        job->ret = -1;
+    }
+    tar_free(archive);
+    close(fd);
+    return NULL;
+}
+
+int run_jobs(struct shard_job *jobs, const unsigned int count, void *(*fn)(void *))
+{
+    pthread_t threads[SHARD_MAX];
+    char started[SHARD_MAX] = {0};
+    int ret = 0;
+    struct tar_ctx *ctx = tar_ctx_current();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        ctx_inherit(&jobs[i].ctx, ctx, jobs[i].errbuf);
+
+        // without a thread the job still runs, just not concurrently
+        if (!(started[i] = !pthread_create(&threads[i], NULL, fn, &jobs[i])))
+        {
+            fn(&jobs[i]);
+            tar_ctx_use(ctx);
+        }
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (jobs[i].ret < 0)
+        {
+            ctx_join(ctx, &jobs[i].ctx);
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,26 @@
+//
+// shard.h
+//
+// Sharded archives: sources split across N archives written in parallel, with
+// a small text manifest recording which shard holds each member
+//
+#ifndef __SHARD__
+#define __SHARD__
+
+#include "tar.h"
+
+#define SHARD_MAGIC "wytar-manifest 1\n"
+#define SHARD_MAX 256
+
+// walk the sources, balance them by size across shards and write
+// <filename>.0 ... <filename>.<shards - 1> concurrently; the manifest goes to filename
+TAR_API int tar_shard_write(const char *filename, const unsigned int shards, const size_t filecount, const char *files[], const char verbosity);
+
+// whether fd starts with a shard manifest (the offset is restored)
+TAR_API int tar_shard_is_manifest(const int fd);
+
+// extract the shards listed in a manifest concurrently
+// shards without selected members are not opened
+TAR_API int tar_shard_extract(const char *filename, const size_t filecount, const char *files[], const char verbosity);
+
+#endif
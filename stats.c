@@ -0,0 +1,188 @@
+//
+// stats.c
+//
+// Counters, phase timers and latency histograms behind wytar --stats
+//
+#include <inttypes.h>
+
+#include "stats.h"
+
+// nesting depth of each phase on this thread (recursion, not operation state)
+static __thread unsigned int phase_depth[PHASE_COUNT];
+
+static const char *sys_names[STATS_SYS_COUNT] = {"read", "write", "lseek", "open", "mkdir", "stat"};
+static const char *phase_names[PHASE_COUNT] = {"read", "write", "extract", "format", "remove"};
+static const char *hist_names[HIST_COUNT] = {"open", "copy", "close"};
+
+// index of the highest set bit
+static int log2_bucket(uint64_t ns);
+
+// upper bound of a bucket in nanoseconds
+static uint64_t bucket_le(const int bucket);
+
+// approximate percentile from a histogram (upper bucket bound)
+static uint64_t percentile(const uint64_t *hist, const uint64_t count, const double p);
+
+struct stats_guard stats_phase_begin(const int phase)
+{
+    struct stats_guard guard = {phase, tar_ctx_current()->stats, 0};
+    if (!guard.stats)
+    {
+        return guard;
+    }
+
+    if (!phase_depth[phase]++)
+    {
+        guard.start = stats_now();
+    }
+    return guard;
+}
+
+void stats_phase_end(struct stats_guard *guard)
+{
+    if (!guard->stats)
+    {
+        return;
+    }
+
+    // only the outermost call of a phase adds time
+    if (!--phase_depth[guard->phase])
+    {
+        __atomic_fetch_add(&guard->stats->phase_ns[guard->phase], stats_now() - guard->start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&guard->stats->phase_calls[guard->phase], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_hist_add(const int hist, const uint64_t ns)
+{
+    struct tar_stats *stats = tar_ctx_current()->stats;
+    if (!stats)
+    {
+        return;
+    }
+
+    __atomic_fetch_add(&stats->hist[hist][log2_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->hist_count[hist], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->hist_ns[hist], ns, __ATOMIC_RELAXED);
+}
+
+int tar_stats_print(FILE *f, const struct tar_stats *s, const enum stats_format format)
+{
+    if (!f || !s)
+    {
+        return -1;
+    }
+
+    if (format == STATS_JSON)
+    {
+        fprintf(f, "{\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64 ",\"syscalls\":{", s->bytes_read, s->bytes_written);
+        for (int i = 0; i < STATS_SYS_COUNT; i++)
+        {
+            fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", sys_names[i], s->syscalls[i]);
+        }
+        fprintf(f, "},\"phases\":{");
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            fprintf(f, "%s\"%s\":{\"calls\":%" PRIu64 ",\"ns\":%" PRIu64 "}", i ? "," : "", phase_names[i], s->phase_calls[i], s->phase_ns[i]);
+        }
+        fprintf(f, "},\"latency\":{");
+        for (int i = 0; i < HIST_COUNT; i++)
+        {
+            fprintf(f, "%s\"%s\":{\"count\":%" PRIu64 ",\"sum_ns\":%" PRIu64 ",\"buckets\":[", i ? "," : "", hist_names[i], s->hist_count[i], s->hist_ns[i]);
+            for (int b = 0; b < STATS_BUCKETS; b++)
+            {
+                fprintf(f, "%s%" PRIu64, b ? "," : "", s->hist[i][b]);
+            }
+            fprintf(f, "]}");
+        }
+        fprintf(f, "}}\n");
+    }
+    else if (format == STATS_PROM)
+    {
+        fprintf(f, "# TYPE wytar_bytes_read_total counter\nwytar_bytes_read_total %" PRIu64 "\n", s->bytes_read);
+        fprintf(f, "# TYPE wytar_bytes_written_total counter\nwytar_bytes_written_total %" PRIu64 "\n", s->bytes_written);
+        fprintf(f, "# TYPE wytar_syscalls_total counter\n");
+        for (int i = 0; i < STATS_SYS_COUNT; i++)
+        {
+            fprintf(f, "wytar_syscalls_total{call=\"%s\"} %" PRIu64 "\n", sys_names[i], s->syscalls[i]);
+        }
+        fprintf(f, "# TYPE wytar_phase_seconds_total counter\n");
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            fprintf(f, "wytar_phase_seconds_total{phase=\"%s\"} %.9f\n", phase_names[i], s->phase_ns[i] / 1e9);
+        }
+        fprintf(f, "# TYPE wytar_file_latency_seconds histogram\n");
+        for (int i = 0; i < HIST_COUNT; i++)
+        {
+            uint64_t cumulative = 0;
+            for (int b = 0; b < STATS_BUCKETS - 1; b++)
+            {
+                cumulative += s->hist[i][b];
+                fprintf(f, "wytar_file_latency_seconds_bucket{op=\"%s\",le=\"%.9f\"} %" PRIu64 "\n", hist_names[i], bucket_le(b) / 1e9, cumulative);
+            }
+            fprintf(f, "wytar_file_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", hist_names[i], s->hist_count[i]);
+            fprintf(f, "wytar_file_latency_seconds_sum{op=\"%s\"} %.9f\n", hist_names[i], s->hist_ns[i] / 1e9);
+            fprintf(f, "wytar_file_latency_seconds_count{op=\"%s\"} %" PRIu64 "\n", hist_names[i], s->hist_count[i]);
+        }
+    }
+    else
+    {
+        fprintf(f, "bytes read    : %" PRIu64 "\n", s->bytes_read);
+        fprintf(f, "bytes written : %" PRIu64 "\n", s->bytes_written);
+        fprintf(f, "syscalls      :");
+        for (int i = 0; i < STATS_SYS_COUNT; i++)
+        {
+            fprintf(f, " %s=%" PRIu64, sys_names[i], s->syscalls[i]);
+        }
+        fprintf(f, "\n");
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            if (s->phase_calls[i])
+            {
+                fprintf(f, "phase %-8s: %.6f s (%" PRIu64 " calls)\n", phase_names[i], s->phase_ns[i] / 1e9, s->phase_calls[i]);
+            }
+        }
+        for (int i = 0; i < HIST_COUNT; i++)
+        {
+            if (s->hist_count[i])
+            {
+                fprintf(f, "file %-6s  : n=%" PRIu64 " avg=%" PRIu64 "ns p50<=%" PRIu64 "ns p99<=%" PRIu64 "ns\n", hist_names[i], s->hist_count[i],
+                        s->hist_ns[i] / s->hist_count[i],
+                        percentile(s->hist[i], s->hist_count[i], 0.50),
+                        percentile(s->hist[i], s->hist_count[i], 0.99));
+            }
+        }
+    }
+
+    return 0;
+}
+
+int log2_bucket(uint64_t ns)
+{
+    int bucket = 0;
+    while ((ns >>= 1) && (bucket < STATS_BUCKETS - 1))
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+uint64_t bucket_le(const int bucket)
+{
+    return (2ull << bucket) - 1;
+}
+
+uint64_t percentile(const uint64_t *hist, const uint64_t count, const double p)
+{
+    const uint64_t want = (uint64_t)(count * p);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen > want)
+        {
+            return bucket_le(b);
+        }
+    }
+    return bucket_le(STATS_BUCKETS - 1);
+}
@@ -0,0 +1,139 @@
+//
+// stats.h
+//
+// Instrumentation used by tar.c and wytar.c (--stats)
+// Counters are only touched when the context's stats is set, so the cost when
+// disabled is a context lookup and a pointer test per hook
+//
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tar.h"
+
+// syscalls that are counted
+enum stats_sys
+{
+    STATS_READ,
+    STATS_WRITE,
+    STATS_LSEEK,
+    STATS_OPEN,
+    STATS_MKDIR,
+    STATS_STAT,
+    STATS_SYS_COUNT
+};
+
+// timed phases (format is nested inside write)
+enum stats_phase
+{
+    PHASE_READ,    // tar_read
+    PHASE_WRITE,   // write_entries
+    PHASE_EXTRACT, // extract_entry
+    PHASE_FORMAT,  // format_tar_data
+    PHASE_REMOVE,  // tar_remove
+    PHASE_COUNT
+};
+
+// per-file latency histograms
+enum stats_hist
+{
+    HIST_OPEN,
+    HIST_COPY,
+    HIST_CLOSE,
+    HIST_COUNT
+};
+
+// bucket i holds latencies in [2^i, 2^(i+1)) ns; last bucket is open ended
+#define STATS_BUCKETS 40
+
+struct tar_stats
+{
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls[STATS_SYS_COUNT];
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+    uint64_t hist[HIST_COUNT][STATS_BUCKETS];
+    uint64_t hist_count[HIST_COUNT];
+    uint64_t hist_ns[HIST_COUNT];
+};
+
+// output formats of tar_stats_print
+enum stats_format
+{
+    STATS_TEXT,
+    STATS_JSON,
+    STATS_PROM
+};
+
+// scope guard used by STATS_PHASE
+struct stats_guard
+{
+    int phase;
+    struct tar_stats *stats; // NULL when disabled
+    uint64_t start;
+};
+
+// monotonic clock in nanoseconds
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// start a phase; nested calls of the same phase (recursion) are only timed once
+struct stats_guard stats_phase_begin(const int phase);
+
+// finish a phase (called automatically at scope exit)
+void stats_phase_end(struct stats_guard *guard);
+
+// add a latency sample
+void stats_hist_add(const int hist, const uint64_t ns);
+
+// print collected statistics
+TAR_API int tar_stats_print(FILE *f, const struct tar_stats *s, const enum stats_format format);
+
+// count one syscall
+#define STATS_SYS(kind)                                                       \
+    do                                                                        \
+    {                                                                         \
+        struct tar_stats *stats_ = tar_ctx_current()->stats;                  \
+        if (stats_)                                                           \
+        {                                                                     \
+            __atomic_fetch_add(&stats_->syscalls[kind], 1, __ATOMIC_RELAXED); \
+        }                                                                     \
+    } while (0)
+
+// count transferred bytes
+#define STATS_BYTES(field, n)                                             \
+    do                                                                    \
+    {                                                                     \
+        struct tar_stats *stats_ = tar_ctx_current()->stats;              \
+        if (stats_ && ((n) > 0))                                          \
+        {                                                                 \
+            __atomic_fetch_add(&stats_->field, (n), __ATOMIC_RELAXED);    \
+        }                                                                 \
+    } while (0)
+
+// time the rest of the enclosing scope as the given phase
+#define STATS_PHASE(phase) \
+    struct stats_guard stats_guard __attribute__((cleanup(stats_phase_end))) = stats_phase_begin(phase)
+
+// take a timestamp for STATS_HIST (0 when disabled)
+#define STATS_CLOCK(var) const uint64_t var = tar_ctx_current()->stats ? stats_now() : 0
+
+// add the time since STATS_CLOCK(var) to a histogram
+#define STATS_HIST(hist, var)                          \
+    do                                                 \
+    {                                                  \
+        if (tar_ctx_current()->stats)                  \
+        {                                              \
+            stats_hist_add(hist, stats_now() - (var)); \
+        }                                              \
+    } while (0)
+
+#endif
@@ -9,57 +9,120 @@
 // Collaborated with Ian Moon on this Homework
 // Copyright (c) 2015 Jason Lee
 //
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+
+#include <stddef.h>
+#include <sys/mman.h>
+
 #include "tar.h"
+#include "dio.h"
+#include "durable.h"
+#include "internal.h"
+#include "match.h"
+#include "prefetch.h"
+#include "resume.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "verify.h"
+
+// source of padding and terminating blocks
+static char zeroes[RECORDSIZE];
+
+// buffers passed to a single writev()
+#define WRITE_IOV 64
+
+// octets handed to a sink per data callback
+#define SINK_CHUNK (1 << 20)
+
+// octets moved per read/write when copying member data
+#define COPY_CHUNK (1 << 16)
+
+// pass one member to a sink
+static int sink_entry(const int fd, const char *map, char *buf, struct tar_t *entry, const struct tar_sink *sink, void *ctx, const char verbosity);
+
+// write a header followed by data buffers and padding
+static int write_member(struct tar_writer *w, struct tar_t *entry, const struct iovec *iov, const int iovcnt, const off_t size);
+
+// archive octets the sources will take (stat pre-pass)
+static off_t plan_size(const size_t filecount, const char *files[], const char verbosity);
+
+// reserve space; a no-op where the filesystem cannot
+static void preallocate(const int fd, const int mode, const off_t offset, const off_t len);
+
+// tar_read, tar_write and tar_extract once the archive fd is set up
+static int read_archive(const int fd, struct tar_t **archive, const char verbosity);
+static int write_archive(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
+static int extract_archive(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
 
-#define MIN(x, y) (((x) < (y)) ? (x) : (y))
-#define MAX(x, y) (((x) > (y)) ? (x) : (y))
-// only print in verbose mode
-#define V_PRINT(f, fmt, ...)                 \
-    if (verbosity)                           \
-    {                                        \
-        fprintf(f, fmt "\n", ##__VA_ARGS__); \
-    }
-// generic error
-#define ERROR(fmt, ...)                                 \
-    fprintf(stderr, "Error: " fmt "\n", ##__VA_ARGS__); \
-    return -1;
-// capture errno when erroring
-#define RC_ERROR(fmt, ...)     \
-    const int rc = errno;      \
-    ERROR(fmt, ##__VA_ARGS__); \
-    return -1;
-#define WRITE_ERROR(fmt, ...)      \
-    {                              \
-        ERROR(fmt, ##__VA_ARGS__); \
-        tar_free(*archive);        \
-        *archive = NULL;           \
-        return -1;                 \
-    }
-#define EXIST_ERROR(fmt, ...)      \
-    const int rc = errno;          \
-    if (rc != EEXIST)              \
-    {                              \
-        ERROR(fmt, ##__VA_ARGS__); \
-        return -1;                 \
-    }
-
-// force read() to complete
-static int read_size(int fd, char *buf, int size);
-
-// force write() to complete
-static int write_size(int fd, char *buf, int size);
-
-// convert octal string to unsigned integer
-static unsigned int oct2uint(char *oct, unsigned int size);
-
-// check if a buffer is zeroed
-static int iszeroed(char *buf, size_t size);
-
-// make directory recursively
-static int recursive_mkdir(const char *dir, const unsigned int mode, const char verbosity);
+// extract_entry unless resume or keep-newer makes it unnecessary, then record progress
+// while ok (no member has failed yet); pax is the extended header in front of entry
+static int extract_member(const int fd, const struct tar_t *pax, struct tar_t *entry, const int ok, const char verbosity);
 
 int tar_read(const int fd, struct tar_t **archive, const char verbosity)
 {
+    const struct tar_options *options = &tar_ctx_current()->options;
+
+    // the archive is read through aligned buffers, bypassing the page cache
+    const int direct = options->direct && !dio_open(fd, DIO_READ, options->direct > 1, verbosity);
+    const int ret = read_archive(fd, archive, verbosity);
+    if (direct)
+    {
+        dio_close(fd);
+    }
+    return ret;
+}
+
+int tar_write(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity)
+{
+    const struct tar_options *options = &tar_ctx_current()->options;
+    const int direct = options->direct && (fd >= 0) && !dio_open(fd, DIO_WRITE, options->direct > 1, verbosity);
+    const int ret = write_archive(fd, archive, filecount, files, verbosity);
+    if (direct && (dio_close(fd) < 0))
+    {
+        ERROR("Unable to flush archive");
+    }
+
+    // give back space reserved past the end when the plan overestimated;
+    // only regular files can be trimmed, so pipes and sockets are left alone
+    if (options->prealloc && (ret >= 0))
+    {
+        struct stat st;
+        STATS_SYS(STATS_STAT);
+        const off_t end = (!fstat(fd, &st) && S_ISREG(st.st_mode)) ? seek_fd(fd, 0, SEEK_CUR) : 0;
+        if ((end > 0) && (ftruncate(fd, end) < 0))
+        {
+            RC_ERROR("Unable to trim archive: %s", strerror(rc));
+        }
+    }
+    return ret;
+}
+
+int tar_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity)
+{
+    const struct tar_options *options = &tar_ctx_current()->options;
+
+    // io_uring reads members at unaligned offsets, so it keeps the page cache
+    const int direct = options->direct && (options->io != TAR_IO_URING) && !dio_open(fd, DIO_READ, options->direct > 1, verbosity);
+    int ret = extract_archive(fd, archive, filecount, files, verbosity);
+    if (direct)
+    {
+        dio_close(fd);
+    }
+
+    if (durable_finish(verbosity) < 0)
+    {
+        ret = -1;
+    }
+    return ret;
+}
+
+int read_archive(const int fd, struct tar_t **archive, const char verbosity)
+{
+    STATS_PHASE(PHASE_READ);
+
     if (fd < 0)
     {
         ERROR("Bad file descriptor");
@@ -70,7 +133,9 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
         ERROR("Bad archive");
     }
 
-    unsigned int offset = 0;
+    // headers may be read from a resume checkpoint instead of the start
+    const off_t start = seek_fd(fd, 0, SEEK_CUR);
+    off_t offset = (start > 0) ? start : 0;
     int count = 0;
 
     struct tar_t **tar = archive;
@@ -78,10 +143,16 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
 
     for (count = 0;; count++)
     {
-        *tar = malloc(sizeof(struct tar_t));
+        if (!(*tar = malloc(sizeof(struct tar_t))))
+        {
+            ERROR("Unable to allocate entry");
+        }
+
+        // the list stays terminated whenever an error returns early
+        (*tar)->next = NULL;
         if (update && (read_size(fd, (*tar)->block, 512) != 512))
         {
-            V_PRINT(stderr, "Error: Bad read. Stopping");
+            V_ERROR("Bad read. Stopping");
             tar_free(*tar);
             *tar = NULL;
             break;
@@ -93,7 +164,7 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
         {
             if (read_size(fd, (*tar)->block, 512) != 512)
             {
-                V_PRINT(stderr, "Error: Bad read. Stopping");
+                V_ERROR("Bad read. Stopping");
                 tar_free(*tar);
                 *tar = NULL;
                 break;
@@ -106,7 +177,7 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
                 *tar = NULL;
 
                 // skip to end of record
-                if (lseek(fd, RECORDSIZE - (offset % RECORDSIZE), SEEK_CUR) == (off_t)(-1))
+                if (seek_fd(fd, RECORDSIZE - (offset % RECORDSIZE), SEEK_CUR) == (off_t)(-1))
                 {
                     RC_ERROR("Unable to seek file: %s", strerror(rc));
                 }
@@ -117,11 +188,18 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
             update = 0;
         }
 
+        if (!header_checksum_ok((*tar)->block))
+        {
+            free(*tar);
+            *tar = NULL;
+            ERROR("Bad header checksum at offset %lld", (long long)offset);
+        }
+
         // set current entry's file offset
         (*tar)->begin = offset;
 
         // skip over data and unfilled block
-        unsigned int jump = oct2uint((*tar)->size, 11);
+        off_t jump = oct2size((*tar)->size, 11);
         if (jump % 512)
         {
             jump += 512 - (jump % 512);
@@ -129,7 +207,7 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
 
         // move file descriptor
         offset += 512 + jump;
-        if (lseek(fd, jump, SEEK_CUR) == (off_t)(-1))
+        if (seek_fd(fd, jump, SEEK_CUR) == (off_t)(-1))
         {
             RC_ERROR("Unable to seek file: %s", strerror(rc));
         }
@@ -141,7 +219,7 @@ int tar_read(const int fd, struct tar_t **archive, const char verbosity)
     return count;
 }
 
-int tar_write(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity)
+int write_archive(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity)
 {
     if (fd < 0)
     {
@@ -154,7 +232,7 @@ int tar_write(const int fd, struct tar_t **archive, const size_t filecount, cons
     }
 
     // where file descriptor offset is
-    int offset = 0;
+    off_t offset = 0;
 
     // if there is old data
     struct tar_t **tar = archive;
@@ -167,7 +245,7 @@ int tar_write(const int fd, struct tar_t **archive, const size_t filecount, cons
         }
 
         // get offset past final entry
-        unsigned int jump = 512 + oct2uint((*tar)->size, 11);
+        off_t jump = 512 + oct2size((*tar)->size, 11);
         if (jump % 512)
         {
             jump += 512 - (jump % 512);
@@ -175,15 +253,28 @@ int tar_write(const int fd, struct tar_t **archive, const size_t filecount, cons
 
         // move file descriptor
         offset = (*tar)->begin + jump;
-        if (lseek(fd, offset, SEEK_SET) == (off_t)(-1))
+        if (seek_fd(fd, offset, SEEK_SET) == (off_t)(-1))
         {
             RC_ERROR("Unable to seek file: %s", strerror(rc));
         }
         tar = &((*tar)->next);
     }
 
-    // write entries first
-    if (write_entries(fd, tar, archive, filecount, files, &offset, verbosity) < 0)
+    // reserve the whole archive up front so it is laid out in few extents
+    if (tar_ctx_current()->options.prealloc)
+    {
+        preallocate(fd, FALLOC_FL_KEEP_SIZE, offset, plan_size(filecount, files, verbosity));
+    }
+
+    // write entries first; checksums are computed by the POSIX copy loop
+    struct tar_ctx *ctx = tar_ctx_current();
+    const int uring = (ctx->options.io == TAR_IO_URING) && !ctx->options.checksum;
+    ctx->prefetch = (!uring && ctx->options.prefetch) ? prefetch_start(filecount, files, ctx->options.prefetch, verbosity) : NULL;
+    const int written = uring ? uring_write_entries(fd, tar, archive, filecount, files, &offset, verbosity)
+                              : write_entries(fd, tar, archive, filecount, files, &offset, verbosity);
+    prefetch_stop(ctx->prefetch);
+    ctx->prefetch = NULL;
+    if (written < 0)
     {
         WRITE_ERROR("Failed to write entries");
     }
@@ -201,7 +292,7 @@ int tar_write(const int fd, struct tar_t **archive, const size_t filecount, cons
         memset((*tar)->name, 0, 100);
         tar = &((*tar)->next);
     }
-    return offset;
+    return 0;
 }
 
 void tar_free(struct tar_t *archive)
@@ -214,6 +305,288 @@ void tar_free(struct tar_t *archive)
     }
 }
 
+int tar_iter_open(struct tar_iter *it, const int fd, const char verbosity)
+{
+    if (!it)
+    {
+        ERROR("Bad iterator");
+    }
+
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    memset(it, 0, sizeof(struct tar_iter));
+    it->fd = fd;
+    it->verbosity = verbosity;
+
+    // pipes and sockets have to be skipped by reading
+    const off_t start = seek_fd(fd, 0, SEEK_CUR);
+    it->seekable = (start != (off_t)(-1));
+    it->offset = it->seekable ? start : 0;
+    return 0;
+}
+
+int tar_iter_next(struct tar_iter *it, struct tar_t **entry)
+{
+    if (!it || !entry)
+    {
+        ERROR("Bad iterator");
+    }
+
+    const char verbosity = it->verbosity;
+    *entry = NULL;
+    if (it->done)
+    {
+        return 0;
+    }
+
+    // move past the previous entry
+    it->remaining += it->padding;
+    it->padding = 0;
+    if (tar_iter_skip(it) < 0)
+    {
+        return -1;
+    }
+
+    struct tar_t *tar = &it->entry;
+    if (read_size(it->fd, tar->block, 512) != 512)
+    {
+        V_ERROR("Bad read. Stopping");
+        it->done = 1;
+        return 0;
+    }
+    it->offset += 512;
+
+    // a zeroed block followed by another one ends the archive
+    if (iszeroed(tar->block, 512))
+    {
+        if (read_size(it->fd, tar->block, 512) != 512)
+        {
+            V_ERROR("Bad read. Stopping");
+            it->done = 1;
+            return 0;
+        }
+        it->offset += 512;
+
+        if (iszeroed(tar->block, 512))
+        {
+            it->done = 1;
+            return 0;
+        }
+    }
+
+    if (!header_checksum_ok(tar->block))
+    {
+        it->done = 1;
+        ERROR("Bad header checksum at offset %lld", (long long)(it->offset - 512));
+    }
+
+    tar->begin = it->offset - 512;
+    tar->next = NULL;
+    it->remaining = oct2size(tar->size, 11);
+    it->padding = (512 - (it->remaining % 512)) % 512;
+    *entry = tar;
+    return 1;
+}
+
+ssize_t tar_iter_read(struct tar_iter *it, char *buf, const size_t size)
+{
+    if (!it || (size && !buf))
+    {
+        return -1;
+    }
+
+    const int want = MIN((off_t)size, MIN(it->remaining, (off_t)(1 << 30)));
+    if (want <= 0)
+    {
+        return 0;
+    }
+
+    const int got = read_size(it->fd, buf, want);
+    if (got != want)
+    {
+        tar_error("Archive ended inside entry data");
+        it->done = 1;
+        return -1;
+    }
+
+    it->remaining -= got;
+    it->offset += got;
+    return got;
+}
+
+int tar_iter_skip(struct tar_iter *it)
+{
+    if (!it)
+    {
+        return -1;
+    }
+
+    if (!it->remaining)
+    {
+        return 0;
+    }
+
+    if (it->seekable)
+    {
+        if (seek_fd(it->fd, it->remaining, SEEK_CUR) == (off_t)(-1))
+        {
+            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        }
+        it->offset += it->remaining;
+        it->remaining = 0;
+        return 0;
+    }
+
+    char buf[BLOCKSIZE * BLOCKING_FACTOR];
+    while (it->remaining)
+    {
+        const int want = MIN(it->remaining, (off_t)sizeof(buf));
+        if (read_size(it->fd, buf, want) != want)
+        {
+            ERROR("Archive ended inside entry data");
+        }
+        it->remaining -= want;
+        it->offset += want;
+    }
+    return 0;
+}
+
+void tar_iter_close(struct tar_iter *it)
+{
+    if (it)
+    {
+        it->done = 1;
+        it->remaining = 0;
+        it->padding = 0;
+    }
+}
+
+int tar_writer_open(struct tar_writer *w, const int fd, const char verbosity)
+{
+    if (!w)
+    {
+        ERROR("Bad writer");
+    }
+
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    w->fd = fd;
+    w->offset = 0;
+    w->verbosity = verbosity;
+    return 0;
+}
+
+int tar_writer_add_buffer(struct tar_writer *w, const struct tar_member *member, const void *buf, const size_t size)
+{
+    const struct iovec iov = {(void *)buf, size};
+    return tar_writer_add_iov(w, member, &iov, size ? 1 : 0);
+}
+
+int tar_writer_add_iov(struct tar_writer *w, const struct tar_member *member, const struct iovec *iov, const int iovcnt)
+{
+    if (!w || !member)
+    {
+        ERROR("Bad writer");
+    }
+
+    if ((iovcnt < 0) || (iovcnt && !iov))
+    {
+        ERROR("Bad data buffers");
+    }
+
+    off_t size = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        size += iov[i].iov_len;
+    }
+
+    struct tar_t entry;
+    if (format_tar_member(&entry, member, size) < 0)
+    {
+        return -1;
+    }
+
+    return write_member(w, &entry, iov, iovcnt, size);
+}
+
+int tar_writer_add_callback(struct tar_writer *w, const struct tar_member *member, tar_read_cb cb, void *ctx)
+{
+    if (!w || !member || !cb)
+    {
+        ERROR("Bad writer");
+    }
+
+    struct tar_t entry;
+    if (format_tar_member(&entry, member, member->size) < 0)
+    {
+        return -1;
+    }
+
+    if (write_member(w, &entry, NULL, 0, 0) < 0)
+    {
+        return -1;
+    }
+
+    // fill whole records before writing them out
+    char buf[RECORDSIZE];
+    off_t left = member->size;
+    while (left)
+    {
+        const size_t want = MIN(left, (off_t)sizeof(buf));
+        size_t got = 0;
+        while (got < want)
+        {
+            const ssize_t r = cb(ctx, buf + got, want - got);
+            if (r < 0)
+            {
+                ERROR("Data callback failed for %s", entry.name);
+            }
+            if (!r)
+            {
+                ERROR("Data callback for %s ended %ld octets early", entry.name, (long)(left - got));
+            }
+            got += r;
+        }
+
+        if (write_size(w->fd, buf, got) != got)
+        {
+            RC_ERROR("Could not write to archive: %s", strerror(rc));
+        }
+        left -= got;
+    }
+
+    if (write_padding(w->fd, member->size) < 0)
+    {
+        RC_ERROR("Could not write padding data: %s", strerror(rc));
+    }
+
+    w->offset += member->size + (512 - member->size % 512) % 512;
+    return 0;
+}
+
+off_t tar_writer_finish(struct tar_writer *w)
+{
+    if (!w)
+    {
+        ERROR("Bad writer");
+    }
+
+    const int pad = write_end_data(w->fd, w->offset % RECORDSIZE, w->verbosity);
+    if (pad < 0)
+    {
+        return -1;
+    }
+
+    w->offset += pad;
+    return w->offset;
+}
+
 int tar_ls(FILE *f, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity)
 {
     if (!verbosity)
@@ -226,64 +599,94 @@ int tar_ls(FILE *f, struct tar_t *archive, const size_t filecount, const char *f
         ERROR("Non-zero file count provided, but file list is NULL");
     }
 
-    while (archive)
+    struct tar_match *names = tar_match_names(filecount, files);
+    if (filecount && !names)
+    {
+        ERROR("Unable to compile member names");
+    }
+
+    int ret = 0;
+    for (; archive; archive = archive->next)
     {
-        if (ls_entry(f, archive, filecount, files, verbosity) < 0)
+        if (select_entry(names, archive) && (ls_entry(f, archive, 0, NULL, verbosity) < 0))
         {
-            return -1;
+            ret = -1;
+            break;
         }
-        archive = archive->next;
     }
 
-    return 0;
+    tar_match_free(names);
+    return ret;
 }
 
-int tar_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity)
+int extract_archive(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity)
 {
+    // batched durability needs every file to go through durable_create, and
+    // resume needs the per-member checks and restored mtimes of extract_entry
+    if ((tar_ctx_current()->options.io == TAR_IO_URING) && (tar_ctx_current()->options.durability != TAR_DURABLE_BATCH) &&
+        !tar_ctx_current()->options.resume && !tar_ctx_current()->options.keep_newer)
+    {
+        return uring_extract(fd, archive, filecount, files, verbosity);
+    }
+
     int ret = 0;
 
-    // extract entries with given names
-    if (filecount)
+    // extract entries with given names or patterns
+    if (filecount || tar_ctx_current()->options.match)
     {
-        if (!files)
+        if (filecount && !files)
         {
             ERROR("Received non-zero file count but got NULL file list");
         }
 
-        while (archive)
+        // compiled once; directory names select everything below them
+        struct tar_match *names = tar_match_names(filecount, files);
+        if (filecount && !names)
+        {
+            ERROR("Unable to compile member names");
+        }
+
+        const struct tar_t *pax = NULL;
+        for (; archive; archive = archive->next)
         {
-            for (size_t i = 0; i < filecount; i++)
+            // checksum records belong to the member after them
+            const struct tar_t *record = pax;
+            pax = (archive->type == PAX_HEADER) ? archive : NULL;
+            if (pax || !select_entry(names, archive))
             {
-                if (!strncmp(archive->name, files[i], MAX(strlen(archive->name), strlen(files[i]))))
-                {
-                    if (lseek(fd, archive->begin, SEEK_SET) == (off_t)(-1))
-                    {
-                        RC_ERROR("Unable to seek file: %s", strerror(rc));
-                    }
+                continue;
+            }
 
-                    if (extract_entry(fd, archive, verbosity) < 0)
-                    {
-                        ret = -1;
-                    }
-                    break;
-                }
+            if (seek_fd(fd, archive->begin, SEEK_SET) == (off_t)(-1))
+            {
+                const int rc = errno;
+                tar_match_free(names);
+                ERROR("Unable to seek file: %s", strerror(rc));
+            }
+
+            if (extract_member(fd, record, archive, !ret, verbosity) < 0)
+            {
+                ret = -1;
             }
-            archive = archive->next;
         }
+        tar_match_free(names);
     }
     // extract all
     else
     {
         // move offset to beginning
-        if (lseek(fd, 0, SEEK_SET) == (off_t)(-1))
+        if (seek_fd(fd, 0, SEEK_SET) == (off_t)(-1))
         {
             RC_ERROR("Unable to seek file: %s", strerror(rc));
         }
 
         // extract each entry
+        const struct tar_t *pax = NULL;
         while (archive)
         {
-            if (extract_entry(fd, archive, verbosity) < 0)
+            const struct tar_t *record = pax;
+            pax = (archive->type == PAX_HEADER) ? archive : NULL;
+            if (!pax && (extract_member(fd, record, archive, !ret, verbosity) < 0))
             {
                 ret = -1;
             }
@@ -293,6 +696,101 @@ int tar_extract(const int fd, struct tar_t *archive, const size_t filecount, con
     return ret;
 }
 
+int extract_member(const int fd, const struct tar_t *pax, struct tar_t *entry, const int ok, const char verbosity)
+{
+    const int skip = (tar_ctx_current()->options.resume || tar_ctx_current()->options.keep_newer) && resume_skip(fd, pax, entry, verbosity);
+    if (!skip && (extract_entry(fd, entry, verbosity) < 0))
+    {
+        return -1;
+    }
+
+    // the checkpoint stays in front of the first member that failed
+    const off_t size = oct2size(entry->size, 11);
+    if (ok && (resume_progress(entry->begin + 512 + (size + 511) / 512 * 512, skip ? 0 : size) < 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int tar_extract_sink(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const struct tar_sink *sink, void *ctx, const char verbosity)
+{
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if (!sink || !sink->data)
+    {
+        ERROR("Bad sink");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Received non-zero file count but got NULL file list");
+    }
+
+    struct tar_match *names = tar_match_names(filecount, files);
+    if (filecount && !names)
+    {
+        ERROR("Unable to compile member names");
+    }
+
+    // map regular files so data can be handed out without copying
+    struct stat st;
+    char *map = NULL;
+    char *buf = NULL;
+    STATS_SYS(STATS_STAT);
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            map = NULL;
+        }
+        else
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (!map && !(buf = malloc(SINK_CHUNK)))
+    {
+        tar_match_free(names);
+        ERROR("Unable to allocate extraction buffer");
+    }
+
+    int ret = 0;
+    for (; archive; archive = archive->next)
+    {
+        if (PAX_EXTENSION(archive->type) || !select_entry(names, archive))
+        {
+            continue;
+        }
+
+        // members past the end of the mapping were appended after it was made
+        if (map && (archive->begin + 512 + oct2size(archive->size, 11) > st.st_size))
+        {
+            tar_error("%s runs past the end of the archive", archive->name);
+            ret = -1;
+            break;
+        }
+
+        if ((ret = sink_entry(fd, map, buf, archive, sink, ctx, verbosity)) < 0)
+        {
+            break;
+        }
+    }
+
+    if (map)
+    {
+        munmap(map, st.st_size);
+    }
+    free(buf);
+    tar_match_free(names);
+    return ret;
+}
+
 int tar_update(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity)
 {
     if (!filecount)
@@ -317,6 +815,7 @@ int tar_update(const int fd, struct tar_t **archive, const size_t filecount, con
     for (int i = 0; i < filecount; i++)
     {
         // make sure original file exists
+        STATS_SYS(STATS_STAT);
         if (lstat(files[i], &st))
         {
             all = 0;
@@ -362,6 +861,8 @@ int tar_update(const int fd, struct tar_t **archive, const size_t filecount, con
 
 int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity)
 {
+    STATS_PHASE(PHASE_REMOVE);
+
     if (fd < 0)
     {
         return -1;
@@ -386,13 +887,14 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
 
     // get file permissions
     struct stat st;
+    STATS_SYS(STATS_STAT);
     if (fstat(fd, &st))
     {
         RC_ERROR("Unable to stat archive: %s", strerror(rc));
     }
 
     // reset offset of original file
-    if (lseek(fd, 0, SEEK_SET) == (off_t)(-1))
+    if (seek_fd(fd, 0, SEEK_SET) == (off_t)(-1))
     {
         RC_ERROR("Unable to seek file: %s", strerror(rc));
     }
@@ -407,25 +909,18 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
         }
     }
 
-    unsigned int read_offset = 0;
-    unsigned int write_offset = 0;
+    off_t read_offset = 0;
+    off_t write_offset = 0;
     struct tar_t *prev = NULL;
     struct tar_t *curr = *archive;
     while (curr)
     {
-        // get original size
-        int total = 512;
-
-        if ((curr->type == REGULAR) || (curr->type == NORMAL) || (curr->type == CONTIGUOUS))
-        {
-            total += oct2uint(curr->size, 11);
-            if (total % 512)
-            {
-                total += 512 - (total % 512);
-            }
-        }
+        // header plus data blocks; extended headers carry data too
+        const off_t size = oct2size(curr->size, 11);
+        const off_t total = 512 + size + (512 - size % 512) % 512;
 
-        const int match = check_match(curr, filecount, files);
+        // an extended header goes with the member it describes
+        const int match = ((curr->type == PAX_HEADER) && curr->next) ? check_match(curr->next, filecount, files) : check_match(curr, filecount, files);
 
         if (match < 0)
         {
@@ -436,11 +931,11 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
             // if the old data is not in the right place, move it
             if (write_offset < read_offset)
             {
-                int got = 0;
+                off_t got = 0;
                 while (got < total)
                 {
                     // go to old data
-                    if (lseek(fd, read_offset, SEEK_SET) == (off_t)(-1))
+                    if (seek_fd(fd, read_offset, SEEK_SET) == (off_t)(-1))
                     {
                         RC_ERROR("Cannot seek: %s", strerror(rc));
                     }
@@ -454,7 +949,7 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
                     }
 
                     // go to new position
-                    if (lseek(fd, write_offset, SEEK_SET) == (off_t)(-1))
+                    if (seek_fd(fd, write_offset, SEEK_SET) == (off_t)(-1))
                     {
                         RC_ERROR("Cannot seek: %s", strerror(rc));
                     }
@@ -477,7 +972,7 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
                 write_offset += total;
 
                 // skip past data
-                if (lseek(fd, read_offset, SEEK_SET) == (off_t)(-1))
+                if (seek_fd(fd, read_offset, SEEK_SET) == (off_t)(-1))
                 {
                     RC_ERROR("Cannot seek: %s", strerror(rc));
                 }
@@ -522,7 +1017,8 @@ int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, con
     // add end data
     if (write_end_data(fd, write_offset, verbosity) < 0)
     {
-        V_PRINT(stderr, "Error: Could not close file");
+        tar_error("Could not close file");
+        ret = -1;
     }
 
     return ret;
@@ -536,6 +1032,7 @@ int tar_diff(FILE *f, struct tar_t *archive, const char verbosity)
         V_PRINT(f, "%s", archive->name);
 
         // if not found, print error
+        STATS_SYS(STATS_STAT);
         if (lstat(archive->name, &st))
         {
             int rc = errno;
@@ -556,7 +1053,7 @@ int tar_diff(FILE *f, struct tar_t *archive, const char verbosity)
             {
                 fprintf(f, "%s: Mod time differs", archive->name);
             }
-            if (st.st_size != oct2uint(archive->size, 11))
+            if (st.st_size != oct2size(archive->size, 11))
             {
                 fprintf(f, "%s: Mod time differs", archive->name);
             }
@@ -576,12 +1073,13 @@ int print_entry_metadata(FILE *f, struct tar_t *entry)
 
     time_t mtime = oct2uint(entry->mtime, 12);
     char mtime_str[32];
-    strftime(mtime_str, sizeof(mtime_str), "%c", localtime(&mtime));
+    struct tm tm;
+    strftime(mtime_str, sizeof(mtime_str), "%c", localtime_r(&mtime, &tm));
     fprintf(f, "File Name: %s\n", entry->name);
     fprintf(f, "File Mode: %s (%03o)\n", entry->mode, oct2uint(entry->mode, 8));
     fprintf(f, "Owner UID: %s (%d)\n", entry->uid, oct2uint(entry->uid, 12));
     fprintf(f, "Owner GID: %s (%d)\n", entry->gid, oct2uint(entry->gid, 12));
-    fprintf(f, "File Size: %s (%d)\n", entry->size, oct2uint(entry->size, 12));
+    fprintf(f, "File Size: %s (%lld)\n", entry->size, (long long)oct2size(entry->size, 11));
     fprintf(f, "Time     : %s (%s)\n", entry->mtime, mtime_str);
     fprintf(f, "Checksum : %s\n", entry->check);
     fprintf(f, "File Type: ");
@@ -661,17 +1159,32 @@ struct tar_t *exists(struct tar_t *archive, const char *filename, const char ori
 
 int format_tar_data(struct tar_t *entry, const char *filename, const char verbosity)
 {
+    STATS_PHASE(PHASE_FORMAT);
+
     if (!entry)
     {
         ERROR("Bad destination entry");
     }
 
     struct stat st;
+    STATS_SYS(STATS_STAT);
     if (lstat(filename, &st))
     {
         RC_ERROR("Cannot stat %s: %s", filename, strerror(rc));
     }
 
+    return format_tar_stat(entry, filename, &st, verbosity);
+}
+
+int format_tar_stat(struct tar_t *entry, const char *filename, const struct stat *sb, const char verbosity)
+{
+    if (!entry || !sb)
+    {
+        ERROR("Bad destination entry");
+    }
+
+    const struct stat st = *sb;
+
     // remove relative path
     int move = 0;
     if (!strncmp(filename, "/", 1))
@@ -694,8 +1207,8 @@ int format_tar_data(struct tar_t *entry, const char *filename, const char verbos
     snprintf(entry->mode, sizeof(entry->mode), "%07o", st.st_mode & 0777);
     snprintf(entry->uid, sizeof(entry->uid), "%07o", st.st_uid);
     snprintf(entry->gid, sizeof(entry->gid), "%07o", st.st_gid);
-    snprintf(entry->size, sizeof(entry->size), "%011o", (int)st.st_size);
-    snprintf(entry->mtime, sizeof(entry->mtime), "%011o", (int)st.st_mtime);
+    format_size(entry->size, st.st_size);
+    snprintf(entry->mtime, sizeof(entry->mtime), "%011llo", (unsigned long long)st.st_mtime);
     strncpy(entry->group, "None", 5); // default value
     memcpy(entry->ustar, "ustar  \x00", 8);
 
@@ -739,29 +1252,33 @@ int format_tar_data(struct tar_t *entry, const char *filename, const char verbos
         break;
     case S_IFSOCK:
         entry->type = -1;
-        ERROR("Error: Cannot tar socket");
+        ERROR("Cannot tar socket");
     default:
         entry->type = -1;
-        ERROR("Error: Unknown filetype");
+        ERROR("Unknown filetype");
     }
 
     // get username
     struct passwd pwd;
     char buffer[4096];
     struct passwd *result = NULL;
-    if (getpwuid_r(st.st_uid, &pwd, buffer, sizeof(buffer), &result))
+    const int err = getpwuid_r(st.st_uid, &pwd, buffer, sizeof(buffer), &result);
+    if (err)
     {
-        const int err = errno;
         V_PRINT(stderr, "Warning: Unable to get username of uid %u for entry '%s': %s", st.st_uid, filename, strerror(err));
     }
 
-    strncpy(entry->owner, buffer, sizeof(entry->owner) - 1);
+    if (result)
+    {
+        strncpy(entry->owner, pwd.pw_name, sizeof(entry->owner) - 1);
+    }
 
     // get group name
-    struct group *grp = getgrgid(st.st_gid);
-    if (grp)
+    struct group grp;
+    struct group *found = NULL;
+    if (!getgrgid_r(st.st_gid, &grp, buffer, sizeof(buffer), &found) && found)
     {
-        strncpy(entry->group, grp->gr_name, sizeof(entry->group) - 1);
+        strncpy(entry->group, grp.gr_name, sizeof(entry->group) - 1);
     }
 
     // get the checksum
@@ -798,24 +1315,18 @@ int ls_entry(FILE *f, struct tar_t *entry, const size_t filecount, const char *f
 
     if (filecount && !files)
     {
-        V_PRINT(stderr, "Error: Non-zero file count given but no files given");
+        tar_error("Non-zero file count given but no files given");
         return -1;
     }
 
-    // figure out whether or not to print
-    // if no files were specified, print everything
-    char print = !filecount;
-    // otherwise, search for matching names
-    for (size_t i = 0; i < filecount; i++)
+    // extended headers describe the member after them
+    if (entry->type == PAX_HEADER)
     {
-        if (strncmp(entry->name, files[i], MAX(strlen(entry->name), strlen(files[i]))))
-        {
-            print = 1;
-            break;
-        }
+        return 0;
     }
 
-    if (print)
+    // if no files were specified, print everything; otherwise only exact names
+    if (!filecount || (check_match(entry, filecount, files) > 0))
     {
         if (verbosity > 1)
         {
@@ -839,13 +1350,13 @@ int ls_entry(FILE *f, struct tar_t *entry, const size_t filecount, const char *f
             case REGULAR:
             case NORMAL:
             case CONTIGUOUS:
-                rc = sprintf(size_buf, "%u", oct2uint(entry->size, 11));
+                rc = sprintf(size_buf, "%lld", (long long)oct2size(entry->size, 11));
                 break;
             case HARDLINK:
             case SYMLINK:
             case DIRECTORY:
             case FIFO:
-                rc = sprintf(size_buf, "%u", oct2uint(entry->size, 11));
+                rc = sprintf(size_buf, "%lld", (long long)oct2size(entry->size, 11));
                 break;
             case CHAR:
             case BLOCK:
@@ -861,8 +1372,9 @@ int ls_entry(FILE *f, struct tar_t *entry, const size_t filecount, const char *f
             fprintf(f, "%s", size_buf);
 
             time_t mtime = oct2uint(entry->mtime, 11);
-            struct tm *time = localtime(&mtime);
-            fprintf(f, " %d-%02d-%02d %02d:%02d ", time->tm_year + 1900, time->tm_mon + 1, time->tm_mday, time->tm_hour, time->tm_min);
+            struct tm time;
+            localtime_r(&mtime, &time);
+            fprintf(f, " %d-%02d-%02d %02d:%02d ", time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min);
         }
 
         fprintf(f, "%s", entry->name);
@@ -889,7 +1401,10 @@ int ls_entry(FILE *f, struct tar_t *entry, const size_t filecount, const char *f
 
 int extract_entry(const int fd, struct tar_t *entry, const char verbosity)
 {
+    STATS_PHASE(PHASE_EXTRACT);
+
     V_PRINT(stdout, "%s", entry->name);
+    TRACE_SCOPE(TRACE_EXTRACT, entry->name, oct2size(entry->size, 11));
 
     if ((entry->type == REGULAR) || (entry->type == NORMAL) || (entry->type == CONTIGUOUS))
     {
@@ -917,39 +1432,72 @@ int extract_entry(const int fd, struct tar_t *entry, const char verbosity)
         free(path);
 
         // create file
-        const unsigned int size = oct2uint(entry->size, 11);
-        int f = open(entry->name, O_WRONLY | O_CREAT | O_TRUNC, oct2uint(entry->mode, 7) & 0777);
+        const off_t size = oct2size(entry->size, 11);
+        const int batched = (tar_ctx_current()->options.durability == TAR_DURABLE_BATCH);
+        STATS_SYS(STATS_OPEN);
+        STATS_CLOCK(open_start);
+        int f = batched ? durable_create(entry->name, oct2uint(entry->mode, 7) & 0777)
+                        : open(entry->name, O_WRONLY | O_CREAT | O_TRUNC, oct2uint(entry->mode, 7) & 0777);
         if (f < 0)
         {
             RC_ERROR("Unable to open file %s: %s", entry->name, strerror(rc));
         }
+        STATS_HIST(HIST_OPEN, open_start);
+
+        // one allocation instead of growing 512 octets at a time
+        if (tar_ctx_current()->options.prealloc && (size >= tar_ctx_current()->options.prealloc))
+        {
+            preallocate(f, 0, 0, size);
+        }
 
         // move archive pointer to data location
-        if (lseek(fd, 512 + entry->begin, SEEK_SET) == (off_t)(-1))
+        if (seek_fd(fd, 512 + entry->begin, SEEK_SET) == (off_t)(-1))
         {
             RC_ERROR("Bad index: %s", strerror(rc));
         }
 
         // copy data to file
-        char buf[512];
-        int got = 0;
+        STATS_CLOCK(copy_start);
+        char buf[COPY_CHUNK];
+        off_t got = 0;
         while (got < size)
         {
             int r;
-            if ((r = read_size(fd, buf, MIN(size - got, 512))) < 0)
+            if ((r = read_size(fd, buf, MIN(size - got, COPY_CHUNK))) < 0)
             {
                 EXIST_ERROR("Unable to read from archive: %s", strerror(rc));
             }
 
-            if (write(f, buf, r) != r)
+            if (write_size(f, buf, r) != r)
             {
                 EXIST_ERROR("Unable to write to %s: %s", entry->name, strerror(rc));
             }
 
             got += r;
         }
+        STATS_HIST(HIST_COPY, copy_start);
 
-        close(f);
+        // a file gets the member's mtime once its data is complete, which is what resume checks
+        const struct timespec times[2] = {{0, UTIME_OMIT}, {oct2size(entry->mtime, 11), 0}};
+        if (futimens(f, times) < 0)
+        {
+            V_PRINT(stderr, "Warning: Unable to set mtime of %s: %s", entry->name, strerror(errno));
+        }
+
+        // batched files are closed when their group commits
+        STATS_CLOCK(close_start);
+        if (batched)
+        {
+            if (durable_done(f) < 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            close(f);
+        }
+        STATS_HIST(HIST_CLOSE, close_start);
     }
     else if ((entry->type == CHAR) || (entry->type == BLOCK))
     {
@@ -960,6 +1508,12 @@ int extract_entry(const int fd, struct tar_t *entry, const char verbosity)
     }
     else if (entry->type == HARDLINK)
     {
+        // the target may still be waiting under a temporary name
+        if ((tar_ctx_current()->options.durability == TAR_DURABLE_BATCH) && (durable_commit() < 0))
+        {
+            return -1;
+        }
+
         if (link(entry->link_name, entry->name) < 0)
         {
             EXIST_ERROR("Unable to create hardlink %s: %s", entry->name, strerror(rc));
@@ -1003,8 +1557,10 @@ int extract_entry(const int fd, struct tar_t *entry, const char verbosity)
     return 0;
 }
 
-int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], int *offset, const char verbosity)
+int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], off_t *offset, const char verbosity)
 {
+    STATS_PHASE(PHASE_WRITE);
+
     if (fd < 0)
     {
         ERROR("Bad file descriptor");
@@ -1024,10 +1580,20 @@ int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, con
     struct tar_t **tar = archive; // current entry
     for (unsigned int i = 0; i < filecount; i++)
     {
+        // excluded subtrees are never stat'ed or opened
+        if (tar_match_excluded(tar_ctx_current()->options.match, files[i]))
+        {
+            V_PRINT(stdout, "Excluding %s", files[i]);
+            continue;
+        }
+
         *tar = malloc(sizeof(struct tar_t));
 
         // stat file
-        if (format_tar_data(*tar, files[i], verbosity) < 0)
+        TRACE_BEGIN(TRACE_STAT, files[i], 0);
+        const int formatted = format_tar_data(*tar, files[i], verbosity);
+        TRACE_END(TRACE_STAT, files[i], (formatted < 0) ? 0 : oct2size((*tar)->size, 11));
+        if (formatted < 0)
         {
             WRITE_ERROR("Failed to stat %s", files[i]);
         }
@@ -1037,10 +1603,10 @@ int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, con
         // directories need special handling
         if ((*tar)->type == DIRECTORY)
         {
-            // save parent directory name (source will change)
+            // children are named after the source path as given (not the stored
+            // name), which is also how the lookahead walker names them
             const size_t len = strlen((*tar)->name);
-            char *parent = calloc(len + 1, sizeof(char));
-            strncpy(parent, (*tar)->name, len);
+            char *parent = strdup(files[i]);
 
             // add a '/' character to the end
             if ((len < 99) && ((*tar)->name[len - 1] != '/'))
@@ -1053,44 +1619,43 @@ int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, con
             V_PRINT(stdout, "Writing %s", (*tar)->name);
 
             // write metadata to (*tar) file
+            TRACE_BEGIN(TRACE_HEADER, (*tar)->name, 512);
             if (write_size(fd, (*tar)->block, 512) != 512)
             {
                 WRITE_ERROR("Failed to write metadata to archive");
             }
+            TRACE_END(TRACE_HEADER, (*tar)->name, 512);
 
-            // go through directory
-            DIR *d = opendir(parent);
-            if (!d)
+            // go through directory (the whole listing first, so it can be ordered)
+            size_t count = 0;
+            struct walk_entry *entries = tar_ctx_current()->options.no_recursion ? NULL : walk_list(parent, &count, verbosity);
+            if (!entries && !tar_ctx_current()->options.no_recursion)
             {
                 WRITE_ERROR("Cannot open directory %s", parent);
             }
 
-            struct dirent *dir;
-            while ((dir = readdir(d)))
+            for (size_t j = 0; j < count; j++)
             {
-                // if not special directories . and ..
-                const size_t sublen = strlen(dir->d_name);
-                if (strncmp(dir->d_name, ".", sublen) && strncmp(dir->d_name, "..", sublen))
-                {
-                    char *path = calloc(len + sublen + 2, sizeof(char));
-                    sprintf(path, "%s/%s", parent, dir->d_name);
+                const size_t sublen = strlen(entries[j].name);
+                char *path = calloc(strlen(parent) + sublen + 2, sizeof(char));
+                sprintf(path, "%s/%s", parent, entries[j].name);
 
-                    // recursively write each subdirectory
-                    if (write_entries(fd, &((*tar)->next), head, 1, (const char **)&path, offset, verbosity) < 0)
-                    {
-                        WRITE_ERROR("Recurse error");
-                    }
-
-                    // go to end of new data
-                    while ((*tar)->next)
-                    {
-                        tar = &((*tar)->next);
-                    }
+                // recursively write each subdirectory
+                if (write_entries(fd, &((*tar)->next), head, 1, (const char **)&path, offset, verbosity) < 0)
+                {
+                    WRITE_ERROR("Recurse error");
+                }
 
-                    free(path);
+                // go to end of new data
+                while ((*tar)->next)
+                {
+                    tar = &((*tar)->next);
                 }
+
+                free(path);
             }
-            closedir(d);
+
+            walk_list_free(entries, count);
 
             free(parent);
 
@@ -1123,52 +1688,133 @@ int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, con
                 }
             }
 
+            // the checksum record goes in front of the member and is filled in once the data is copied
+            const int sum = tar_ctx_current()->options.checksum && !tarred && (((*tar)->type == REGULAR) || ((*tar)->type == NORMAL) || ((*tar)->type == CONTIGUOUS));
+            // *offset lags behind inside directories, so ask the stream where it is
+            const off_t at = sum ? seek_fd(fd, 0, SEEK_CUR) : 0;
+            const off_t record = at + 512;
+            uint32_t crc = 0;
+            if (sum && (at < 0))
+            {
+                WRITE_ERROR("Checksums need a seekable archive");
+            }
+            else if (sum)
+            {
+                struct tar_t *pax = malloc(sizeof(struct tar_t));
+                char block[512];
+                pax_crc32c_header(pax, *tar);
+                pax_crc32c_record(block, 0);
+                if ((write_size(fd, pax->block, 512) != 512) || (write_size(fd, block, 512) != 512))
+                {
+                    free(pax);
+                    WRITE_ERROR("Failed to write checksum header to archive");
+                }
+
+                // the extended header is an entry of its own
+                pax->begin = at;
+                pax->next = *tar;
+                *tar = pax;
+                tar = &(pax->next);
+                *offset += 1024;
+                (*tar)->begin = at + 1024;
+            }
+
             // write metadata to (*tar) file
+            TRACE_BEGIN(TRACE_HEADER, (*tar)->name, 512);
             if (write_size(fd, (*tar)->block, 512) != 512)
             {
                 WRITE_ERROR("Failed to write metadata to archive");
             }
+            TRACE_END(TRACE_HEADER, (*tar)->name, 512);
 
             if (((*tar)->type == REGULAR) || ((*tar)->type == NORMAL) || ((*tar)->type == CONTIGUOUS))
             {
                 // if the file isn't already in the tar file, copy the contents in
                 if (!tarred)
                 {
-                    int f = open((*tar)->name, O_RDONLY);
+                    // opened ahead by the lookahead thread when it is running
+                    STATS_CLOCK(open_start);
+                    int f = prefetch_take(tar_ctx_current()->prefetch, files[i]);
+                    if (f < 0)
+                    {
+                        STATS_SYS(STATS_OPEN);
+                        f = open(files[i], O_RDONLY);
+                    }
                     if (f < 0)
                     {
                         WRITE_ERROR("Could not open %s", files[i]);
                     }
+                    STATS_HIST(HIST_OPEN, open_start);
 
-                    int r = 0;
-                    char buf[512];
-                    while ((r = read_size(f, buf, 512)) > 0)
+                    STATS_CLOCK(copy_start);
+                    TRACE_BEGIN(TRACE_COPY, (*tar)->name, oct2size((*tar)->size, 11));
+                    // on the heap, since this function recurses once per directory level
+                    char *buf = malloc(COPY_CHUNK);
+                    if (!buf)
+                    {
+                        close(f);
+                        WRITE_ERROR("Unable to allocate copy buffer");
+                    }
+
+                    // exactly the recorded size, so a file that grew cannot overrun its member
+                    const off_t size = oct2size((*tar)->size, 11);
+                    off_t done = 0;
+                    while (done < size)
                     {
-                        if (write_size(fd, buf, r) != r)
+                        const int r = read_size(f, buf, MIN(size - done, COPY_CHUNK));
+                        if (r <= 0)
+                        {
+                            // a file that shrank since it was stat'ed is zero filled, as in emit_slot
+                            memset(buf, 0, COPY_CHUNK);
+                        }
+
+                        const int n = (r > 0) ? r : MIN(size - done, COPY_CHUNK);
+                        if (write_size(fd, buf, n) != n)
                         {
-                            RC_ERROR("Could not write to archive: %s", strerror(rc));
+                            const int rc = errno;
+                            free(buf);
+                            ERROR("Could not write to archive: %s", strerror(rc));
                         }
+
+                        if (sum)
+                        {
+                            crc = crc32c(crc, buf, n);
+                        }
+                        done += n;
+                    }
+                    free(buf);
+                    TRACE_END(TRACE_COPY, (*tar)->name, oct2size((*tar)->size, 11));
+                    STATS_HIST(HIST_COPY, copy_start);
+
+                    // the data is in the archive now; do not let it crowd the page cache
+                    if (tar_ctx_current()->options.prefetch)
+                    {
+                        posix_fadvise(f, 0, 0, POSIX_FADV_DONTNEED);
                     }
 
+                    STATS_CLOCK(close_start);
                     close(f);
+                    STATS_HIST(HIST_CLOSE, close_start);
                 }
             }
 
-            // pad data to fill block
-            const unsigned int size = oct2uint((*tar)->size, 11);
-            const unsigned int pad = 512 - size % 512;
-            if (pad != 512)
+            if (sum)
             {
-                for (unsigned int j = 0; j < pad; j++)
+                char block[512];
+                pax_crc32c_record(block, crc);
+                if (patch_size(fd, block, 512, record) != 512)
                 {
-                    if (write_size(fd, "\0", 1) != 1)
-                    {
-                        WRITE_ERROR("Could not write padding data");
-                    }
+                    WRITE_ERROR("Could not record checksum of %s", (*tar)->name);
                 }
-                *offset += pad;
             }
-            *offset += size;
+
+            // pad data to fill block
+            const off_t size = oct2size((*tar)->size, 11);
+            if (write_padding(fd, size) < 0)
+            {
+                WRITE_ERROR("Could not write padding data");
+            }
+            *offset += size + (512 - size % 512) % 512;
             tar = &((*tar)->next);
         }
 
@@ -1179,7 +1825,7 @@ int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, con
     return 0;
 }
 
-int write_end_data(const int fd, int size, const char verbosity)
+int write_end_data(const int fd, const off_t size, const char verbosity)
 {
     if (fd < 0)
     {
@@ -1188,25 +1834,19 @@ int write_end_data(const int fd, int size, const char verbosity)
 
     // complete current record
     const int pad = RECORDSIZE - (size % RECORDSIZE);
-    for (int i = 0; i < pad; i++)
+    if (write_size(fd, zeroes, pad) != pad)
     {
-        if (write(fd, "\0", 1) != 1)
-        {
-            V_PRINT(stderr, "Error: Unable to close tar file");
-            return -1;
-        }
+        tar_error("Unable to close tar file");
+        return -1;
     }
 
     // if the current record does not have 2 blocks of zeros, add a whole other record
     if (pad < (2 * BLOCKSIZE))
     {
-        for (int i = 0; i < RECORDSIZE; i++)
+        if (write_size(fd, zeroes, RECORDSIZE) != RECORDSIZE)
         {
-            if (write(fd, "\0", 1) != 1)
-            {
-                V_PRINT(stderr, "Error: Unable to close tar file");
-                return -1;
-            }
+            tar_error("Unable to close tar file");
+            return -1;
         }
         return pad + RECORDSIZE;
     }
@@ -1242,26 +1882,347 @@ int check_match(struct tar_t *entry, const size_t filecount, const char *files[]
     return 0;
 }
 
+off_t plan_size(const size_t filecount, const char *files[], const char verbosity)
+{
+    struct walker walker = {files, filecount, 0, NULL, 0, 0, 0};
+    off_t size = 0;
+    char *path;
+    unsigned char type;
+    while ((path = walk_next(&walker, &type, verbosity)))
+    {
+        // every member has a header; regular files add padded data
+        struct stat st;
+        size += 512;
+        STATS_SYS(STATS_STAT);
+        if ((type == DT_REG) && !lstat(path, &st))
+        {
+            size += (st.st_size + 511) / 512 * 512 + (tar_ctx_current()->options.checksum ? 1024 : 0);
+        }
+        free(path);
+    }
+    walk_free(&walker);
+
+    // end of archive: two zero blocks, rounded up to a whole record
+    return (size + 2 * BLOCKSIZE + RECORDSIZE - 1) / RECORDSIZE * RECORDSIZE;
+}
+
+void preallocate(const int fd, const int mode, const off_t offset, const off_t len)
+{
+    if (len <= 0)
+    {
+        return;
+    }
+
+    // EOPNOTSUPP (e.g. tmpfs before 3.5, NFSv3) and friends are not errors
+    if (fallocate(fd, mode, offset, len) < 0)
+    {
+        return;
+    }
+}
+
+int select_entry(const struct tar_match *names, const struct tar_t *entry)
+{
+    // names fill all 100 octets without a terminator
+    char name[101];
+    memcpy(name, entry->name, 100);
+    name[100] = '\0';
+    return tar_match_test(names, name) && tar_match_test(tar_ctx_current()->options.match, name);
+}
+
 int read_size(int fd, char *buf, int size)
 {
+    struct dio *d = dio_find(fd);
+    if (d)
+    {
+        return dio_read(d, buf, size);
+    }
+
     int got = 0, rc;
-    while ((got < size) && ((rc = read(fd, buf + got, size - got)) > 0))
+    while (got < size)
     {
+        STATS_SYS(STATS_READ);
+        if ((rc = read(fd, buf + got, size - got)) <= 0)
+        {
+            break;
+        }
         got += rc;
     }
+    STATS_BYTES(bytes_read, got);
     return got;
 }
 
 int write_size(int fd, char *buf, int size)
 {
+    struct dio *d = dio_find(fd);
+    if (d)
+    {
+        return dio_write(d, buf, size);
+    }
+
+    int wrote = 0, rc;
+    while (wrote < size)
+    {
+        STATS_SYS(STATS_WRITE);
+        if ((rc = write(fd, buf + wrote, size - wrote)) <= 0)
+        {
+            break;
+        }
+        wrote += rc;
+    }
+    STATS_BYTES(bytes_written, wrote);
+    return wrote;
+}
+
+int patch_size(int fd, char *buf, int size, const off_t offset)
+{
+    struct dio *d = dio_find(fd);
+    if (d)
+    {
+        return dio_patch(d, buf, size, offset);
+    }
+
     int wrote = 0, rc;
-    while ((wrote < size) && ((rc = write(fd, buf + wrote, size - wrote)) > 0))
+    while (wrote < size)
     {
+        STATS_SYS(STATS_WRITE);
+        if ((rc = pwrite(fd, buf + wrote, size - wrote, offset + wrote)) <= 0)
+        {
+            break;
+        }
         wrote += rc;
     }
     return wrote;
 }
 
+int header_checksum_ok(const char *block)
+{
+    // the field is octal, optionally space padded and NUL or space terminated
+    const char *check = block + offsetof(struct tar_t, check) - offsetof(struct tar_t, block);
+    unsigned int stored = 0;
+    int i = 0;
+    while ((i < 8) && (check[i] == ' '))
+    {
+        i++;
+    }
+    while ((i < 8) && (check[i] >= '0') && (check[i] <= '7'))
+    {
+        stored = (stored << 3) | (check[i++] - '0');
+    }
+
+    // octets summed eight at a time in 16 bit lanes (at most 64 * 510 per lane),
+    // with the check field counted as spaces
+    uint64_t lanes = 0;
+    for (int j = 0; j < 512; j += 8)
+    {
+        uint64_t word;
+        memcpy(&word, block + j, 8);
+        lanes += (word & 0x00ff00ff00ff00ffull) + ((word >> 8) & 0x00ff00ff00ff00ffull);
+    }
+    unsigned int sum = 8 * ' ' + (lanes & 0xffff) + ((lanes >> 16) & 0xffff) + ((lanes >> 32) & 0xffff) + (lanes >> 48);
+    for (int j = 0; j < 8; j++)
+    {
+        sum -= (unsigned char)check[j];
+    }
+
+    if (stored == sum)
+    {
+        return 1;
+    }
+
+    // some old writers summed signed octets
+    int signed_sum = 8 * ' ';
+    for (int j = 0; j < 512; j++)
+    {
+        signed_sum += (signed char)block[j];
+    }
+    for (int j = 0; j < 8; j++)
+    {
+        signed_sum -= (signed char)check[j];
+    }
+    return stored == (unsigned int)signed_sum;
+}
+
+int write_padding(int fd, const off_t size)
+{
+    const int pad = (512 - size % 512) % 512;
+    return (write_size(fd, zeroes, pad) == pad) ? 0 : -1;
+}
+
+int format_tar_member(struct tar_t *entry, const struct tar_member *member, const off_t size)
+{
+    if (!member->name || !member->name[0])
+    {
+        ERROR("Member name is empty");
+    }
+
+    if (strlen(member->name) > 100)
+    {
+        ERROR("Member name %s is longer than 100 octets", member->name);
+    }
+
+    memset(entry, 0, sizeof(struct tar_t));
+    strncpy(entry->name, member->name, 100);
+    snprintf(entry->mode, sizeof(entry->mode), "%07o", member->mode & 0777);
+    snprintf(entry->uid, sizeof(entry->uid), "%07o", member->uid);
+    snprintf(entry->gid, sizeof(entry->gid), "%07o", member->gid);
+    format_size(entry->size, size);
+    snprintf(entry->mtime, sizeof(entry->mtime), "%011lo", (unsigned long)member->mtime);
+    entry->type = member->type ? member->type : NORMAL;
+    memcpy(entry->ustar, "ustar  \x00", 8);
+    strncpy(entry->owner, member->owner ? member->owner : "", sizeof(entry->owner) - 1);
+    strncpy(entry->group, member->group ? member->group : "None", sizeof(entry->group) - 1);
+    if (member->link_name)
+    {
+        strncpy(entry->link_name, member->link_name, 100);
+    }
+
+    calculate_checksum(entry);
+    return 0;
+}
+
+int sink_entry(const int fd, const char *map, char *buf, struct tar_t *entry, const struct tar_sink *sink, void *ctx, const char verbosity)
+{
+    V_PRINT(stdout, "%s", entry->name);
+    TRACE_SCOPE(TRACE_EXTRACT, entry->name, oct2size(entry->size, 11));
+
+    int rc = sink->begin ? sink->begin(ctx, entry) : 0;
+    if (rc < 0)
+    {
+        return -1;
+    }
+
+    // only file types carry data
+    const off_t size = ((entry->type == REGULAR) || (entry->type == NORMAL) || (entry->type == CONTIGUOUS)) ? oct2size(entry->size, 11) : 0;
+    const off_t start = (off_t)entry->begin + 512;
+    for (off_t got = 0; !rc && (got < size);)
+    {
+        const size_t want = MIN(size - got, SINK_CHUNK);
+        const char *chunk = NULL;
+        if (map)
+        {
+            chunk = map + start + got;
+        }
+        else
+        {
+            STATS_SYS(STATS_READ);
+            const ssize_t r = pread(fd, buf, want, start + got);
+            if (r <= 0)
+            {
+                const int err = r ? errno : EIO;
+                ERROR("Unable to read %s from archive: %s", entry->name, strerror(err));
+            }
+            STATS_BYTES(bytes_read, r);
+            chunk = buf;
+            if (r < want)
+            {
+                if (sink->data(ctx, entry, chunk, r) < 0)
+                {
+                    return -1;
+                }
+                got += r;
+                continue;
+            }
+        }
+
+        if (sink->data(ctx, entry, chunk, want) < 0)
+        {
+            return -1;
+        }
+        got += want;
+    }
+
+    if (sink->end && (sink->end(ctx, entry) < 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int write_member(struct tar_writer *w, struct tar_t *entry, const struct iovec *iov, const int iovcnt, const off_t size)
+{
+    const char verbosity = w->verbosity;
+    V_PRINT(stdout, "Writing %s", entry->name);
+
+    // header, data and padding go out together
+    struct iovec vec[WRITE_IOV];
+    size_t total = 512;
+    int count = 1;
+    vec[0].iov_base = entry->block;
+    vec[0].iov_len = 512;
+
+    for (int i = 0; i <= iovcnt; i++)
+    {
+        const int last = (i == iovcnt);
+        if (!last && !iov[i].iov_len)
+        {
+            continue;
+        }
+
+        if (last)
+        {
+            const size_t pad = (512 - size % 512) % 512;
+            if (pad)
+            {
+                vec[count].iov_base = zeroes;
+                vec[count++].iov_len = pad;
+                total += pad;
+            }
+        }
+        else
+        {
+            vec[count++] = iov[i];
+            total += iov[i].iov_len;
+        }
+
+        // flush when full or done
+        if (last || (count == WRITE_IOV))
+        {
+            struct iovec *v = vec;
+            int n = count;
+            while (n)
+            {
+                STATS_SYS(STATS_WRITE);
+                ssize_t wrote = writev(w->fd, v, n);
+                if (wrote <= 0)
+                {
+                    RC_ERROR("Could not write %s to archive: %s", entry->name, strerror(rc));
+                }
+                STATS_BYTES(bytes_written, wrote);
+                total -= wrote;
+                w->offset += wrote;
+
+                // drop completed buffers and adjust a partially written one
+                while (n && (wrote >= (ssize_t)v->iov_len))
+                {
+                    wrote -= v->iov_len;
+                    v++;
+                    n--;
+                }
+                if (n)
+                {
+                    v->iov_base = (char *)v->iov_base + wrote;
+                    v->iov_len -= wrote;
+                }
+            }
+            count = 0;
+        }
+    }
+
+    return 0;
+}
+
+off_t seek_fd(int fd, off_t offset, int whence)
+{
+    struct dio *d = dio_find(fd);
+    if (d)
+    {
+        return dio_seek(d, offset, whence);
+    }
+
+    STATS_SYS(STATS_LSEEK);
+    return lseek(fd, offset, whence);
+}
+
 unsigned int oct2uint(char *oct, unsigned int size)
 {
     unsigned int out = 0;
@@ -1273,6 +2234,45 @@ unsigned int oct2uint(char *oct, unsigned int size)
     return out;
 }
 
+off_t oct2size(const char *oct, unsigned int size)
+{
+    off_t out = 0;
+    int i = 0;
+
+    // base-256: the rest of the field is a big-endian binary number
+    if ((unsigned char)oct[0] & 0x80)
+    {
+        out = (unsigned char)oct[0] & 0x7f;
+        for (i = 1; i <= size; i++)
+        {
+            out = (out << 8) | (unsigned char)oct[i];
+        }
+        return out;
+    }
+
+    while ((i < size) && (oct[i] >= '0') && (oct[i] <= '7'))
+    {
+        out = (out << 3) | (off_t)(oct[i++] - '0');
+    }
+    return out;
+}
+
+void format_size(char *field, const off_t size)
+{
+    // 11 octal digits hold sizes below 8 GiB
+    if (size <= 077777777777)
+    {
+        snprintf(field, 12, "%011llo", (unsigned long long)size);
+        return;
+    }
+
+    field[0] = (char)0x80;
+    for (int i = 11; i > 0; i--)
+    {
+        field[i] = (char)((unsigned long long)size >> (8 * (11 - i)));
+    }
+}
+
 int iszeroed(char *buf, size_t size)
 {
     for (size_t i = 0; i < size; buf++, i++)
@@ -1304,6 +2304,14 @@ int recursive_mkdir(const char *dir, const unsigned int mode, const char verbosi
         path[len - 1] = 0;
     }
 
+    // usually every parent exists already, so try the whole path first
+    STATS_SYS(STATS_MKDIR);
+    if (!mkdir(path, mode ? mode : DEFAULT_DIR_MODE) || (errno == EEXIST))
+    {
+        free(path);
+        return 0;
+    }
+
     // all subsequent directories do not exist
     for (char *p = path + 1; *p; p++)
     {
@@ -1311,6 +2319,7 @@ int recursive_mkdir(const char *dir, const unsigned int mode, const char verbosi
         {
             *p = '\0';
 
+            STATS_SYS(STATS_MKDIR);
             if ((rc = mkdir(path, mode ? mode : DEFAULT_DIR_MODE)))
             {
                 EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
@@ -1320,6 +2329,7 @@ int recursive_mkdir(const char *dir, const unsigned int mode, const char verbosi
         }
     }
 
+    STATS_SYS(STATS_MKDIR);
     if (mkdir(path, mode ? mode : DEFAULT_DIR_MODE) < 0)
     {
         EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
@@ -34,8 +34,12 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// marks the library interface; everything else in libwytar is hidden
+#define TAR_API __attribute__((visibility("default")))
+
 #define DEFAULT_DIR_MODE S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH // 0755
 
 #define BLOCKSIZE 512
@@ -53,11 +57,97 @@
 #define FIFO '6'
 #define CONTIGUOUS '7'
 
+// I/O backends
+enum tar_io
+{
+    TAR_IO_POSIX, // one blocking syscall at a time
+    TAR_IO_URING  // batched io_uring submissions (falls back to POSIX when unavailable)
+};
+
+// crash safety of extraction (durable.h describes the guarantees)
+enum tar_durability
+{
+    TAR_DURABLE_NONE,   // page cache only
+    TAR_DURABLE_SYNCFS, // one syncfs at the end
+    TAR_DURABLE_BATCH   // temp files renamed into place by fsync'ed group commits
+};
+
+// order of directory entries when creating
+enum tar_sort
+{
+    TAR_SORT_NONE,   // readdir order (hash order on ext4)
+    TAR_SORT_INODE,  // inode number, close to on-disk order for small files
+    TAR_SORT_EXTENT, // physical offset of the first extent (FIEMAP), inode order otherwise
+    TAR_SORT_NAME    // byte order of names, for reproducible archives
+};
+
+// existing files that make extracting a member unnecessary (resume.h)
+enum tar_resume
+{
+    TAR_RESUME_NONE,    // always extract
+    TAR_RESUME_STAT,    // same size and mtime
+    TAR_RESUME_CHECKSUM // same size, mtime and recorded CRC32C
+};
+
+struct tar_match;
+
+// options of one context (below); the defaults keep the original behaviour
+struct tar_options
+{
+    enum tar_io io;                // backend used by tar_extract and tar_write
+    unsigned int uring_depth;      // files stat'ed, opened and read ahead by the io_uring create backend
+    const struct tar_match *match; // include/exclude patterns (match.h); NULL selects everything
+    char no_recursion;             // archive directories named as sources without their contents
+    char direct;                   // archive fd uses O_DIRECT (dio.h): 0 off, 1 on, 2 on with MAP_HUGETLB buffers
+    unsigned int prefetch;         // source files opened ahead by the POSIX create path (prefetch.h); 0 off
+    enum tar_durability durability;
+    unsigned int durable_batch;    // files per group commit with TAR_DURABLE_BATCH
+    off_t prealloc;                // fallocate extracted files of at least this size and the whole
+                                   // archive on create; 0 off
+    enum tar_sort sort;            // order directory entries are archived in
+    char checksum;                 // record a CRC32C of every regular file in a PAX header (verify.h)
+    enum tar_resume resume;        // skip regular files already extracted
+    char keep_newer;               // do not replace files newer than their member
+};
+
+// receives an error message (without the "Error: " prefix or newline)
+// worker threads of one operation may call it at the same time
+typedef void (*tar_error_cb)(void *arg, const char *message);
+
+struct tar_stats;
+struct tar_trace;
+struct dio;
+struct prefetch;
+struct durable;
+struct resume;
+
+// per-operation state: every call made on a thread runs under the context the
+// thread uses (tar_ctx_use), or a default context of its own when it uses none.
+// Worker threads started by an operation run under contexts derived from it
+// (same options, error reporting, stats and trace), and errors they report
+// reach errbuf once they are joined, so nothing here is shared under a lock
+struct tar_ctx
+{
+    struct tar_options options;
+    tar_error_cb error;  // NULL prints "Error: <message>" to stderr
+    void *error_arg;
+    char *errbuf;        // optional; receives the last error message
+    size_t errbuf_size;
+    struct tar_stats *stats; // counters behind --stats (stats.h); NULL when off
+    struct tar_trace *trace; // event recorder behind --trace (trace.h); NULL when off
+
+    // kept by the library while an operation runs; tar_ctx_init clears them
+    struct dio *dio;           // archive fds streamed with O_DIRECT (dio.h)
+    struct prefetch *prefetch; // lookahead of the running tar_write (prefetch.h)
+    struct durable *durable;   // pending group commit of TAR_DURABLE_BATCH (durable.h)
+    struct resume *resume;     // extraction journal (resume.h)
+};
+
 // tar entry metadata structure (singly-linked list)
 struct tar_t
 {
     char original_name[100]; // original filenme; only availible when writing into a tar
-    unsigned int begin;      // location of data in file (including metadata)
+    off_t begin;             // location of data in file (including metadata)
     union
     {
         union
@@ -97,35 +187,138 @@ struct tar_t
     struct tar_t *next;
 };
 
+// streaming reader state; holds one header at a time
+struct tar_iter
+{
+    int fd;
+    struct tar_t entry; // current header (reused for every entry)
+    off_t offset;       // archive offset of the next unread octet
+    off_t remaining;    // unread data octets of the current entry
+    off_t padding;      // octets between the end of the data and the next header
+    char seekable;      // skip data with lseek() instead of read()
+    char done;
+    char verbosity;
+};
+
+// caller supplied metadata for the tar_writer_add_* functions
+struct tar_member
+{
+    const char *name;      // member name (at most 100 octets)
+    mode_t mode;           // permission bits
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    char type;             // NORMAL, DIRECTORY, SYMLINK, ... (0 is treated as NORMAL)
+    const char *link_name; // target of SYMLINK and HARDLINK members
+    const char *owner;     // user name (optional)
+    const char *group;     // group name (optional)
+    off_t size;            // data size; only read by tar_writer_add_callback
+};
+
+// supplies member data for tar_writer_add_callback
+// returns number of octets placed in buf, 0 at end of data, -1 on error
+typedef ssize_t (*tar_read_cb)(void *ctx, char *buf, size_t size);
+
+// receives extracted members in place of the filesystem
+// begin returns < 0 to abort, > 0 to skip the member's data, 0 to receive it
+// data and end return < 0 to abort
+struct tar_sink
+{
+    int (*begin)(void *ctx, const struct tar_t *entry);
+    int (*data)(void *ctx, const struct tar_t *entry, const char *buf, const size_t size);
+    int (*end)(void *ctx, const struct tar_t *entry);
+};
+
+// archive writer state for members that do not come from the filesystem
+struct tar_writer
+{
+    int fd;
+    off_t offset; // octets written since tar_writer_open
+    char verbosity;
+};
+
+// contexts ////////////////////////////////////////////////////////////////////
+// default options, errors on stderr
+TAR_API void tar_ctx_init(struct tar_ctx *ctx);
+
+// run the calling thread's operations under ctx (NULL: the thread's default)
+// returns the context used before
+TAR_API struct tar_ctx *tar_ctx_use(struct tar_ctx *ctx);
+
+// context of the calling thread; its options field holds the options in effect
+TAR_API struct tar_ctx *tar_ctx_current(void);
+
+// report an error through the calling thread's context
+TAR_API void tar_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// /////////////////////////////////////////////////////////////////////////////
+
 // core functions //////////////////////////////////////////////////////////////
 // read a tar file
 // archive should be address to null pointer
-int tar_read(const int fd, struct tar_t **archive, const char verbosity);
+TAR_API int tar_read(const int fd, struct tar_t **archive, const char verbosity);
 
 // write to a tar file
 // if archive contains data, the new data will be appended to the back of the file (terminating blocks will be rewritten)
-int tar_write(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
+TAR_API int tar_write(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
 
 // recursive freeing of entries
-void tar_free(struct tar_t *archive);
+TAR_API void tar_free(struct tar_t *archive);
+
+// start streaming entries from the current offset of fd
+TAR_API int tar_iter_open(struct tar_iter *it, const int fd, const char verbosity);
+
+// advance to the next entry; any unread data of the current entry is skipped
+// entry points into the iterator and is overwritten by the next call
+// returns 1 on entry, 0 at end of archive, -1 on error
+TAR_API int tar_iter_next(struct tar_iter *it, struct tar_t **entry);
+
+// read data of the current entry
+// returns number of octets read (0 once the entry's data is exhausted), -1 on error
+TAR_API ssize_t tar_iter_read(struct tar_iter *it, char *buf, const size_t size);
+
+// skip the rest of the current entry's data
+TAR_API int tar_iter_skip(struct tar_iter *it);
+
+// finish iterating (does not close fd)
+TAR_API void tar_iter_close(struct tar_iter *it);
+
+// start writing members at the current offset of fd
+TAR_API int tar_writer_open(struct tar_writer *w, const int fd, const char verbosity);
+
+// append a member whose data is in memory (written without copying)
+TAR_API int tar_writer_add_buffer(struct tar_writer *w, const struct tar_member *member, const void *buf, const size_t size);
+
+// append a member whose data is spread over several buffers (written without copying)
+TAR_API int tar_writer_add_iov(struct tar_writer *w, const struct tar_member *member, const struct iovec *iov, const int iovcnt);
+
+// append a member of member->size octets produced by a callback
+TAR_API int tar_writer_add_callback(struct tar_writer *w, const struct tar_member *member, tar_read_cb cb, void *ctx);
+
+// write the terminating blocks; returns total archive size
+TAR_API off_t tar_writer_finish(struct tar_writer *w);
 // /////////////////////////////////////////////////////////////////////////////
 
 // utilities ///////////////////////////////////////////////////////////////////
 // print contents of archive
 // verbosity should be greater than 0
-int tar_ls(FILE *f, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
+TAR_API int tar_ls(FILE *f, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
 
 // extracts files from an archive
-int tar_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
+TAR_API int tar_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
+
+// hands members to a sink instead of creating files
+// data is passed as views into a read-only mapping of the archive when possible,
+// otherwise in 1 MiB reads with pread() (fd must be seekable either way)
+TAR_API int tar_extract_sink(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const struct tar_sink *sink, void *ctx, const char verbosity);
 
 // update files in tar with provided list
-int tar_update(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
+TAR_API int tar_update(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
 
 // remove entries from tar
-int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
+TAR_API int tar_remove(const int fd, struct tar_t **archive, const size_t filecount, const char *files[], const char verbosity);
 
 // show files that are missing from the current directory
-int tar_diff(FILE *f, struct tar_t *archive, const char verbosity);
+TAR_API int tar_diff(FILE *f, struct tar_t *archive, const char verbosity);
 // /////////////////////////////////////////////////////////////////////////////
 
 // internal functions; generally don't call from outside ///////////////////////
@@ -141,6 +334,9 @@ struct tar_t *exists(struct tar_t *archive, const char *filename, const char ori
 // read file and construct metadata
 int format_tar_data(struct tar_t *entry, const char *filename, const char verbosity);
 
+// construct metadata from an existing stat result
+int format_tar_stat(struct tar_t *entry, const char *filename, const struct stat *st, const char verbosity);
+
 // calculate checksum (6 ASCII octet digits + NULL + space)
 unsigned int calculate_checksum(struct tar_t *entry);
 
@@ -153,10 +349,10 @@ int ls_entry(FILE *f, struct tar_t *archive, const size_t filecount, const char
 int extract_entry(const int fd, struct tar_t *entry, const char verbosity);
 
 // write entries to a tar file
-int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], int *offset, const char verbosity);
+int write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], off_t *offset, const char verbosity);
 
 // add ending data
-int write_end_data(const int fd, int size, const char verbosity);
+int write_end_data(const int fd, const off_t size, const char verbosity);
 
 // check if entry is a match for any of the given file names
 // returns index + 1 if match is found
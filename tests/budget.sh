@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# budget.sh
+#
+# Syscall budget regression tests: runs wytar create and extract on fixed
+# fixture trees under the syscount.so LD_PRELOAD shim and fails when a count
+# goes over its per-member or per-MiB budget
+#
+# usage: tests/budget.sh [WYTAR [SHIM]]
+#
+
+WYTAR=$(realpath "${1:-./wytar}")
+SHIM=$(realpath "${2:-tests/syscount.so}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+# fixture trees, the same on every run
+#   small: 4 levels of directories holding 240 files of 0-6 KiB (odd sizes pad)
+#   large: three 3 MiB files
+fixtures()
+{
+    mkdir -p "$WORK/small" "$WORK/large"
+    for a in 0 1 2 3; do
+        for b in 0 1 2; do
+            d="$WORK/small/d$a/e$b/f/g"
+            mkdir -p "$d"
+            for i in $(seq 0 19); do
+                head -c $(( (a * 1000 + b * 300 + i * 317) % 6144 )) /dev/zero > "$d/file$i"
+            done
+        done
+    done
+    for i in 0 1 2; do
+        head -c 3145728 /dev/zero > "$WORK/large/blob$i"
+    done
+}
+
+# run wytar in a directory under the shim; leaves the counts in $counts
+counted()
+{
+    rm -f "$WORK/counts"
+    (cd "$1" && shift && SYSCOUNT_OUT="$WORK/counts" LD_PRELOAD="$SHIM" "$WYTAR" "$@" > /dev/null) || return 1
+    counts=$(cat "$WORK/counts")
+}
+
+# check one scenario: budget NAME UNITS UNIT read write lseek open mkdir stat
+# each budget is calls per unit (member or MiB of data) plus a fixed 16 for setup
+budget()
+{
+    label=$1
+    units=$2
+    unit=$3
+    shift 3
+    over=0
+    for kind in read write lseek open mkdir stat; do
+        limit=$(( $1 * units + 16 ))
+        got=$(echo "$counts" | tr ' ' '\n' | sed -n "s/^$kind=//p")
+        if [ "$got" -gt "$limit" ]; then
+            echo "FAIL $label: $kind=$got over budget $limit ($1 per $unit)"
+            over=1
+        fi
+        shift
+    done
+
+    if [ $over = 0 ]; then
+        echo "ok   $label: $counts"
+    fi
+    failed=$((failed | over))
+}
+
+# scenario NAME TREE UNIT budgets...; UNIT is member or MiB
+scenario()
+{
+    name=$1
+    tree=$2
+    unit=$3
+    shift 3
+    if [ "$unit" = MiB ]; then
+        units=$(( $(cd "$WORK" && find "$tree" -type f -exec cat {} + | wc -c) / 1048576 ))
+    else
+        units=$(cd "$WORK" && find "$tree" | wc -l)
+    fi
+    rm -rf "$WORK/out" && mkdir "$WORK/out"
+
+    if ! counted "$WORK" c f "$WORK/$tree.tar" "$tree"; then
+        echo "FAIL $name: create failed"
+        failed=1
+        return
+    fi
+    budget "create $name" "$units" "$unit" $1 $2 $3 $4 $5 $6
+    shift 6
+
+    if ! counted "$WORK/out" x f "$WORK/$tree.tar" || ! diff -r "$WORK/$tree" "$WORK/out/$tree" > /dev/null; then
+        echo "FAIL $name: extract failed"
+        failed=1
+        return
+    fi
+    budget "extract $name" "$units" "$unit" $1 $2 $3 $4 $5 $6
+}
+
+fixtures
+
+# budgets sit just above the current counts, so that a mkdir per path
+# component or a read/write per 512 octet block fails them; lower them as
+# fixes land so the savings stay
+#                            create: read write lseek open mkdir stat | extract: read write lseek open mkdir stat
+scenario small small member          1    3     0     1    0     1               2    1     2     1    1     0
+scenario large large MiB             20   20    0     1    0     1               20   20    1     1    1     0
+
+exit $failed
@@ -0,0 +1,226 @@
+//
+// syscount.c
+//
+// LD_PRELOAD shim counting the read, write, lseek, open, mkdir and stat
+// families of libc calls a process makes. The totals are appended as one
+// line to the file named by SYSCOUNT_OUT (stderr when unset) at exit:
+//
+//     read=N write=N lseek=N open=N mkdir=N stat=N
+//
+// Only calls through the dynamic symbol table are seen; libc's own internal
+// calls (stdio buffers) and io_uring submissions are not
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // RTLD_NEXT, statx
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum count_kind
+{
+    COUNT_READ,
+    COUNT_WRITE,
+    COUNT_LSEEK,
+    COUNT_OPEN,
+    COUNT_MKDIR,
+    COUNT_STAT,
+    COUNT_KINDS,
+};
+
+static const char *count_names[COUNT_KINDS] = {"read", "write", "lseek", "open", "mkdir", "stat"};
+
+static unsigned long counts[COUNT_KINDS];
+
+// count a call and find the next definition of it
+#define NEXT(kind, name, ret, args)                                    \
+    __atomic_fetch_add(&counts[kind], 1, __ATOMIC_RELAXED);           \
+    static ret(*real_##name) args = NULL;                             \
+    if (!real_##name)                                                 \
+    {                                                                 \
+        real_##name = (ret(*) args)dlsym(RTLD_NEXT, #name);           \
+    }
+
+// open flags that take a mode argument
+#define NEEDS_MODE(flags) (((flags) & O_CREAT) || (((flags) & O_TMPFILE) == O_TMPFILE))
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    NEXT(COUNT_READ, read, ssize_t, (int, void *, size_t));
+    return real_read(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    NEXT(COUNT_READ, pread, ssize_t, (int, void *, size_t, off_t));
+    return real_pread(fd, buf, count, offset);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    NEXT(COUNT_READ, readv, ssize_t, (int, const struct iovec *, int));
+    return real_readv(fd, iov, iovcnt);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    NEXT(COUNT_WRITE, write, ssize_t, (int, const void *, size_t));
+    return real_write(fd, buf, count);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    NEXT(COUNT_WRITE, pwrite, ssize_t, (int, const void *, size_t, off_t));
+    return real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    NEXT(COUNT_WRITE, writev, ssize_t, (int, const struct iovec *, int));
+    return real_writev(fd, iov, iovcnt);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    NEXT(COUNT_LSEEK, lseek, off_t, (int, off_t, int));
+    return real_lseek(fd, offset, whence);
+}
+
+int open(const char *path, int flags, ...)
+{
+    NEXT(COUNT_OPEN, open, int, (const char *, int, ...));
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    NEXT(COUNT_OPEN, open64, int, (const char *, int, ...));
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return real_open64(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    NEXT(COUNT_OPEN, openat, int, (int, const char *, int, ...));
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return real_openat(dirfd, path, flags, mode);
+}
+
+int creat(const char *path, mode_t mode)
+{
+    NEXT(COUNT_OPEN, creat, int, (const char *, mode_t));
+    return real_creat(path, mode);
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+    NEXT(COUNT_MKDIR, mkdir, int, (const char *, mode_t));
+    return real_mkdir(path, mode);
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+    NEXT(COUNT_MKDIR, mkdirat, int, (int, const char *, mode_t));
+    return real_mkdirat(dirfd, path, mode);
+}
+
+int stat(const char *path, struct stat *st)
+{
+    NEXT(COUNT_STAT, stat, int, (const char *, struct stat *));
+    return real_stat(path, st);
+}
+
+int lstat(const char *path, struct stat *st)
+{
+    NEXT(COUNT_STAT, lstat, int, (const char *, struct stat *));
+    return real_lstat(path, st);
+}
+
+int fstat(int fd, struct stat *st)
+{
+    NEXT(COUNT_STAT, fstat, int, (int, struct stat *));
+    return real_fstat(fd, st);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+    NEXT(COUNT_STAT, fstatat, int, (int, const char *, struct stat *, int));
+    return real_fstatat(dirfd, path, st, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *st)
+{
+    NEXT(COUNT_STAT, statx, int, (int, const char *, int, unsigned int, struct statx *));
+    return real_statx(dirfd, path, flags, mask, st);
+}
+
+// glibc before 2.33 routes the stat family through these
+int __xstat(int ver, const char *path, struct stat *st)
+{
+    NEXT(COUNT_STAT, __xstat, int, (int, const char *, struct stat *));
+    return real___xstat(ver, path, st);
+}
+
+int __lxstat(int ver, const char *path, struct stat *st)
+{
+    NEXT(COUNT_STAT, __lxstat, int, (int, const char *, struct stat *));
+    return real___lxstat(ver, path, st);
+}
+
+int __fxstat(int ver, int fd, struct stat *st)
+{
+    NEXT(COUNT_STAT, __fxstat, int, (int, int, struct stat *));
+    return real___fxstat(ver, fd, st);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    char line[256];
+    int len = 0;
+    for (int i = 0; i < COUNT_KINDS; i++)
+    {
+        len += snprintf(line + len, sizeof(line) - len, "%s%s=%lu", i ? " " : "", count_names[i], __atomic_load_n(&counts[i], __ATOMIC_RELAXED));
+    }
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+
+    // the shim's own calls are not counted: they happen after the snapshot
+    const char *path = getenv("SYSCOUNT_OUT");
+    FILE *out = path ? fopen(path, "a") : stderr;
+    if (out)
+    {
+        fputs(line, out);
+        if (out != stderr)
+        {
+            fclose(out);
+        }
+    }
+}
@@ -0,0 +1,234 @@
+//
+// trace.c
+//
+// Lock-free per-thread event buffers and Chrome trace-event export
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_CHUNK 4096 // events per chunk
+
+struct trace_event
+{
+    uint64_t ts; // nanoseconds since tar_trace_new
+    uint64_t size;
+    char kind;
+    char phase;
+    char path[102]; // member names are at most 100 octets
+};
+
+struct trace_chunk
+{
+    struct trace_event events[TRACE_CHUNK];
+    unsigned int used;
+    struct trace_chunk *next;
+};
+
+// one per recording thread; only the owner appends to it
+struct trace_buffer
+{
+    pthread_t owner;
+    long tid;
+    struct trace_chunk *head;
+    struct trace_chunk *tail;
+    struct trace_buffer *next;
+};
+
+struct tar_trace
+{
+    uint64_t start; // clock at tar_trace_new
+    struct trace_buffer *buffers; // pushed with compare-and-swap
+};
+
+static const char *kind_names[TRACE_KIND_COUNT] = {"stat", "header", "copy", "extract"};
+
+// monotonic clock in nanoseconds
+static uint64_t now(void);
+
+// get or register the calling thread's buffer
+static struct trace_buffer *thread_buffer(struct tar_trace *trace);
+
+// write a string with JSON escaping
+static void write_json_string(FILE *f, const char *str);
+
+struct tar_trace *tar_trace_new(void)
+{
+    struct tar_trace *trace = calloc(1, sizeof(struct tar_trace));
+    if (trace)
+    {
+        trace->start = now();
+    }
+    return trace;
+}
+
+void trace_event(struct tar_trace *trace, const int kind, const char phase, const char *path, const uint64_t size)
+{
+    struct trace_buffer *buf = thread_buffer(trace);
+    if (!buf)
+    {
+        return;
+    }
+
+    if (!buf->tail || (buf->tail->used == TRACE_CHUNK))
+    {
+        struct trace_chunk *chunk = malloc(sizeof(struct trace_chunk));
+        if (!chunk)
+        {
+            return;
+        }
+        chunk->used = 0;
+        chunk->next = NULL;
+        if (buf->tail)
+        {
+            buf->tail->next = chunk;
+        }
+        else
+        {
+            buf->head = chunk;
+        }
+        buf->tail = chunk;
+    }
+
+    struct trace_event *ev = &buf->tail->events[buf->tail->used++];
+    ev->ts = now() - trace->start;
+    ev->size = size;
+    ev->kind = kind;
+    ev->phase = phase;
+    ev->path[0] = '\0';
+    if (path)
+    {
+        strncpy(ev->path, path, sizeof(ev->path) - 1);
+        ev->path[sizeof(ev->path) - 1] = '\0';
+    }
+}
+
+void trace_scope_end(struct trace_guard *guard)
+{
+    if (guard->trace)
+    {
+        trace_event(guard->trace, guard->kind, 'E', guard->path, guard->size);
+    }
+}
+
+int tar_trace_write(const struct tar_trace *trace, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        return -1;
+    }
+
+    const int pid = getpid();
+    int first = 1;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (struct trace_buffer *buf = __atomic_load_n(&trace->buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+    {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"wytar %ld\"}}", first ? "" : ",\n", pid, buf->tid, buf->tid);
+        first = 0;
+        for (struct trace_chunk *chunk = buf->head; chunk; chunk = chunk->next)
+        {
+            for (unsigned int i = 0; i < chunk->used; i++)
+            {
+                const struct trace_event *ev = &chunk->events[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"wytar\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%ld,\"args\":{\"path\":",
+                        kind_names[(int)ev->kind], ev->phase, ev->ts / 1000, ev->ts % 1000, pid, buf->tid);
+                write_json_string(f, ev->path);
+                fprintf(f, ",\"size\":%lu}}", ev->size);
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) ? -1 : 0;
+}
+
+void tar_trace_free(struct tar_trace *trace)
+{
+    if (!trace)
+    {
+        return;
+    }
+
+    struct trace_buffer *buf = trace->buffers;
+    while (buf)
+    {
+        struct trace_buffer *next = buf->next;
+        while (buf->head)
+        {
+            struct trace_chunk *chunk = buf->head->next;
+            free(buf->head);
+            buf->head = chunk;
+        }
+        free(buf);
+        buf = next;
+    }
+    free(trace);
+}
+
+uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct trace_buffer *thread_buffer(struct tar_trace *trace)
+{
+    // a trace is written by a handful of threads, so a scan is cheap
+    const pthread_t self = pthread_self();
+    for (struct trace_buffer *buf = __atomic_load_n(&trace->buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+    {
+        if (pthread_equal(buf->owner, self))
+        {
+            return buf;
+        }
+    }
+
+    struct trace_buffer *buf = calloc(1, sizeof(struct trace_buffer));
+    if (!buf)
+    {
+        return NULL;
+    }
+    buf->owner = self;
+    buf->tid = syscall(SYS_gettid);
+
+    // push onto the trace's list
+    buf->next = __atomic_load_n(&trace->buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace->buffers, &buf->next, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return buf;
+}
+
+void write_json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++)
+    {
+        const unsigned char c = *str;
+        if ((c == '"') || (c == '\\'))
+        {
+            fprintf(f, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(f, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
@@ -0,0 +1,79 @@
+//
+// trace.h
+//
+// Per-entry event tracer used by tar.c and wytar.c (--trace)
+// Events are recorded into the context's trace, one buffer per thread and
+// without locking, and written out in the Chrome trace-event format (loads in
+// Perfetto and chrome://tracing)
+//
+#ifndef __TRACE__
+#define __TRACE__
+
+#include <stdint.h>
+
+#include "tar.h"
+
+// traced steps of a member
+enum trace_kind
+{
+    TRACE_STAT,
+    TRACE_HEADER,
+    TRACE_COPY,
+    TRACE_EXTRACT,
+    TRACE_KIND_COUNT
+};
+
+// scope guard used by TRACE_SCOPE
+struct trace_guard
+{
+    struct tar_trace *trace; // NULL when not tracing
+    int kind;
+    const char *path;
+    uint64_t size;
+};
+
+// start recording (set it as a context's trace); NULL when out of memory
+TAR_API struct tar_trace *tar_trace_new(void);
+
+// record a begin ('B') or end ('E') event on the calling thread's buffer
+void trace_event(struct tar_trace *trace, const int kind, const char phase, const char *path, const uint64_t size);
+
+// end the event opened by TRACE_SCOPE (called automatically at scope exit)
+void trace_scope_end(struct trace_guard *guard);
+
+// write all recorded events as Chrome trace JSON
+// call once no other thread is recording
+TAR_API int tar_trace_write(const struct tar_trace *trace, const char *filename);
+
+// release a trace and all of its buffers
+TAR_API void tar_trace_free(struct tar_trace *trace);
+
+#define TRACE_BEGIN(kind, path, size)                        \
+    do                                                       \
+    {                                                        \
+        struct tar_trace *trace_ = tar_ctx_current()->trace; \
+        if (trace_)                                          \
+        {                                                    \
+            trace_event(trace_, kind, 'B', path, size);      \
+        }                                                    \
+    } while (0)
+
+#define TRACE_END(kind, path, size)                          \
+    do                                                       \
+    {                                                        \
+        struct tar_trace *trace_ = tar_ctx_current()->trace; \
+        if (trace_)                                          \
+        {                                                    \
+            trace_event(trace_, kind, 'E', path, size);      \
+        }                                                    \
+    } while (0)
+
+// trace the rest of the enclosing scope
+#define TRACE_SCOPE(kind, path, size)                                                                                          \
+    struct trace_guard trace_guard __attribute__((cleanup(trace_scope_end))) = {tar_ctx_current()->trace, kind, path, size}; \
+    if (trace_guard.trace)                                                                                                     \
+    {                                                                                                                          \
+        trace_event(trace_guard.trace, kind, 'B', path, size);                                                                 \
+    }
+
+#endif
@@ -0,0 +1,1128 @@
+//
+// uring.c
+//
+// io_uring ring setup over raw syscalls, the batched extraction backend and
+// the read-ahead create backend
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // struct statx
+#endif
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "internal.h"
+#include "match.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "verify.h"
+
+#define URING_ENTRIES 256        // submission queue depth
+#define URING_SLOTS 64           // members per batch (registered file slots)
+#define URING_ARENA (8 << 20)    // archive octets buffered per batch
+#define URING_MAX_MEMBER (1 << 20) // larger members go through extract_entry
+
+// user_data layout: operation << 32 | batch << 16 | member
+#define OP_READ 1ull
+#define OP_OPEN 2ull
+#define OP_WRITE 3ull
+#define OP_CLOSE 4ull
+#define OP_STATX 5ull
+#define USER_DATA(op, batch, index) (((op) << 32) | ((uint64_t)(batch) << 16) | (index))
+
+#define URING_READAHEAD (128 << 10) // data read ahead per create slot
+
+// a member queued for extraction
+struct batch_member
+{
+    struct tar_t *entry;
+    char name[101]; // terminated copy; must stay valid until submission
+    size_t offset;  // data location inside the arena
+    size_t size;
+    mode_t mode;
+    char failed;
+};
+
+// archive octets read by a single READ_FIXED
+struct batch_run
+{
+    off_t begin; // archive offset
+    size_t offset; // arena offset
+    size_t size;
+};
+
+struct batch
+{
+    int id;
+    char *arena;
+    struct batch_member members[URING_SLOTS];
+    size_t count;
+    struct batch_run runs[URING_SLOTS];
+    size_t run_count;
+    size_t used; // arena octets
+};
+
+// a file in the create window
+enum slot_state
+{
+    SLOT_EMPTY,
+    SLOT_STAT,  // statx in flight
+    SLOT_OPEN,  // openat in flight
+    SLOT_READ,  // read in flight
+    SLOT_READY, // can be emitted
+    SLOT_FAILED
+};
+
+struct create_slot
+{
+    char *path;
+    enum slot_state state;
+    struct statx stx;
+    int fd;       // source file (regular files only)
+    char *buf;    // read-ahead data
+    size_t got;   // octets in buf
+    int err;      // errno of the failed step
+};
+
+// cached results of the support probes (0 unknown, 1 yes, -1 no); threads
+// racing on the first probe reach the same answer
+static int supported = 0;
+static int create_supported = 0;
+
+// queue the statx of a slot
+static int queue_statx(struct uring *ring, struct create_slot *slots, const size_t index);
+
+// advance slots as completions arrive
+static int reap_create(struct uring *ring, struct create_slot *slots, const unsigned int wait);
+
+// write one finished slot to the archive
+static int emit_slot(const int fd, struct tar_t **tar, struct tar_t **head, struct create_slot *slot, off_t *offset, const char verbosity);
+
+// whether an entry can be extracted inside a batch
+static int batchable(const struct tar_t *entry);
+
+// extract selected entries one at a time (fallback)
+static int extract_each(const int fd, struct tar_t *archive, const struct tar_match *names, const char verbosity);
+
+// uring_extract once the member names are compiled
+static int extract_batched(const int fd, struct tar_t *archive, const struct tar_match *names, const char verbosity);
+
+// make the parent directory of a member, skipping repeats of the previous parent
+static int make_parent(const char *name, char *last, const char verbosity);
+
+// queue consecutive batchable entries; stops at the first entry that is not
+static struct tar_t *plan_batch(const int fd, struct batch *b, struct tar_t *archive, const struct tar_match *names, char *last_parent, const char verbosity);
+
+// prepare the reads of a batch
+static int queue_reads(struct uring *ring, const int fd, struct batch *b);
+
+// prepare openat -> write -> close chains for a batch
+static int queue_writes(struct uring *ring, struct batch *b);
+
+// submit everything prepared and handle all completions
+static int complete(struct uring *ring, struct batch *batches, const unsigned int pending, const char verbosity);
+
+int uring_init(struct uring *ring, const unsigned int entries)
+{
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    const int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_ring_size = ring->cq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            uring_exit(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(struct uring *ring)
+{
+    if (ring->sqes)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && (ring->cq_ring != ring->sq_ring))
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+    const unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->entries)
+    {
+        return NULL;
+    }
+
+    const unsigned int index = ring->sqe_tail++ & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, const unsigned int wait)
+{
+    const unsigned int tail = *ring->sq_tail;
+    const unsigned int count = ring->sqe_tail - tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    int rc;
+    do
+    {
+        rc = syscall(__NR_io_uring_enter, ring->fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while ((rc < 0) && (errno == EINTR));
+
+    return (rc < 0) ? -1 : rc;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *ring)
+{
+    const unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_probe(struct uring *ring, const int *ops, const size_t count)
+{
+    const size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe)
+    {
+        return 0;
+    }
+
+    int ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (size_t i = 0; ok && (i < count); i++)
+    {
+        ok = (ops[i] <= probe->last_op) && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+int uring_register_files(struct uring *ring, const unsigned int count)
+{
+    int *fds = malloc(count * sizeof(int));
+    if (!fds)
+    {
+        return -1;
+    }
+
+    memset(fds, 0xff, count * sizeof(int)); // -1 marks an empty slot
+    const int rc = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return (rc < 0) ? -1 : 0;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, const unsigned int count)
+{
+    return (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) < 0) ? -1 : 0;
+}
+
+int uring_extract_supported(void)
+{
+    const int known = __atomic_load_n(&supported, __ATOMIC_ACQUIRE);
+    if (known)
+    {
+        return known > 0;
+    }
+
+    // direct descriptors (openat/close into registered slots) need 5.15+
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_FILES_UPDATE};
+    struct uring ring;
+    int result = -1;
+    if (!uring_init(&ring, 8))
+    {
+        if (uring_probe(&ring, ops, sizeof(ops) / sizeof(ops[0])) && !uring_register_files(&ring, 1))
+        {
+            result = 1;
+        }
+        uring_exit(&ring);
+    }
+    __atomic_store_n(&supported, result, __ATOMIC_RELEASE);
+    return result > 0;
+}
+
+int uring_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity)
+{
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Received non-zero file count but got NULL file list");
+    }
+
+    struct tar_match *names = tar_match_names(filecount, files);
+    if (filecount && !names)
+    {
+        ERROR("Unable to compile member names");
+    }
+
+    const int ret = extract_batched(fd, archive, names, verbosity);
+    tar_match_free(names);
+    return ret;
+}
+
+int extract_batched(const int fd, struct tar_t *archive, const struct tar_match *names, const char verbosity)
+{
+    if (!uring_extract_supported())
+    {
+        V_PRINT(stderr, "io_uring unavailable; using POSIX extraction");
+        return extract_each(fd, archive, names, verbosity);
+    }
+
+    struct uring ring;
+    if (uring_init(&ring, URING_ENTRIES) < 0)
+    {
+        RC_ERROR("Unable to set up io_uring: %s", strerror(rc));
+    }
+
+    // two arena halves: one batch is read while the previous one is written
+    struct batch *batches = calloc(2, sizeof(struct batch));
+    char *arena = mmap(NULL, 2 * URING_ARENA, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    const struct iovec iov = {arena, 2 * URING_ARENA};
+    if (!batches || (arena == MAP_FAILED) || (uring_register_buffers(&ring, &iov, 1) < 0) || (uring_register_files(&ring, URING_SLOTS) < 0))
+    {
+        // e.g. RLIMIT_MEMLOCK too small for the fixed buffers
+        const int rc = errno;
+        free(batches);
+        if (arena != MAP_FAILED)
+        {
+            munmap(arena, 2 * URING_ARENA);
+        }
+        uring_exit(&ring);
+        V_PRINT(stderr, "Unable to set up io_uring buffers (%s); using POSIX extraction", strerror(rc));
+        return extract_each(fd, archive, names, verbosity);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        batches[i].id = i;
+        batches[i].arena = arena + i * URING_ARENA;
+    }
+
+    int ret = 0;
+    char last_parent[101] = {0};
+    struct batch *prev = NULL;
+    for (int turn = 0;; turn ^= 1)
+    {
+        struct batch *cur = &batches[turn];
+        archive = plan_batch(fd, cur, archive, names, last_parent, verbosity);
+
+        // reads for this batch overlap with the writes of the previous one
+        const int reads = queue_reads(&ring, fd, cur);
+        const int writes = prev ? queue_writes(&ring, prev) : 0;
+        if ((reads < 0) || (writes < 0))
+        {
+            ret = -1;
+            break;
+        }
+
+        if ((reads + writes) && (complete(&ring, batches, reads + writes, verbosity) < 0))
+        {
+            ret = -1;
+        }
+
+        // written members get the member's mtime, as extract_entry gives them
+        for (size_t i = 0; prev && (i < prev->count); i++)
+        {
+            const struct batch_member *m = &prev->members[i];
+            if (m->failed)
+            {
+                ret = -1;
+                continue;
+            }
+
+            const struct timespec times[2] = {{0, UTIME_OMIT}, {oct2size(m->entry->mtime, 11), 0}};
+            if (utimensat(AT_FDCWD, m->name, times, 0) < 0)
+            {
+                V_PRINT(stderr, "Warning: Unable to set mtime of %s: %s", m->name, strerror(errno));
+            }
+        }
+
+        if (cur->count)
+        {
+            prev = cur;
+            continue;
+        }
+
+        // nothing was batched, so nothing is in flight: handle the entry
+        // that stopped the batch the usual way
+        prev = NULL;
+        if (!archive)
+        {
+            break;
+        }
+
+        if (extract_entry(fd, archive, verbosity) < 0)
+        {
+            ret = -1;
+        }
+        last_parent[0] = '\0';
+        archive = archive->next;
+    }
+
+    munmap(arena, 2 * URING_ARENA);
+    free(batches);
+    uring_exit(&ring);
+    return ret;
+}
+
+int batchable(const struct tar_t *entry)
+{
+    if ((entry->type != REGULAR) && (entry->type != NORMAL) && (entry->type != CONTIGUOUS))
+    {
+        return 0;
+    }
+    return oct2size(entry->size, 11) <= URING_MAX_MEMBER;
+}
+
+int extract_each(const int fd, struct tar_t *archive, const struct tar_match *names, const char verbosity)
+{
+    int ret = 0;
+    for (; archive; archive = archive->next)
+    {
+        if (!PAX_EXTENSION(archive->type) && select_entry(names, archive) && (extract_entry(fd, archive, verbosity) < 0))
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int make_parent(const char *name, char *last, const char verbosity)
+{
+    char parent[101];
+    size_t len = strnlen(name, 100);
+    while (len && (name[len - 1] != '/'))
+    {
+        len--;
+    }
+    memcpy(parent, name, len);
+    parent[len] = '\0';
+
+    if (!len || !strcmp(parent, last))
+    {
+        return 0;
+    }
+
+    if (recursive_mkdir(parent, DEFAULT_DIR_MODE, verbosity) < 0)
+    {
+        return -1;
+    }
+    strcpy(last, parent);
+    return 0;
+}
+
+struct tar_t *plan_batch(const int fd, struct batch *b, struct tar_t *archive, const struct tar_match *names, char *last_parent, const char verbosity)
+{
+    b->count = 0;
+    b->run_count = 0;
+    b->used = 0;
+
+    for (; archive; archive = archive->next)
+    {
+        // extended headers neither end a batch nor become files
+        if (PAX_EXTENSION(archive->type) || !select_entry(names, archive))
+        {
+            continue;
+        }
+
+        // directories do not depend on anything in flight
+        if (archive->type == DIRECTORY)
+        {
+            if (extract_entry(fd, archive, verbosity) < 0)
+            {
+                tar_error("Could not create directory %s", archive->name);
+            }
+            continue;
+        }
+
+        if (!batchable(archive) || (b->count == URING_SLOTS))
+        {
+            break;
+        }
+
+        // a name repeated inside a batch has to be written in order
+        char name[101];
+        strncpy(name, archive->name, 100);
+        name[100] = '\0';
+        char repeat = 0;
+        for (size_t i = 0; !repeat && (i < b->count); i++)
+        {
+            repeat = !strcmp(b->members[i].name, name);
+        }
+        if (repeat)
+        {
+            break;
+        }
+
+        // extend the previous run when only headers (and an extended header's
+        // data block) and padding separate the data
+        const size_t size = oct2size(archive->size, 11);
+        const off_t begin = (off_t)archive->begin + 512;
+        struct batch_run *run = b->run_count ? &b->runs[b->run_count - 1] : NULL;
+        const off_t end = run ? run->begin + run->size : 0;
+        size_t offset = b->used;
+        if (!size)
+        {
+            // nothing to read
+        }
+        else if (run && (begin >= end) && (begin - end <= 2048) && (run->offset + (begin - run->begin) + size <= URING_ARENA))
+        {
+            offset = run->offset + (begin - run->begin);
+            run->size = offset + size - run->offset;
+            b->used = offset + size;
+        }
+        else if (b->used + size <= URING_ARENA)
+        {
+            run = &b->runs[b->run_count++];
+            run->begin = begin;
+            run->offset = b->used;
+            run->size = size;
+            b->used += size;
+        }
+        else
+        {
+            break;
+        }
+
+        if (make_parent(name, last_parent, verbosity) < 0)
+        {
+            V_PRINT(stderr, "Could not make directory for %s", name);
+        }
+
+        V_PRINT(stdout, "%s", name);
+        struct batch_member *m = &b->members[b->count++];
+        m->entry = archive;
+        strcpy(m->name, name);
+        m->offset = offset;
+        m->size = size;
+        m->mode = oct2uint(archive->mode, 7) & 0777;
+        m->failed = 0;
+    }
+
+    return archive;
+}
+
+int queue_reads(struct uring *ring, const int fd, struct batch *b)
+{
+    for (size_t i = 0; i < b->run_count; i++)
+    {
+        const struct batch_run *run = &b->runs[i];
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        if (!sqe)
+        {
+            ERROR("io_uring submission queue full");
+        }
+
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)(b->arena + run->offset);
+        sqe->len = run->size;
+        sqe->off = run->begin;
+        sqe->buf_index = 0;
+        sqe->user_data = USER_DATA(OP_READ, b->id, i);
+        STATS_SYS(STATS_READ);
+    }
+    return b->run_count;
+}
+
+int queue_writes(struct uring *ring, struct batch *b)
+{
+    int count = 0;
+    for (size_t i = 0; i < b->count; i++)
+    {
+        struct batch_member *m = &b->members[i];
+        if (m->failed)
+        {
+            continue;
+        }
+
+        struct io_uring_sqe *open_sqe = uring_sqe(ring);
+        struct io_uring_sqe *write_sqe = open_sqe ? uring_sqe(ring) : NULL;
+        struct io_uring_sqe *close_sqe = write_sqe ? uring_sqe(ring) : NULL;
+        if (!close_sqe)
+        {
+            ERROR("io_uring submission queue full");
+        }
+
+        // open into registered slot i
+        open_sqe->opcode = IORING_OP_OPENAT;
+        open_sqe->fd = AT_FDCWD;
+        open_sqe->addr = (uint64_t)(uintptr_t)m->name;
+        open_sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        open_sqe->len = m->mode;
+        open_sqe->file_index = i + 1;
+        open_sqe->flags = IOSQE_IO_LINK;
+        open_sqe->user_data = USER_DATA(OP_OPEN, b->id, i);
+
+        write_sqe->opcode = IORING_OP_WRITE_FIXED;
+        write_sqe->fd = i;
+        write_sqe->addr = (uint64_t)(uintptr_t)(b->arena + m->offset);
+        write_sqe->len = m->size;
+        write_sqe->off = 0;
+        write_sqe->buf_index = 0;
+        write_sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        write_sqe->user_data = USER_DATA(OP_WRITE, b->id, i);
+
+        // the slot is released even when the write fails
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->file_index = i + 1;
+        close_sqe->user_data = USER_DATA(OP_CLOSE, b->id, i);
+
+        STATS_SYS(STATS_OPEN);
+        STATS_SYS(STATS_WRITE);
+        count += 3;
+    }
+    return count;
+}
+
+int complete(struct uring *ring, struct batch *batches, const unsigned int pending, const char verbosity)
+{
+    if (uring_submit(ring, pending) < 0)
+    {
+        RC_ERROR("io_uring submission failed: %s", strerror(rc));
+    }
+
+    int ret = 0;
+    unsigned int seen = 0;
+    while (seen < pending)
+    {
+        struct io_uring_cqe *cqe = uring_cqe(ring);
+        if (!cqe)
+        {
+            // wait for the rest
+            if (uring_submit(ring, pending - seen) < 0)
+            {
+                RC_ERROR("io_uring wait failed: %s", strerror(rc));
+            }
+            continue;
+        }
+
+        const uint64_t op = cqe->user_data >> 32;
+        struct batch *b = &batches[(cqe->user_data >> 16) & 0xffff];
+        const size_t index = cqe->user_data & 0xffff;
+        const int res = cqe->res;
+        uring_cqe_seen(ring);
+        seen++;
+
+        if (op == OP_READ)
+        {
+            const struct batch_run *run = &b->runs[index];
+            if (res != (int)run->size)
+            {
+                // fail every member stored in the run
+                for (size_t i = 0; i < b->count; i++)
+                {
+                    if ((b->members[i].offset >= run->offset) && (b->members[i].offset < run->offset + run->size))
+                    {
+                        b->members[i].failed = 1;
+                    }
+                }
+                tar_error("Unable to read from archive: %s", (res < 0) ? strerror(-res) : "short read");
+                ret = -1;
+            }
+            else
+            {
+                STATS_BYTES(bytes_read, res);
+            }
+            continue;
+        }
+
+        struct batch_member *m = &b->members[index];
+        if ((op == OP_OPEN) && (res < 0))
+        {
+            tar_error("Unable to open file %s: %s", m->name, strerror(-res));
+            m->failed = 1;
+        }
+        else if ((op == OP_WRITE) && (res != (int)m->size) && !m->failed)
+        {
+            tar_error("Unable to write to %s: %s", m->name, (res < 0) ? strerror(-res) : "short write");
+            m->failed = 1;
+        }
+        else if (op == OP_WRITE)
+        {
+            STATS_BYTES(bytes_written, res);
+        }
+    }
+
+    return ret;
+}
+
+int uring_create_supported(void)
+{
+    const int known = __atomic_load_n(&create_supported, __ATOMIC_ACQUIRE);
+    if (known)
+    {
+        return known > 0;
+    }
+
+    static const int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    struct uring ring;
+    int result = -1;
+    if (!uring_init(&ring, 8))
+    {
+        if (uring_probe(&ring, ops, sizeof(ops) / sizeof(ops[0])))
+        {
+            result = 1;
+        }
+        uring_exit(&ring);
+    }
+    __atomic_store_n(&create_supported, result, __ATOMIC_RELEASE);
+    return result > 0;
+}
+
+int uring_write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], off_t *offset, const char verbosity)
+{
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    if (!archive || *archive)
+    {
+        ERROR("Bad archive");
+    }
+
+    if (filecount && !files)
+    {
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    if (!uring_create_supported())
+    {
+        V_PRINT(stderr, "io_uring unavailable; using POSIX create");
+        return write_entries(fd, archive, head, filecount, files, offset, verbosity);
+    }
+
+    const size_t depth = tar_ctx_current()->options.uring_depth ? MIN(tar_ctx_current()->options.uring_depth, 4096) : 1;
+    struct uring ring;
+    if (uring_init(&ring, MAX(depth, 8)) < 0)
+    {
+        RC_ERROR("Unable to set up io_uring: %s", strerror(rc));
+    }
+
+    struct create_slot *slots = calloc(depth, sizeof(struct create_slot));
+    char *bufs = malloc(depth * URING_READAHEAD);
+    if (!slots || !bufs)
+    {
+        free(slots);
+        free(bufs);
+        uring_exit(&ring);
+        ERROR("Unable to allocate io_uring window");
+    }
+    for (size_t i = 0; i < depth; i++)
+    {
+        slots[i].buf = bufs + i * URING_READAHEAD;
+        slots[i].fd = -1;
+    }
+
+    struct walker walker = {files, filecount, 0, NULL, 0, 0, 0};
+    struct tar_t **tar = archive;
+    int ret = 0;
+
+    // fill the window, then emit in order and refill each slot as it frees up
+    size_t queued = 0;
+    for (; queued < depth; queued++)
+    {
+        if (!(slots[queued].path = walk_next(&walker, NULL, verbosity)))
+        {
+            break;
+        }
+        queue_statx(&ring, slots, queued);
+    }
+
+    for (size_t i = 0; queued; i = (i + 1) % depth)
+    {
+        struct create_slot *slot = &slots[i];
+        while ((slot->state != SLOT_READY) && (slot->state != SLOT_FAILED))
+        {
+            if (reap_create(&ring, slots, 1) < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+
+        if (!ret && (emit_slot(fd, tar, head, slot, offset, verbosity) < 0))
+        {
+            ret = -1;
+        }
+
+        // a directory that cannot be read fails the archive, as in write_entries
+        if (walker.failed)
+        {
+            ret = -1;
+        }
+
+        if (*tar)
+        {
+            tar = &((*tar)->next);
+        }
+
+        if (slot->fd >= 0)
+        {
+            close(slot->fd);
+            slot->fd = -1;
+        }
+        free(slot->path);
+        slot->path = NULL;
+        slot->state = SLOT_EMPTY;
+        queued--;
+
+        if (ret < 0)
+        {
+            break;
+        }
+
+        if ((slot->path = walk_next(&walker, NULL, verbosity)))
+        {
+            queue_statx(&ring, slots, i);
+            queued++;
+        }
+    }
+
+    // drain anything still in flight before the buffers go away
+    for (size_t i = 0; i < depth; i++)
+    {
+        while ((slots[i].state == SLOT_STAT) || (slots[i].state == SLOT_OPEN) || (slots[i].state == SLOT_READ))
+        {
+            if (reap_create(&ring, slots, 1) < 0)
+            {
+                break;
+            }
+        }
+        if (slots[i].fd >= 0)
+        {
+            close(slots[i].fd);
+        }
+        free(slots[i].path);
+    }
+
+    walk_free(&walker);
+    free(bufs);
+    free(slots);
+    uring_exit(&ring);
+
+    if (ret < 0)
+    {
+        tar_free(*archive);
+        *archive = NULL;
+    }
+    return ret;
+}
+
+int queue_statx(struct uring *ring, struct create_slot *slots, const size_t index)
+{
+    struct create_slot *slot = &slots[index];
+    slot->state = SLOT_STAT;
+    slot->got = 0;
+    slot->err = 0;
+    slot->fd = -1;
+
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+    {
+        slot->state = SLOT_FAILED;
+        slot->err = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)slot->path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = USER_DATA(OP_STATX, 0, index);
+    STATS_SYS(STATS_STAT);
+
+    // get it moving right away; completions are collected later
+    return uring_submit(ring, 0);
+}
+
+int reap_create(struct uring *ring, struct create_slot *slots, const unsigned int wait)
+{
+    if (uring_submit(ring, wait) < 0)
+    {
+        RC_ERROR("io_uring wait failed: %s", strerror(rc));
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(ring)))
+    {
+        const uint64_t op = cqe->user_data >> 32;
+        const size_t index = cqe->user_data & 0xffff;
+        const int res = cqe->res;
+        uring_cqe_seen(ring);
+
+        struct create_slot *slot = &slots[index];
+        if (res < 0)
+        {
+            slot->state = SLOT_FAILED;
+            slot->err = -res;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = NULL;
+        if (op == OP_STATX)
+        {
+            // only regular files with data are opened
+            if (!S_ISREG(slot->stx.stx_mode) || !slot->stx.stx_size)
+            {
+                slot->state = SLOT_READY;
+                continue;
+            }
+
+            if (!(sqe = uring_sqe(ring)))
+            {
+                slot->state = SLOT_READY; // read at emit time instead
+                continue;
+            }
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)slot->path;
+            sqe->open_flags = O_RDONLY;
+            sqe->user_data = USER_DATA(OP_OPEN, 0, index);
+            slot->state = SLOT_OPEN;
+            STATS_SYS(STATS_OPEN);
+        }
+        else if (op == OP_OPEN)
+        {
+            slot->fd = res;
+            if (!(sqe = uring_sqe(ring)))
+            {
+                slot->state = SLOT_READY;
+                continue;
+            }
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = slot->fd;
+            sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+            sqe->len = MIN(slot->stx.stx_size, URING_READAHEAD);
+            sqe->off = 0;
+            sqe->user_data = USER_DATA(OP_READ, 0, index);
+            slot->state = SLOT_READ;
+            STATS_SYS(STATS_READ);
+        }
+        else if (op == OP_READ)
+        {
+            slot->got = res;
+            slot->state = SLOT_READY;
+            STATS_BYTES(bytes_read, res);
+        }
+    }
+
+    return 0;
+}
+
+int emit_slot(const int fd, struct tar_t **tar, struct tar_t **head, struct create_slot *slot, off_t *offset, const char verbosity)
+{
+    if (slot->state == SLOT_FAILED)
+    {
+        ERROR("Cannot stat %s: %s", slot->path, strerror(slot->err));
+    }
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = slot->stx.stx_mode;
+    st.st_uid = slot->stx.stx_uid;
+    st.st_gid = slot->stx.stx_gid;
+    st.st_size = slot->stx.stx_size;
+    st.st_mtime = slot->stx.stx_mtime.tv_sec;
+    st.st_rdev = makedev(slot->stx.stx_rdev_major, slot->stx.stx_rdev_minor);
+
+    *tar = malloc(sizeof(struct tar_t));
+    if (format_tar_stat(*tar, slot->path, &st, verbosity) < 0)
+    {
+        free(*tar);
+        *tar = NULL;
+        ERROR("Failed to stat %s", slot->path);
+    }
+    (*tar)->begin = *offset;
+    (*tar)->next = NULL;
+
+    if ((*tar)->type == DIRECTORY)
+    {
+        // add a '/' character to the end
+        const size_t len = strlen((*tar)->name);
+        if ((len < 99) && ((*tar)->name[len - 1] != '/'))
+        {
+            (*tar)->name[len] = '/';
+            (*tar)->name[len + 1] = '\0';
+            calculate_checksum(*tar);
+        }
+    }
+
+    V_PRINT(stdout, "Writing %s", (*tar)->name);
+
+    // repeated sources become hard links, as in write_entries
+    char tarred = 0;
+    if (((*tar)->type == REGULAR) || ((*tar)->type == NORMAL) || ((*tar)->type == CONTIGUOUS) || ((*tar)->type == SYMLINK))
+    {
+        tarred = (exists(*head, slot->path, 1) != *tar);
+        if (tarred)
+        {
+            (*tar)->type = HARDLINK;
+            strncpy((*tar)->link_name, (*tar)->name, 100);
+            memset((*tar)->size, '0', sizeof((*tar)->size) - 1);
+            calculate_checksum(*tar);
+        }
+    }
+
+    TRACE_BEGIN(TRACE_HEADER, (*tar)->name, 512);
+    if (write_size(fd, (*tar)->block, 512) != 512)
+    {
+        ERROR("Failed to write metadata to archive");
+    }
+    TRACE_END(TRACE_HEADER, (*tar)->name, 512);
+    *offset += 512;
+
+    const off_t size = oct2size((*tar)->size, 11);
+    if (tarred || !size || (((*tar)->type != REGULAR) && ((*tar)->type != NORMAL) && ((*tar)->type != CONTIGUOUS)))
+    {
+        return 0;
+    }
+
+    TRACE_BEGIN(TRACE_COPY, (*tar)->name, size);
+
+    // read-ahead data first, then whatever did not fit
+    if (slot->fd < 0)
+    {
+        STATS_SYS(STATS_OPEN);
+        if ((slot->fd = open(slot->path, O_RDONLY)) < 0)
+        {
+            ERROR("Could not open %s", slot->path);
+        }
+    }
+
+    off_t done = MIN((off_t)slot->got, size);
+    if (done && (write_size(fd, slot->buf, done) != done))
+    {
+        RC_ERROR("Could not write to archive: %s", strerror(rc));
+    }
+
+    if ((done < size) && (seek_fd(slot->fd, done, SEEK_SET) == (off_t)(-1)))
+    {
+        RC_ERROR("Unable to seek file: %s", strerror(rc));
+    }
+
+    while (done < size)
+    {
+        const int want = MIN(size - done, URING_READAHEAD);
+        const int r = read_size(slot->fd, slot->buf, want);
+        if (r <= 0)
+        {
+            break;
+        }
+        if (write_size(fd, slot->buf, r) != r)
+        {
+            RC_ERROR("Could not write to archive: %s", strerror(rc));
+        }
+        done += r;
+    }
+
+    // a file that shrank since it was stat'ed is zero filled to the recorded size
+    if (done < size)
+    {
+        memset(slot->buf, 0, URING_READAHEAD);
+    }
+    while (done < size)
+    {
+        const int want = MIN(size - done, URING_READAHEAD);
+        if (write_size(fd, slot->buf, want) != want)
+        {
+            RC_ERROR("Could not write to archive: %s", strerror(rc));
+        }
+        done += want;
+    }
+    TRACE_END(TRACE_COPY, (*tar)->name, size);
+
+    if (write_padding(fd, size) < 0)
+    {
+        ERROR("Could not write padding data");
+    }
+    *offset += size + (512 - size % 512) % 512;
+    return 0;
+}
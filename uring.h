@@ -0,0 +1,82 @@
+//
+// uring.h
+//
+// Minimal io_uring wrapper (raw syscalls, no liburing) and the batched
+// extraction and create backends built on it
+//
+#ifndef __URING__
+#define __URING__
+
+#include <linux/io_uring.h>
+
+#include "tar.h"
+
+struct uring
+{
+    int fd;
+    unsigned int entries;
+
+    // submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail; // prepared but not yet published
+
+    // completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// create a ring; returns -1 with errno set when io_uring is unavailable
+int uring_init(struct uring *ring, const unsigned int entries);
+
+// tear down a ring
+void uring_exit(struct uring *ring);
+
+// get a zeroed submission entry; NULL when the queue is full
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+// publish prepared entries and wait for at least wait completions
+// returns number of entries submitted or -1
+int uring_submit(struct uring *ring, const unsigned int wait);
+
+// next completion or NULL; call uring_cqe_seen after using it
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+
+// release a completion returned by uring_cqe
+void uring_cqe_seen(struct uring *ring);
+
+// check whether the kernel supports every listed opcode
+int uring_probe(struct uring *ring, const int *ops, const size_t count);
+
+// register count empty slots for direct descriptors
+int uring_register_files(struct uring *ring, const unsigned int count);
+
+// register fixed buffers
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, const unsigned int count);
+
+// non-zero when the io_uring extraction backend can run on this kernel
+int uring_extract_supported(void);
+
+// extract entries by batching openat/write/close chains
+// selection and results match tar_extract
+int uring_extract(const int fd, struct tar_t *archive, const size_t filecount, const char *files[], const char verbosity);
+
+// non-zero when the io_uring create backend can run on this kernel
+int uring_create_supported(void);
+
+// write_entries with statx/openat/read issued for tar_options.uring_depth
+// upcoming files while members are emitted in order
+int uring_write_entries(const int fd, struct tar_t **archive, struct tar_t **head, const size_t filecount, const char *files[], off_t *offset, const char verbosity);
+
+#endif
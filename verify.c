@@ -0,0 +1,324 @@
+//
+// verify.c
+//
+// CRC32C member checksums and the parallel verify pass
+//
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "internal.h"
+#include "stats.h"
+#include "verify.h"
+
+#define VERIFY_BUF (1 << 20)   // octets per positional read
+#define VERIFY_THREADS 256     // upper bound on workers
+
+// a member whose data has a recorded checksum
+struct verify_item
+{
+    const struct tar_t *entry;
+    uint32_t crc;
+};
+
+// shared by the workers
+struct verify_job
+{
+    int fd;
+    struct verify_item *items;
+    size_t count;
+    size_t next;   // next item to claim
+    size_t failed; // members that did not match or could not be read
+    char verbosity;
+};
+
+// one worker thread
+struct verify_thread
+{
+    struct verify_job *job;
+    struct tar_ctx ctx; // derived from the caller's (ctx_inherit)
+    char errbuf[CTX_ERRBUF];
+};
+
+// reflected Castagnoli polynomial, one octet at a time
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// fill crc32c_table
+static void crc32c_init(void);
+
+// table driven CRC32C
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *buf, size_t len);
+
+#if defined(__x86_64__)
+// CRC32C with the SSE4.2 crc32 instruction, 8 octets at a time
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len);
+#endif
+
+// find the crc32c record in the data of an extended header
+static int pax_find_crc32c(const char *data, const size_t size, uint32_t *crc);
+
+// claim and check items until none are left
+static void *verify_worker(void *arg);
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32c_sse42(~crc, buf, len);
+    }
+#endif
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_soft(~crc, buf, len);
+}
+
+void pax_crc32c_header(struct tar_t *entry, const struct tar_t *member)
+{
+    // ownership and times follow the member; the name only has to be unique enough
+    *entry = *member;
+    entry->next = NULL;
+    memset(entry->original_name, 0, sizeof(entry->original_name));
+    memset(entry->name, 0, sizeof(entry->name));
+    memcpy(entry->name, "PaxHeaders/", 11);
+    strncpy(entry->name + 11, member->name, sizeof(entry->name) - 12);
+    memset(entry->link_name, 0, sizeof(entry->link_name));
+    snprintf(entry->mode, sizeof(entry->mode), "%07o", 0644);
+    snprintf(entry->size, sizeof(entry->size), "%011o", PAX_CRC32C_LEN);
+    entry->type = PAX_HEADER;
+    calculate_checksum(entry);
+}
+
+void pax_crc32c_record(char *block, const uint32_t crc)
+{
+    memset(block, 0, 512);
+    snprintf(block, 512, "%d %s=%08x\n", PAX_CRC32C_LEN, PAX_CRC32C, crc);
+}
+
+int pax_read_crc32c(const int fd, const struct tar_t *pax, uint32_t *crc)
+{
+    if (!pax || (pax->type != PAX_HEADER))
+    {
+        return -1;
+    }
+
+    char data[512];
+    const off_t size = oct2size(pax->size, 11);
+    STATS_SYS(STATS_READ);
+    const ssize_t got = pread(fd, data, MIN(size, (off_t)sizeof(data)), pax->begin + 512);
+    return (got < 0) ? -1 : pax_find_crc32c(data, got, crc);
+}
+
+int tar_verify(const int fd, struct tar_t *archive, const unsigned int threads, const char verbosity)
+{
+    if (fd < 0)
+    {
+        ERROR("Bad file descriptor");
+    }
+
+    size_t cap = 0;
+    for (struct tar_t *entry = archive; entry; entry = entry->next)
+    {
+        cap += (entry->type == PAX_HEADER);
+    }
+
+    struct verify_job job = {fd, calloc(cap + 1, sizeof(struct verify_item)), 0, 0, 0, verbosity};
+    if (!job.items)
+    {
+        ERROR("Unable to allocate verify list");
+    }
+
+    // pair every extended header carrying a checksum with the member after it
+    size_t unchecked = 0;
+    for (struct tar_t *entry = archive; entry; entry = entry->next)
+    {
+        if (entry->type != PAX_HEADER)
+        {
+            const int data = (entry->type == REGULAR) || (entry->type == NORMAL) || (entry->type == CONTIGUOUS);
+            if (data && oct2size(entry->size, 11))
+            {
+                V_PRINT(stdout, "No checksum: %s", entry->name);
+                unchecked++;
+            }
+            continue;
+        }
+
+        uint32_t crc = 0;
+        if (!entry->next || (pax_read_crc32c(fd, entry, &crc) < 0))
+        {
+            continue;
+        }
+
+        job.items[job.count].entry = entry->next;
+        job.items[job.count].crc = crc;
+        job.count++;
+        entry = entry->next;
+    }
+
+    // every worker keeps a read in flight, so more threads than CPUs still help on slow devices
+    unsigned int count = threads ? threads : (unsigned int)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    count = MIN(MIN(count, VERIFY_THREADS), MAX(job.count, 1));
+
+    struct tar_ctx *ctx = tar_ctx_current();
+    pthread_t workers[VERIFY_THREADS];
+    struct verify_thread *slots = calloc(count, sizeof(struct verify_thread));
+    unsigned int started = 0;
+    for (; slots && (started < count); started++)
+    {
+        slots[started].job = &job;
+        ctx_inherit(&slots[started].ctx, ctx, slots[started].errbuf);
+        if (pthread_create(&workers[started], NULL, verify_worker, &slots[started]))
+        {
+            break;
+        }
+    }
+
+    // without threads the caller does the work
+    if (!started)
+    {
+        struct verify_thread self = {&job};
+        ctx_inherit(&self.ctx, ctx, self.errbuf);
+        verify_worker(&self);
+        tar_ctx_use(ctx);
+        ctx_join(ctx, &self.ctx);
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+        ctx_join(ctx, &slots[i].ctx);
+    }
+    free(slots);
+
+    // members nobody could claim (no buffer) were not verified
+    job.failed += job.count - MIN(job.next, job.count);
+
+    V_PRINT(stdout, "Verified %zu members (%zu without checksum), %zu bad", job.count - job.failed, unchecked, job.failed);
+    free(job.items);
+    return job.failed ? -1 : 0;
+}
+
+void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+uint32_t crc32c_soft(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    while (len--)
+    {
+        crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+    while (len--)
+    {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+int pax_find_crc32c(const char *data, const size_t size, uint32_t *crc)
+{
+    // records are "<length> <keyword>=<value>\n", length counting the whole record
+    const size_t key_len = strlen(PAX_CRC32C);
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t len = 0;
+        size_t i = pos;
+        while ((i < size) && (data[i] >= '0') && (data[i] <= '9'))
+        {
+            len = len * 10 + (data[i++] - '0');
+        }
+
+        if (!len || (i >= size) || (data[i] != ' ') || (pos + len > size))
+        {
+            return -1;
+        }
+
+        const char *key = data + i + 1;
+        if ((key + key_len + 9 <= data + pos + len) && !strncmp(key, PAX_CRC32C, key_len) && (key[key_len] == '='))
+        {
+            char hex[9] = {0};
+            char *end = NULL;
+            memcpy(hex, key + key_len + 1, 8);
+            *crc = strtoul(hex, &end, 16);
+            return (end == hex + 8) ? 0 : -1;
+        }
+        pos += len;
+    }
+    return -1;
+}
+
+void *verify_worker(void *arg)
+{
+    struct verify_thread *thread = arg;
+    struct verify_job *job = thread->job;
+    const char verbosity = job->verbosity;
+    tar_ctx_use(&thread->ctx);
+    char *buf = malloc(VERIFY_BUF);
+    size_t i;
+    while (buf && ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count))
+    {
+        const struct verify_item *item = &job->items[i];
+        const off_t size = oct2size(item->entry->size, 11);
+        const off_t begin = item->entry->begin + 512;
+        uint32_t crc = 0;
+        off_t done = 0;
+        while (done < size)
+        {
+            STATS_SYS(STATS_READ);
+            const ssize_t got = pread(job->fd, buf, MIN(size - done, (off_t)VERIFY_BUF), begin + done);
+            if (got <= 0)
+            {
+                break;
+            }
+            crc = crc32c(crc, buf, got);
+            done += got;
+        }
+
+        if ((done != size) || (crc != item->crc))
+        {
+            tar_error("%s: %s", item->entry->name, (done != size) ? "data cannot be read" : "checksum mismatch");
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            V_PRINT(stdout, "OK %s", item->entry->name);
+        }
+    }
+
+    if (!buf)
+    {
+        // the other workers still drain the list; this one just cannot help
+        V_PRINT(stderr, "Unable to allocate verify buffer");
+    }
+    free(buf);
+    return NULL;
+}
@@ -0,0 +1,40 @@
+//
+// verify.h
+//
+// Member content checksums. Creating with tar_options.checksum puts a PAX
+// extended header carrying the CRC32C of the data in front of every regular
+// file; tar_verify checks those members in parallel without extracting
+//
+#ifndef __VERIFY__
+#define __VERIFY__
+
+#include <stdint.h>
+
+#include "tar.h"
+
+#define PAX_HEADER 'x'            // extended header for the next member
+#define PAX_GLOBAL 'g'            // extended header for every member after it
+// headers describing other members; never extracted as members themselves
+#define PAX_EXTENSION(type) (((type) == PAX_HEADER) || ((type) == PAX_GLOBAL))
+#define PAX_CRC32C "WYTAR.crc32c" // record keyword; the value is 8 hex digits
+#define PAX_CRC32C_LEN 25         // "25 WYTAR.crc32c=xxxxxxxx\n"
+
+// continue a CRC32C (Castagnoli) over buf; start with 0
+// uses the SSE4.2 crc32 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// fill entry with the extended header that goes in front of member
+void pax_crc32c_header(struct tar_t *entry, const struct tar_t *member);
+
+// the data block of an extended header holding crc (512 octets)
+void pax_crc32c_record(char *block, const uint32_t crc);
+
+// read the checksum recorded by the extended header pax; -1 when it has none
+int pax_read_crc32c(const int fd, const struct tar_t *pax, uint32_t *crc);
+
+// check the data of every member that has a recorded checksum with
+// positional reads spread over threads (0: one per CPU)
+// returns -1 when any member does not match or cannot be read
+TAR_API int tar_verify(const int fd, struct tar_t *archive, const unsigned int threads, const char verbosity);
+
+#endif
@@ -0,0 +1,263 @@
+//
+// walk.c
+//
+// Lazy source traversal shared by the read-ahead create paths, and the
+// ordered directory listings every create path walks
+//
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "internal.h"
+#include "stats.h"
+
+// first physical extent of a regular file; ~0 when there is none or no FIEMAP
+static unsigned long long first_extent(const int dir, const char *name);
+
+// qsort comparators for each tar_ctx_current()->options.sort mode
+static int by_inode(const void *a, const void *b);
+static int by_extent(const void *a, const void *b);
+static int by_name(const void *a, const void *b);
+
+struct walk_entry *walk_list(const char *path, size_t *count, const char verbosity)
+{
+    *count = 0;
+    DIR *d = opendir(path);
+    if (!d)
+    {
+        return NULL;
+    }
+
+    // one spare slot so an empty directory is not mistaken for a failure
+    size_t cap = 16;
+    struct walk_entry *entries = malloc(cap * sizeof(struct walk_entry));
+    struct dirent *dir;
+    while (entries && (dir = readdir(d)))
+    {
+        // if not special directories . and ..
+        if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+        {
+            continue;
+        }
+
+        if (*count + 1 == cap)
+        {
+            cap *= 2;
+            struct walk_entry *grown = realloc(entries, cap * sizeof(struct walk_entry));
+            if (!grown)
+            {
+                walk_list_free(entries, *count);
+                entries = NULL;
+                break;
+            }
+            entries = grown;
+        }
+
+        struct walk_entry *e = &entries[*count];
+        if (!(e->name = strdup(dir->d_name)))
+        {
+            walk_list_free(entries, *count);
+            entries = NULL;
+            break;
+        }
+        (*count)++;
+        e->ino = dir->d_ino;
+        e->type = dir->d_type;
+        e->physical = ~0ull;
+    }
+
+    if (!entries)
+    {
+        closedir(d);
+        *count = 0;
+        V_PRINT(stderr, "Unable to list %s", path);
+        return NULL;
+    }
+
+    switch (tar_ctx_current()->options.sort)
+    {
+    case TAR_SORT_INODE:
+        qsort(entries, *count, sizeof(struct walk_entry), by_inode);
+        break;
+    case TAR_SORT_EXTENT:
+        // costs an open per file, which pays off when the reads are seek bound
+        for (size_t i = 0; i < *count; i++)
+        {
+            if ((entries[i].type == DT_REG) || (entries[i].type == DT_UNKNOWN))
+            {
+                entries[i].physical = first_extent(dirfd(d), entries[i].name);
+            }
+        }
+        qsort(entries, *count, sizeof(struct walk_entry), by_extent);
+        break;
+    case TAR_SORT_NAME:
+        qsort(entries, *count, sizeof(struct walk_entry), by_name);
+        break;
+    default:
+        break;
+    }
+
+    closedir(d);
+    return entries;
+}
+
+void walk_list_free(struct walk_entry *entries, const size_t count)
+{
+    for (size_t i = 0; entries && (i < count); i++)
+    {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+unsigned long long first_extent(const int dir, const char *name)
+{
+    STATS_SYS(STATS_OPEN);
+    const int fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return ~0ull;
+    }
+
+    // room for a single extent is enough to know where the file starts
+    union
+    {
+        struct fiemap map;
+        char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.map.fm_length = FIEMAP_MAX_OFFSET;
+    buf.map.fm_extent_count = 1;
+
+    struct stat st;
+    unsigned long long physical = ~0ull;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && !ioctl(fd, FS_IOC_FIEMAP, &buf.map) && buf.map.fm_mapped_extents)
+    {
+        physical = buf.map.fm_extents[0].fe_physical;
+    }
+    close(fd);
+    return physical;
+}
+
+int by_inode(const void *a, const void *b)
+{
+    const ino_t x = ((const struct walk_entry *)a)->ino;
+    const ino_t y = ((const struct walk_entry *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+int by_extent(const void *a, const void *b)
+{
+    // files without a known extent (directories, empty or inline files) follow in inode order
+    const unsigned long long x = ((const struct walk_entry *)a)->physical;
+    const unsigned long long y = ((const struct walk_entry *)b)->physical;
+    return (x != y) ? (x > y) - (x < y) : by_inode(a, b);
+}
+
+int by_name(const void *a, const void *b)
+{
+    return strcmp(((const struct walk_entry *)a)->name, ((const struct walk_entry *)b)->name);
+}
+
+char *walk_next(struct walker *w, unsigned char *type, const char verbosity)
+{
+    char *path = NULL;
+    unsigned char kind = DT_UNKNOWN;
+    while (!path)
+    {
+        if (w->depth)
+        {
+            struct walk_dir *top = &w->stack[w->depth - 1];
+            if (top->next == top->count)
+            {
+                walk_list_free(top->entries, top->count);
+                free(top->path);
+                w->depth--;
+                continue;
+            }
+
+            const struct walk_entry *dir = &top->entries[top->next++];
+            path = malloc(strlen(top->path) + strlen(dir->name) + 2);
+            sprintf(path, "%s/%s", top->path, dir->name);
+
+            // excluded subtrees are never stat'ed or opened
+            if (tar_match_excluded(tar_ctx_current()->options.match, path))
+            {
+                V_PRINT(stdout, "Excluding %s", path);
+                free(path);
+                path = NULL;
+                continue;
+            }
+
+            kind = dir->type;
+            if (kind == DT_UNKNOWN)
+            {
+                struct stat st;
+                STATS_SYS(STATS_STAT);
+                kind = lstat(path, &st) ? DT_UNKNOWN : IFTODT(st.st_mode);
+            }
+        }
+        else if (w->next < w->filecount)
+        {
+            path = strdup(w->files[w->next++]);
+            if (tar_match_excluded(tar_ctx_current()->options.match, path))
+            {
+                V_PRINT(stdout, "Excluding %s", path);
+                free(path);
+                path = NULL;
+                continue;
+            }
+
+            struct stat st;
+            STATS_SYS(STATS_STAT);
+            kind = lstat(path, &st) ? DT_UNKNOWN : IFTODT(st.st_mode);
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+
+    if (type)
+    {
+        *type = kind;
+    }
+
+    // children follow their directory
+    if ((kind == DT_DIR) && !tar_ctx_current()->options.no_recursion)
+    {
+        size_t count = 0;
+        struct walk_entry *entries = walk_list(path, &count, verbosity);
+        if (!entries)
+        {
+            tar_error("Cannot open directory %s", path);
+            w->failed = 1;
+            return path;
+        }
+
+        if (w->depth == w->cap)
+        {
+            w->cap = w->cap ? w->cap * 2 : 16;
+            w->stack = realloc(w->stack, w->cap * sizeof(struct walk_dir));
+        }
+        w->stack[w->depth].entries = entries;
+        w->stack[w->depth].count = count;
+        w->stack[w->depth].next = 0;
+        w->stack[w->depth].path = strdup(path);
+        w->depth++;
+    }
+
+    return path;
+}
+
+void walk_free(struct walker *w)
+{
+    while (w->depth)
+    {
+        w->depth--;
+        walk_list_free(w->stack[w->depth].entries, w->stack[w->depth].count);
+        free(w->stack[w->depth].path);
+    }
+    free(w->stack);
+    w->stack = NULL;
+}
@@ -0,0 +1,774 @@
+//
+// watch.c
+//
+// inotify loop, debounced path set and batched appends of the watch mode
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // copy_file_range
+#endif
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#include "internal.h"
+#include "stats.h"
+#include "watch.h"
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+static char zeroes[RECORDSIZE + 2 * BLOCKSIZE];
+
+// a path seen in the archive or the tree
+struct watched
+{
+    char *name; // member name without a trailing '/'; the table key
+    size_t len;
+    char *path; // where it was seen in the tree; NULL until then
+    uint32_t hash;
+    off_t size;       // of the last member; -1 when not archived
+    time_t sec;       // mtime of the last member
+    long nsec;        // -1 when only the header (seconds) is known
+    char pending;     // queued for the next batch
+    struct watched *next;
+};
+
+struct watch
+{
+    int fd;
+    dev_t dev; // the archive itself is never appended
+    ino_t ino;
+    off_t end;   // where the next header goes
+    off_t gap;   // octets before end still to be zeroed (padding of the last member)
+    struct watched **table;
+    size_t mask;
+    size_t entries;
+    struct watched **pending;
+    size_t npending;
+    size_t cap;
+    char **dirs; // watched directory by watch descriptor
+    size_t ndirs;
+    size_t watched; // directories in dirs
+    int inotify;
+    uint64_t first; // time of the oldest pending change (ns)
+    uint64_t last;  // time of the newest event (ns)
+    uid_t uid;      // owner and group names of the last lookups
+    gid_t gid;
+    char owner[32];
+    char group[32];
+    char named; // 1: owner cached, 2: group cached
+    char verbosity;
+};
+
+// find where the trailer starts and remember every member's size and mtime
+static int find_end(struct watch *w);
+
+// member name of a path as tar_write stores it (leading "/", "./" or "../"
+// dropped), without trailing '/'s; len gets its length
+static const char *stored_name(const char *path, size_t *len);
+
+// entry of a member name, added when create is set
+static struct watched *lookup(struct watch *w, const char *name, const size_t len, const int create);
+
+// watch a directory and everything below it, queueing all of it
+static int add_tree(struct watch *w, const char *root);
+
+// queue path for the next batch
+static void queue(struct watch *w, const char *path);
+
+// act on a buffer of inotify events
+static void handle_events(struct watch *w, const char *buf, const ssize_t len, const size_t count, const char *roots[]);
+
+// append every pending path, then the trailer
+static int append_batch(struct watch *w);
+
+// append one path if it changed since its last member; 1 when appended
+static int append_path(struct watch *w, struct watched *e);
+
+// move the member's data to the archive; zeros replace data the file lost meanwhile
+static int copy_data(struct watch *w, const int in, off_t len, const char *name);
+
+// owner and group names, cached for the last ids
+static void names(struct watch *w, const struct stat *st, struct tar_member *member);
+
+int tar_watch(const int fd, const size_t count, const char *dirs[], const unsigned int quiet, const char verbosity)
+{
+    if ((fd < 0) || (count && !dirs))
+    {
+        ERROR("Bad watch arguments");
+    }
+
+    struct watch w;
+    memset(&w, 0, sizeof(w));
+    w.fd = fd;
+    w.verbosity = verbosity;
+    w.mask = 1023;
+    w.table = calloc(w.mask + 1, sizeof(struct watched *));
+    struct stat st;
+    if (!w.table || fstat(fd, &st))
+    {
+        free(w.table);
+        ERROR("Unable to set up watch state");
+    }
+    w.dev = st.st_dev;
+    w.ino = st.st_ino;
+
+    // SIGINT and SIGTERM end the loop after a last batch
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+    int ret = find_end(&w);
+    const int sig = ret ? -1 : signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    w.inotify = ret ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (!ret && ((sig < 0) || (w.inotify < 0)))
+    {
+        tar_error("Unable to set up inotify: %s", strerror(errno));
+        ret = -1;
+    }
+
+    for (size_t i = 0; !ret && (i < count); i++)
+    {
+        ret = add_tree(&w, dirs[i]);
+    }
+
+    if (!ret)
+    {
+        V_PRINT(stderr, "Watching %zu directories; archive ends at %lld", w.watched, (long long)w.end);
+    }
+
+    char events[WATCH_EVENTS] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const uint64_t quiet_ns = (quiet ? quiet : WATCH_QUIET) * 1000000ull;
+    char stop = 0;
+    while (!ret && !stop)
+    {
+        // wake for the batch once the tree is quiet or the oldest change is due
+        int timeout = -1;
+        if (w.npending)
+        {
+            const uint64_t now = stats_now();
+            const uint64_t due = MIN(w.last + quiet_ns, w.first + WATCH_DELAY * 1000000ull);
+            timeout = (due > now) ? (int)((due - now + 999999) / 1000000) : 0;
+        }
+
+        struct pollfd fds[2] = {{w.inotify, POLLIN, 0}, {sig, POLLIN, 0}};
+        const int n = poll(fds, 2, timeout);
+        if ((n < 0) && (errno != EINTR))
+        {
+            tar_error("poll failed: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        if ((n > 0) && (fds[1].revents & POLLIN))
+        {
+            // consume the signal so restoring the mask does not deliver it
+            struct signalfd_siginfo info;
+            stop = read(sig, &info, sizeof(info)) == sizeof(info);
+        }
+
+        // drain the queue; a full set is written out between reads
+        ssize_t len;
+        while ((n > 0) && (fds[0].revents & POLLIN) && ((len = read(w.inotify, events, sizeof(events))) > 0))
+        {
+            handle_events(&w, events, len, count, dirs);
+            if (w.npending >= WATCH_BATCH)
+            {
+                ret = append_batch(&w);
+            }
+        }
+
+        const uint64_t now = stats_now();
+        if (!ret && w.npending && (stop || (now >= w.last + quiet_ns) || (now >= w.first + WATCH_DELAY * 1000000ull)))
+        {
+            ret = append_batch(&w);
+        }
+    }
+
+    if (w.inotify >= 0)
+    {
+        close(w.inotify);
+    }
+    if (sig >= 0)
+    {
+        close(sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (size_t i = 0; i < w.ndirs; i++)
+    {
+        free(w.dirs[i]);
+    }
+    free(w.dirs);
+    for (size_t i = 0; i <= w.mask; i++)
+    {
+        for (struct watched *e = w.table[i], *next; e; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(w.table);
+    free(w.pending);
+    return ret;
+}
+
+int find_end(struct watch *w)
+{
+    const char verbosity = w->verbosity;
+    if (seek_fd(w->fd, 0, SEEK_SET) < 0)
+    {
+        RC_ERROR("Archive is not seekable: %s", strerror(rc));
+    }
+
+    struct tar_iter it;
+    struct tar_t *entry;
+    int rc;
+    tar_iter_open(&it, w->fd, 0);
+    while ((rc = tar_iter_next(&it, &entry)) > 0)
+    {
+        w->end = it.offset + it.remaining + it.padding;
+
+        // long names and extended headers only cost a re-append after a restart
+        if ((entry->type == 'L') || (entry->type == 'K') || (entry->type == 'x') || (entry->type == 'g'))
+        {
+            continue;
+        }
+
+        char name[257];
+        if (!memcmp(entry->ustar, "ustar\0", 6) && entry->prefix[0])
+        {
+            snprintf(name, sizeof(name), "%.155s/%.100s", entry->prefix, entry->name);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%.100s", entry->name);
+        }
+
+        size_t len;
+        const char *key = stored_name(name, &len);
+        struct watched *e = lookup(w, key, len, 1);
+        if (!e)
+        {
+            tar_iter_close(&it);
+            ERROR("Unable to index archive members");
+        }
+        e->size = oct2size(entry->size, 11);
+        e->sec = oct2size(entry->mtime, 11);
+        e->nsec = -1;
+    }
+    tar_iter_close(&it);
+
+    if (rc < 0)
+    {
+        ERROR("Refusing to append to a damaged archive");
+    }
+
+    V_PRINT(stderr, "Archive holds %zu paths", w->entries);
+    return 0;
+}
+
+const char *stored_name(const char *path, size_t *len)
+{
+    size_t n = strlen(path);
+    while ((n > 1) && (path[n - 1] == '/'))
+    {
+        n--;
+    }
+
+    const size_t skip = !strncmp(path, "/", 1) ? 1 : !strncmp(path, "./", 2) ? 2 : !strncmp(path, "../", 3) ? 3 : 0;
+    *len = (n > skip) ? n - skip : 0;
+    return path + MIN(skip, n);
+}
+
+struct watched *lookup(struct watch *w, const char *name, const size_t len, const int create)
+{
+    // FNV-1a, as in memtar
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+
+    for (struct watched *e = w->table[hash & w->mask]; e; e = e->next)
+    {
+        if ((e->hash == hash) && (e->len == len) && !memcmp(e->name, name, len))
+        {
+            return e;
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    struct watched *e = calloc(1, sizeof(struct watched));
+    if (!e || !(e->name = strndup(name, len)))
+    {
+        free(e);
+        return NULL;
+    }
+    e->len = len;
+    e->hash = hash;
+    e->size = -1;
+
+    // keep chains short; entries are never removed
+    if (++w->entries > w->mask)
+    {
+        const size_t mask = w->mask * 2 + 1;
+        struct watched **table = calloc(mask + 1, sizeof(struct watched *));
+        for (size_t i = 0; table && (i <= w->mask); i++)
+        {
+            for (struct watched *old = w->table[i], *next; old; old = next)
+            {
+                next = old->next;
+                old->next = table[old->hash & mask];
+                table[old->hash & mask] = old;
+            }
+        }
+        if (table)
+        {
+            free(w->table);
+            w->table = table;
+            w->mask = mask;
+        }
+    }
+
+    e->next = w->table[hash & w->mask];
+    w->table[hash & w->mask] = e;
+    return e;
+}
+
+int add_tree(struct watch *w, const char *root)
+{
+    const char verbosity = w->verbosity;
+    size_t len = strlen(root);
+    while ((len > 1) && (root[len - 1] == '/'))
+    {
+        len--;
+    }
+
+    char *path = strndup(root, len);
+    if (!path)
+    {
+        ERROR("Unable to allocate path");
+    }
+
+    // watch before listing, so nothing created in between is missed
+    const int wd = inotify_add_watch(w->inotify, path, WATCH_MASK);
+    if (wd < 0)
+    {
+        // gone again, or not a directory
+        const int rc = errno;
+        if ((rc == ENOENT) || (rc == ENOTDIR))
+        {
+            queue(w, path);
+            free(path);
+            return 0;
+        }
+        tar_error("Unable to watch %s: %s", path, strerror(rc));
+        free(path);
+        return -1;
+    }
+
+    if ((size_t)wd >= w->ndirs)
+    {
+        const size_t ndirs = MAX(w->ndirs * 2, (size_t)wd + 64);
+        char **dirs = realloc(w->dirs, ndirs * sizeof(char *));
+        if (!dirs)
+        {
+            free(path);
+            ERROR("Unable to allocate watch table");
+        }
+        memset(dirs + w->ndirs, 0, (ndirs - w->ndirs) * sizeof(char *));
+        w->dirs = dirs;
+        w->ndirs = ndirs;
+    }
+
+    // a directory moved inside the tree keeps its descriptor
+    w->watched += !w->dirs[wd];
+    free(w->dirs[wd]);
+    w->dirs[wd] = path;
+    queue(w, path);
+
+    size_t count = 0;
+    struct walk_entry *entries = walk_list(path, &count, verbosity);
+    for (size_t i = 0; entries && (i < count); i++)
+    {
+        char *child = malloc(strlen(path) + strlen(entries[i].name) + 2);
+        if (!child)
+        {
+            break;
+        }
+        sprintf(child, "%s/%s", path, entries[i].name);
+
+        if (tar_match_excluded(tar_ctx_current()->options.match, child))
+        {
+            V_PRINT(stderr, "Excluding %s", child);
+        }
+        else if (entries[i].type == DT_DIR)
+        {
+            add_tree(w, child);
+        }
+        else
+        {
+            queue(w, child);
+        }
+        free(child);
+    }
+    walk_list_free(entries, count);
+    return 0;
+}
+
+void queue(struct watch *w, const char *path)
+{
+    size_t len;
+    const char *name = stored_name(path, &len);
+    struct watched *e = lookup(w, name, len, 1);
+    w->last = stats_now();
+    if (!e)
+    {
+        return;
+    }
+
+    // the same member may be reached through another path after a move
+    if (!e->path || strcmp(e->path, path))
+    {
+        free(e->path);
+        if (!(e->path = strdup(path)))
+        {
+            return;
+        }
+    }
+
+    if (e->pending)
+    {
+        return;
+    }
+
+    if (w->npending == w->cap)
+    {
+        const size_t cap = w->cap ? w->cap * 2 : 1024;
+        struct watched **pending = realloc(w->pending, cap * sizeof(struct watched *));
+        if (!pending)
+        {
+            return;
+        }
+        w->pending = pending;
+        w->cap = cap;
+    }
+
+    w->first = w->npending ? w->first : w->last;
+    w->pending[w->npending++] = e;
+    e->pending = 1;
+}
+
+void handle_events(struct watch *w, const char *buf, const ssize_t len, const size_t count, const char *roots[])
+{
+    const char verbosity = w->verbosity;
+    char path[8192];
+    for (const char *p = buf; p < buf + len;)
+    {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        // events were dropped: look at everything again (unchanged paths are skipped)
+        if (ev->mask & IN_Q_OVERFLOW)
+        {
+            V_PRINT(stderr, "Event queue overflowed; rescanning");
+            for (size_t i = 0; i < count; i++)
+            {
+                add_tree(w, roots[i]);
+            }
+            continue;
+        }
+
+        if ((ev->wd < 0) || ((size_t)ev->wd >= w->ndirs) || !w->dirs[ev->wd])
+        {
+            continue;
+        }
+
+        if (ev->mask & IN_IGNORED)
+        {
+            free(w->dirs[ev->wd]);
+            w->dirs[ev->wd] = NULL;
+            w->watched--;
+            continue;
+        }
+
+        if (!ev->len || (snprintf(path, sizeof(path), "%s/%s", w->dirs[ev->wd], ev->name) >= (int)sizeof(path)))
+        {
+            continue;
+        }
+
+        if (tar_match_excluded(tar_ctx_current()->options.match, path))
+        {
+            continue;
+        }
+
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+        {
+            add_tree(w, path);
+        }
+        else if (!(ev->mask & IN_ISDIR))
+        {
+            queue(w, path);
+        }
+    }
+}
+
+int append_batch(struct watch *w)
+{
+    const char verbosity = w->verbosity;
+    const off_t start = w->end;
+    size_t appended = 0;
+    for (size_t i = 0; i < w->npending; i++)
+    {
+        struct watched *e = w->pending[i];
+        e->pending = 0;
+        const int rc = append_path(w, e);
+        if (rc < 0)
+        {
+            // an archive write failed; the archive still ends at the old trailer
+            for (size_t j = i + 1; j < w->npending; j++)
+            {
+                w->pending[j]->pending = 0;
+            }
+            w->npending = 0;
+            return -1;
+        }
+        appended += rc;
+    }
+    w->npending = 0;
+
+    if (!appended)
+    {
+        return 0;
+    }
+
+    // padding of the last member, two zero blocks, then the rest of the record
+    const off_t trailer = 2 * BLOCKSIZE + (RECORDSIZE - (w->end + 2 * BLOCKSIZE) % RECORDSIZE) % RECORDSIZE;
+    const struct iovec iov[2] = {{zeroes, w->gap}, {zeroes, trailer}};
+    STATS_SYS(STATS_WRITE);
+    if (pwritev(w->fd, iov, 2, w->end - w->gap) != (ssize_t)(w->gap + trailer))
+    {
+        RC_ERROR("Could not write end of archive: %s", strerror(rc));
+    }
+    w->gap = 0;
+
+    if ((tar_ctx_current()->options.durability != TAR_DURABLE_NONE) && fdatasync(w->fd))
+    {
+        RC_ERROR("Could not sync archive: %s", strerror(rc));
+    }
+
+    V_PRINT(stderr, "Appended %zu members (%lld octets)", appended, (long long)(w->end - start));
+    return 0;
+}
+
+int append_path(struct watch *w, struct watched *e)
+{
+    const char verbosity = w->verbosity;
+    struct stat st;
+    STATS_SYS(STATS_STAT);
+    if (lstat(e->path, &st) || ((st.st_dev == w->dev) && (st.st_ino == w->ino)))
+    {
+        return 0;
+    }
+
+    // a file that has not changed since its last member (only regular files have data)
+    const int dir = S_ISDIR(st.st_mode);
+    if ((e->size >= 0) && (dir || ((e->size == (S_ISREG(st.st_mode) ? st.st_size : 0)) && (e->sec == st.st_mtim.tv_sec) && ((e->nsec < 0) || (e->nsec == st.st_mtim.tv_nsec)))))
+    {
+        return 0;
+    }
+
+    char stored[102];
+    snprintf(stored, sizeof(stored), "%.*s%s", (int)MIN(e->len, 101), e->name, dir ? "/" : "");
+    if (!e->len || (strlen(stored) > 100))
+    {
+        // the file is left out of the archive, so the caller hears about it
+        tar_error("Skipping %s: name longer than 100 octets", e->path);
+        return 0;
+    }
+
+    struct tar_member member;
+    memset(&member, 0, sizeof(member));
+    member.name = stored;
+    member.mode = st.st_mode;
+    member.uid = st.st_uid;
+    member.gid = st.st_gid;
+    char link[101] = {0};
+    int in = -1;
+    if (S_ISREG(st.st_mode))
+    {
+        // take the size from the open file; it may still be growing
+        STATS_SYS(STATS_OPEN);
+        if ((in = open(e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        {
+            return 0;
+        }
+        fstat(in, &st);
+        member.type = NORMAL;
+    }
+    else if (S_ISLNK(st.st_mode))
+    {
+        if ((readlink(e->path, link, sizeof(link) - 1) < 0) || !link[0])
+        {
+            return 0;
+        }
+        member.type = SYMLINK;
+        member.link_name = link;
+    }
+    else if (dir)
+    {
+        member.type = DIRECTORY;
+    }
+    else
+    {
+        // devices, fifos and sockets are not followed
+        return 0;
+    }
+    member.mtime = st.st_mtim.tv_sec;
+    names(w, &st, &member);
+
+    const off_t size = (in >= 0) ? st.st_size : 0;
+    struct tar_t entry;
+    if (format_tar_member(&entry, &member, size) < 0)
+    {
+        if (in >= 0)
+        {
+            close(in);
+        }
+        return 0;
+    }
+
+    // the last member's padding and this header in one write
+    const struct iovec iov[2] = {{zeroes, w->gap}, {entry.block, BLOCKSIZE}};
+    STATS_SYS(STATS_WRITE);
+    if (pwritev(w->fd, iov, 2, w->end - w->gap) != (ssize_t)(w->gap + BLOCKSIZE))
+    {
+        const int rc = errno;
+        if (in >= 0)
+        {
+            close(in);
+        }
+        ERROR("Could not write %s to archive: %s", stored, strerror(rc));
+    }
+    w->end += BLOCKSIZE;
+    w->gap = 0;
+
+    if (in >= 0)
+    {
+        const int rc = copy_data(w, in, size, stored);
+        close(in);
+        if (rc < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (verbosity > 1)
+    {
+        fprintf(stderr, "%s\n", stored);
+    }
+
+    e->size = size;
+    e->sec = st.st_mtim.tv_sec;
+    e->nsec = st.st_mtim.tv_nsec;
+    return 1;
+}
+
+int copy_data(struct watch *w, const int in, off_t len, const char *name)
+{
+    // in the kernel where both files allow it, through a buffer otherwise
+    char buf[RECORDSIZE];
+    off_t from = 0;
+    off_t to = w->end;
+    char method = 0;
+    while (len)
+    {
+        ssize_t n;
+        STATS_SYS(STATS_WRITE);
+        if (!method)
+        {
+            n = copy_file_range(in, &from, w->fd, &to, len, 0);
+            if ((n < 0) && ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP)))
+            {
+                method = 1;
+                continue;
+            }
+        }
+        else
+        {
+            STATS_SYS(STATS_READ);
+            n = pread(in, buf, MIN(len, (off_t)sizeof(buf)), from);
+            if ((n > 0) && (pwrite(w->fd, buf, n, to) != n))
+            {
+                n = -1;
+            }
+            from += (n > 0) ? n : 0;
+            to += (n > 0) ? n : 0;
+        }
+
+        if (n < 0)
+        {
+            RC_ERROR("Could not copy %s to archive: %s", name, strerror(rc));
+        }
+
+        // truncated while copying; the member keeps its header size
+        if (!n)
+        {
+            n = MIN(len, (off_t)sizeof(zeroes));
+            STATS_SYS(STATS_WRITE);
+            if (pwrite(w->fd, zeroes, n, to) != n)
+            {
+                RC_ERROR("Could not write %s to archive: %s", name, strerror(rc));
+            }
+            to += n;
+        }
+        len -= n;
+    }
+
+    w->gap = (BLOCKSIZE - (to - w->end) % BLOCKSIZE) % BLOCKSIZE;
+    w->end = to + w->gap;
+    return 0;
+}
+
+void names(struct watch *w, const struct stat *st, struct tar_member *member)
+{
+    char buffer[4096];
+    if (!(w->named & 1) || (w->uid != st->st_uid))
+    {
+        struct passwd pwd;
+        struct passwd *result = NULL;
+        w->owner[0] = '\0';
+        if (!getpwuid_r(st->st_uid, &pwd, buffer, sizeof(buffer), &result) && result)
+        {
+            snprintf(w->owner, sizeof(w->owner), "%s", pwd.pw_name);
+        }
+        w->uid = st->st_uid;
+        w->named |= 1;
+    }
+
+    if (!(w->named & 2) || (w->gid != st->st_gid))
+    {
+        struct group grp;
+        struct group *found = NULL;
+        snprintf(w->group, sizeof(w->group), "None");
+        if (!getgrgid_r(st->st_gid, &grp, buffer, sizeof(buffer), &found) && found)
+        {
+            snprintf(w->group, sizeof(w->group), "%s", grp.gr_name);
+        }
+        w->gid = st->st_gid;
+        w->named |= 2;
+    }
+
+    member->owner = w->owner;
+    member->group = w->group;
+}
@@ -0,0 +1,30 @@
+//
+// watch.h
+//
+// Continuous archiving. The archive stays open and its end offset is kept in
+// memory, so nothing is re-read after startup. Directories are watched with
+// inotify; changed paths are collected in a hash set until the tree has been
+// quiet for a while (or a change has waited too long), then appended in one
+// batch: each member is one pwritev of header and padding plus a
+// copy_file_range of its data, and the trailer is rewritten once per batch.
+// Paths whose size and mtime match their last member are skipped, which also
+// makes a restart on an existing archive append only what changed meanwhile.
+// Deleted files stay in the archive (tar cannot record removals)
+//
+#ifndef __WATCH__
+#define __WATCH__
+
+#include "tar.h"
+
+#define WATCH_QUIET 100          // default ms without events before a batch is written
+#define WATCH_DELAY 1000         // ms a change waits at most while events keep arriving
+#define WATCH_BATCH 4096         // pending paths that force a batch
+#define WATCH_EVENTS (64 * 1024) // inotify read buffer
+
+// append the trees under dirs to the archive on fd (opened for reading and
+// writing), then keep appending new and changed files until SIGINT or SIGTERM
+// quiet is the debounce interval in ms (0: WATCH_QUIET)
+// with tar_options.durability other than TAR_DURABLE_NONE every batch is fdatasync'ed
+TAR_API int tar_watch(const int fd, const size_t count, const char *dirs[], const unsigned int quiet, const char verbosity);
+
+#endif
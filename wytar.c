@@ -19,12 +19,292 @@
 
 #include <stdio.h>
 
+#include "list.h"
+#include "match.h"
+#include "range.h"
+#include "repack.h"
+#include "resume.h"
+#include "serve.h"
+#include "shard.h"
+#include "stats.h"
 #include "tar.h"
+#include "trace.h"
+#include "watch.h"
+#include "verify.h"
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+// parse --stats[=FORMAT[:FILE]]
+static int parse_stats(const char *arg, enum stats_format *format, const char **path);
+
+// append one name per line of a file ("-" for stdin) to a list
+static int read_list(const char *filename, char ***list, size_t *count);
+
+// write a byte range of each named member to stdout through a block cache
+static int print_ranges(const int fd, struct tar_t *archive, const off_t offset, const off_t length, const int count, const char *names[], const char verbosity);
 
 int main(int argc, char *argv[])
 {
+    // long options may appear anywhere; pull them out before the positional parsing
+    struct tar_options *options = &tar_ctx_current()->options;
+    struct tar_stats stats;
+    enum stats_format stats_format = STATS_TEXT;
+    const char *stats_path = NULL;
+    const char *trace_path = NULL;
+    const char *list_path = NULL;
+    unsigned int shards = 0;
+    const char *journal_path = NULL;
+    char repack = 0; // 1: --repack, 2: --concat
+    struct tar_rename *renames = NULL;
+    size_t renamecount = 0;
+    char verify = 0;
+    unsigned int verify_threads = 0; // 0: one per CPU
+    enum tar_list_format list_format = TAR_LIST_TEXT;
+    off_t range_offset = -1;         // -1: no --range
+    off_t range_length = -1;         // -1: to the end of the member
+    unsigned int debounce = 0;       // 0: WATCH_QUIET
+    struct tar_match *match = NULL;
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) || !argv[i][2])
+        {
+            argv[kept++] = argv[i];
+        }
+        else if (!strncmp(argv[i], "--stats", 7) && ((argv[i][7] == '\0') || (argv[i][7] == '=')))
+        {
+            if (parse_stats(argv[i] + 7, &stats_format, &stats_path) < 0)
+            {
+                tar_error("Bad stats option: %s", argv[i]);
+                return -1;
+            }
+            memset(&stats, 0, sizeof(stats));
+            tar_ctx_current()->stats = &stats;
+        }
+        else if (!strncmp(argv[i], "--sort=", 7))
+        {
+            const char *modes[] = {"none", "inode", "extent", "name"};
+            int mode = 3;
+            while ((mode >= 0) && strcmp(argv[i] + 7, modes[mode]))
+            {
+                mode--;
+            }
+
+            if (mode < 0)
+            {
+                tar_error("Bad sort order: %s", argv[i]);
+                return -1;
+            }
+            options->sort = mode;
+        }
+        else if (!strcmp(argv[i], "--io=uring"))
+        {
+            options->io = TAR_IO_URING;
+        }
+        else if (!strcmp(argv[i], "--io=posix"))
+        {
+            options->io = TAR_IO_POSIX;
+        }
+        else if (!strncmp(argv[i], "--uring-depth=", 14) && argv[i][14])
+        {
+            char *end = NULL;
+            const unsigned long depth = strtoul(argv[i] + 14, &end, 10);
+            if (*end || !depth || (depth > 4096))
+            {
+                tar_error("Bad io_uring depth: %s", argv[i]);
+                return -1;
+            }
+            options->uring_depth = depth;
+        }
+        else if ((!strncmp(argv[i], "--exclude=", 10) && argv[i][10]) || (!strncmp(argv[i], "--include=", 10) && argv[i][10]) ||
+                 (!strncmp(argv[i], "--exclude-from=", 15) && argv[i][15]))
+        {
+            if (!match && !(match = tar_match_new()))
+            {
+                tar_error("Unable to allocate matcher");
+                return -1;
+            }
+
+            const int exclude = (argv[i][2] == 'e');
+            const int added = (argv[i][9] == '=') ? tar_match_add(match, argv[i] + 10, exclude)
+                                                   : tar_match_add_file(match, argv[i] + 15, 1);
+            if (added < 0)
+            {
+                tar_match_free(match);
+                return -1;
+            }
+            options->match = match;
+        }
+        else if (!strcmp(argv[i], "--prefetch") || (!strncmp(argv[i], "--prefetch=", 11) && argv[i][11]))
+        {
+            char *end = NULL;
+            const unsigned long depth = argv[i][10] ? strtoul(argv[i] + 11, &end, 10) : 16;
+            if ((end && *end) || !depth || (depth > 4096))
+            {
+                tar_error("Bad prefetch depth: %s", argv[i]);
+                return -1;
+            }
+            options->prefetch = depth;
+        }
+        else if (!strcmp(argv[i], "--durable=none") || !strcmp(argv[i], "--durable=syncfs"))
+        {
+            options->durability = (argv[i][10] == 'n') ? TAR_DURABLE_NONE : TAR_DURABLE_SYNCFS;
+        }
+        else if (!strncmp(argv[i], "--durable=batch", 15) && ((argv[i][15] == '\0') || (argv[i][15] == ':')))
+        {
+            char *end = NULL;
+            const unsigned long size = argv[i][15] ? strtoul(argv[i] + 16, &end, 10) : 256;
+            if ((end && *end) || !size || (size > 65536))
+            {
+                tar_error("Bad durability batch: %s", argv[i]);
+                return -1;
+            }
+            options->durability = TAR_DURABLE_BATCH;
+            options->durable_batch = size;
+        }
+        else if (!strcmp(argv[i], "--prealloc") || (!strncmp(argv[i], "--prealloc=", 11) && argv[i][11]))
+        {
+            char *end = NULL;
+            const unsigned long long size = argv[i][10] ? strtoull(argv[i] + 11, &end, 10) : (1 << 20);
+            if ((end && *end) || !size)
+            {
+                tar_error("Bad preallocation threshold: %s", argv[i]);
+                return -1;
+            }
+            options->prealloc = size;
+        }
+        else if (!strcmp(argv[i], "--direct") || !strcmp(argv[i], "--direct=huge"))
+        {
+            options->direct = argv[i][8] ? 2 : 1;
+        }
+        else if (!strcmp(argv[i], "--resume") || !strcmp(argv[i], "--resume=checksum"))
+        {
+            options->resume = argv[i][8] ? TAR_RESUME_CHECKSUM : TAR_RESUME_STAT;
+        }
+        else if (!strcmp(argv[i], "--repack"))
+        {
+            repack = 1;
+        }
+        else if (!strcmp(argv[i], "--concat"))
+        {
+            repack = 2;
+        }
+        else if (!strncmp(argv[i], "--rename=", 9) && strchr(argv[i] + 10, '='))
+        {
+            // FROM=TO, split at the first '=' after a non-empty FROM
+            char *eq = strchr(argv[i] + 10, '=');
+            *eq = '\0';
+            renames = realloc(renames, (renamecount + 1) * sizeof(struct tar_rename));
+            renames[renamecount].from = argv[i] + 9;
+            renames[renamecount].to = eq + 1;
+            renamecount++;
+        }
+        else if (!strcmp(argv[i], "--keep-newer"))
+        {
+            options->keep_newer = 1;
+        }
+        else if (!strncmp(argv[i], "--journal=", 10) && argv[i][10])
+        {
+            journal_path = argv[i] + 10;
+        }
+        else if (!strcmp(argv[i], "--checksum"))
+        {
+            options->checksum = 1;
+        }
+        else if (!strcmp(argv[i], "--verify") || (!strncmp(argv[i], "--verify=", 9) && argv[i][9]))
+        {
+            char *end = NULL;
+            const unsigned long threads = argv[i][8] ? strtoul(argv[i] + 9, &end, 10) : 0;
+            if ((end && *end) || (threads > 256))
+            {
+                tar_error("Bad verify thread count: %s", argv[i]);
+                return -1;
+            }
+            verify = 1;
+            verify_threads = threads;
+        }
+        else if (!strncmp(argv[i], "--format=", 9))
+        {
+            if (!strcmp(argv[i] + 9, "text"))
+            {
+                list_format = TAR_LIST_TEXT;
+            }
+            else if (!strcmp(argv[i] + 9, "ndjson"))
+            {
+                list_format = TAR_LIST_NDJSON;
+            }
+            else if (!strcmp(argv[i] + 9, "csv"))
+            {
+                list_format = TAR_LIST_CSV;
+            }
+            else
+            {
+                tar_error("Bad list format: %s", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[i], "--range=", 8) && argv[i][8])
+        {
+            // OFFSET[:LENGTH]
+            char *end = NULL;
+            range_offset = strtoll(argv[i] + 8, &end, 10);
+            if ((end != argv[i] + 8) && (*end == ':') && end[1])
+            {
+                range_length = strtoll(end + 1, &end, 10);
+            }
+
+            if (*end || (range_offset < 0) || (range_length < -1))
+            {
+                tar_error("Bad range: %s", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[i], "--debounce=", 11) && argv[i][11])
+        {
+            char *end = NULL;
+            const unsigned long ms = strtoul(argv[i] + 11, &end, 10);
+            if (*end || !ms || (ms > 60000))
+            {
+                tar_error("Bad debounce interval: %s", argv[i]);
+                return -1;
+            }
+            debounce = ms;
+        }
+        else if (!strncmp(argv[i], "--shards=", 9) && argv[i][9])
+        {
+            char *end = NULL;
+            const unsigned long count = strtoul(argv[i] + 9, &end, 10);
+            if (*end || !count || (count > SHARD_MAX))
+            {
+                tar_error("Bad shard count: %s", argv[i]);
+                return -1;
+            }
+            shards = count;
+        }
+        else if (!strncmp(argv[i], "--files-from=", 13) && argv[i][13])
+        {
+            list_path = argv[i] + 13;
+        }
+        else if (!strncmp(argv[i], "--trace=", 8) && argv[i][8])
+        {
+            trace_path = argv[i] + 8;
+            if (!tar_ctx_current()->trace && !(tar_ctx_current()->trace = tar_trace_new()))
+            {
+                tar_error("Unable to start tracing");
+                return -1;
+            }
+        }
+        else
+        {
+            tar_error("Unknown option: %s", argv[i]);
+            fprintf(stderr, "Do '%s help' for help\n", argv[0]);
+            return -1;
+        }
+    }
+    argc = kept;
+    argv[argc] = NULL;
+
     if (((argc == 2) && (strncmp(argv[1], "help", MAX(strlen(argv[1]), 4)))) || (argc < 3))
     {
         fprintf(stderr, "Usage: %s option(s) tarfile [sources]\n", argv[0]);
@@ -35,6 +315,8 @@ int main(int argc, char *argv[])
     if (argc == 2)
     {
         fprintf(stdout, "Usage: %s options(s) tarfile [sources]\n"
+                        "Usage: %s serve socket archive(s)\n"
+                        "Usage: %s watch tarfile dir(s)\n"
                         "Usage: %s help\n"
                         "\n"
                         "Important:\n"
@@ -42,25 +324,109 @@ int main(int argc, char *argv[])
                         "    Only a subset of the functions the GNU tar utility has are supported.\n"
                         "\n"
                         "    Special files that already exist will not be replaced when extracting (no error)\n"
-                        "    Regular expression expansion/matching is not done.\n"
+                        "    Names given when extracting select those members and everything below them;\n"
+                        "    they and the patterns below may use the glob characters * ? [...]\n"
                         "\n"
                         "    options (only one allowed at a time):\n"
                         "        c - create a new archive\n"
                         "        x - extract from archive\n"
+                        "        t - list the members of an archive (long listing with v)\n"
+                        "\n"
+                        "    serve indexes the archives once and answers LIST, STAT, READ, OPEN and STATS\n"
+                        "    requests on a Unix socket until interrupted (see serve.h for the protocol)\n"
+                        "    watch archives the directories into tarfile (created if missing, appended to\n"
+                        "    otherwise), then appends new and changed files in batches until interrupted\n"
                         "\n"
                         "    other options:\n"
                         "        v - make operation verbose\n"
                         "\n"
+                        "    long options:\n"
+                        "        --stats[=FORMAT[:FILE]] - print syscall counts, phase times and file latencies\n"
+                        "                                  FORMAT is text (default), json or prom; FILE defaults to stderr\n"
+                        "        --trace=FILE            - write per-entry events as Chrome trace JSON (open in Perfetto)\n"
+                        "        --exclude=PATTERN       - skip matching members; excluded directories are not walked\n"
+                        "                                  when creating. Without a '/' it matches any path component\n"
+                        "        --exclude-from=FILE     - read exclude patterns from FILE, one per line\n"
+                        "        --include=PATTERN       - only extract members matching PATTERN (repeatable)\n"
+                        "        --files-from=FILE       - read sources (create) or member names (extract) from FILE\n"
+                        "        --sort=ORDER            - create: order of directory entries; none (readdir order,\n"
+                        "                                  default), inode, extent (FIEMAP physical order, costs an\n"
+                        "                                  open per file) or name (reproducible archives)\n"
+                        "        --prefetch[=K]          - create: open and read-hint the next K files (default 16)\n"
+                        "                                  while writing, and drop their pages once archived\n"
+                        "        --durable=LEVEL         - crash safety of extraction:\n"
+                        "                                  none     - page cache only (default, fastest)\n"
+                        "                                  syncfs   - one syncfs at the end; near full speed, durable on\n"
+                        "                                             exit, partial files possible after a crash\n"
+                        "                                  batch[:N] - write to temp names, then every N files (256)\n"
+                        "                                             fsync, rename into place and fsync each parent\n"
+                        "                                             once; files are absent or complete after a crash\n"
+                        "        --prealloc[=BYTES]      - fallocate extracted files of at least BYTES (default 1 MiB)\n"
+                        "                                  and, on create, the whole archive from a stat pre-pass\n"
+                        "        --direct[=huge]         - archive I/O with O_DIRECT through large aligned buffers\n"
+                        "                                  (huge: MAP_HUGETLB); falls back to buffered I/O\n"
+                        "        --repack                - with c: the sources are archives; copy their members to\n"
+                        "                                  tarfile without extracting (--exclude/--include filter\n"
+                        "                                  source names, data moves with copy_file_range)\n"
+                        "        --concat                - with c: the sources are archives; append their members to\n"
+                        "                                  tarfile as is, with one trailer (reflinked when possible)\n"
+                        "        --rename=FROM=TO        - repack: member names starting with FROM start with TO\n"
+                        "                                  instead (repeatable; the first match applies)\n"
+                        "        --resume[=checksum]     - extract: skip regular files that already have the member's\n"
+                        "                                  size and mtime (and recorded CRC32C with =checksum)\n"
+                        "        --keep-newer            - extract: leave files newer than their member alone\n"
+                        "        --journal=FILE          - extract: checkpoint progress in FILE; a rerun on the same\n"
+                        "                                  archive starts at the first incomplete member. FILE is\n"
+                        "                                  removed once extraction succeeds\n"
+                        "        --checksum              - create: record a CRC32C of every regular file in a PAX\n"
+                        "                                  extended header (needs a seekable archive)\n"
+                        "        --verify[=THREADS]      - with x: check member data against the recorded checksums\n"
+                        "                                  with parallel positional reads instead of extracting\n"
+                        "                                  (default one thread per CPU)\n"
+                        "        --format=FORMAT         - with t: text (default), ndjson or csv (name, type, mode,\n"
+                        "                                  uid, gid, owner, group, size, mtime, link, offset)\n"
+                        "        --range=OFFSET[:LENGTH] - with x: write LENGTH octets (default all) of each named\n"
+                        "                                  member from OFFSET to stdout with positional reads\n"
+                        "                                  through a shared LRU block cache\n"
+                        "        --debounce=MS           - watch: quiet time before a batch is appended (default 100)\n"
+                        "        --shards=N              - create: balance sources by size over N archives tarfile.0 ...\n"
+                        "                                  written in parallel, with a manifest at tarfile. Extracting\n"
+                        "                                  a manifest reads its shards in parallel\n"
+                        "        --io=posix|uring        - I/O backend; uring batches small-file extraction and\n"
+                        "                                  reads ahead of the writer when creating\n"
+                        "        --uring-depth=N         - files stat'ed, opened and read ahead when creating with\n"
+                        "                                  --io=uring (1-4096, default 32)\n"
+                        "\n"
                         "Ex: %s vl archive.tar\n",
-                argv[0], argv[0], argv[0]);
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 0;
     }
 
-    argc -= 3;
+    if (!strcmp(argv[1], "serve"))
+    {
+        return tar_serve(argv[2], argc - 3, (const char **)argv + 3, 1);
+    }
+
+    if (!strcmp(argv[1], "watch"))
+    {
+        const int fd = open(argv[2], O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+            tar_error("Unable to open file %s", argv[2]);
+            return -1;
+        }
+        const int ret = tar_watch(fd, argc - 3, (const char **)argv + 3, debounce, 1);
+        close(fd);
+        return ret;
+    }
+
+    // number of sources after the archive name
+    argc = MAX(argc - 4, 0);
 
     int rc = 0;
     char c = 0,         // create
         x = 0,          // extract
+        t = 0,          // list
         f = 0;
     char verbosity = 0; // 0: no print; 1: print file names; 2: print file properties
 
@@ -75,13 +441,16 @@ int main(int argc, char *argv[])
         case 'x':
             x = 1;
             break;
+        case 't':
+            t = 1;
+            break;
         case 'v':
             verbosity++;
             break;
         case '-':
             break;
         default:
-            fprintf(stderr, "Error: Bad option: %c\n", argv[1][i]);
+            tar_error("Bad option: %c", argv[1][i]);
             fprintf(stderr, "Do '%s help' for help\n", argv[0]);
             return 0;
             break;
@@ -97,41 +466,105 @@ int main(int argc, char *argv[])
         case '-':
             break;
         default:
-            fprintf(stderr, "Error: Bad option, or -f not used, please use -f to declare the archive being used\n");
+            tar_error("Bad option, or -f not used, please use -f to declare the archive being used");
             return 0;
             break;
         }
     }
 
     // make sure only one of these options was selected
-    const char used = c + x;
+    const char used = c + x + t;
     if (used > 1)
     {
-        fprintf(stderr, "Error: Cannot have so all of these flags at once\n");
+        tar_error("Cannot have so all of these flags at once");
         return -1;
     }
     else if (used < 1)
     {
-        fprintf(stderr, "Error: Need one of 'cx' options set\n");
+        tar_error("Need one of 'cxt' options set");
         return -1;
     }
 
     if (f != 1){
-        fprintf(stderr, "Error: Must use -f to declare the archive being used\n");
+        tar_error("Must use -f to declare the archive being used");
     }
 
     const char *filename = argv[3];
     const char **files = (const char **)&argv[4];
 
+    // names from --files-from follow the ones on the command line
+    char **list = NULL;
+    size_t listcount = 0;
+    if (list_path)
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            list = realloc(list, (listcount + 1) * sizeof(char *));
+            list[listcount++] = strdup(files[i]);
+        }
+
+        if (read_list(list_path, &list, &listcount) < 0)
+        {
+            tar_error("Unable to read %s", list_path);
+            return -1;
+        }
+        files = (const char **)list;
+        argc = listcount;
+    }
+
     // //////////////////////////////////////////
 
     struct tar_t *archive = NULL;
+    off_t start = 0; // resume checkpoint
     int fd = -1;
-    if (c)
+    if (c && shards)
+    {
+        if (tar_shard_write(filename, shards, argc, files, verbosity) < 0)
+        {
+            rc = -1;
+        }
+    }
+    else if (c && repack)
+    {
+        if ((fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+        {
+            tar_error("Unable to open file %s", filename);
+            return -1;
+        }
+
+        int *in = calloc(argc + 1, sizeof(int));
+        for (int i = 0; i < argc; i++)
+        {
+            if ((in[i] = open(files[i], O_RDONLY)) < 0)
+            {
+                tar_error("Unable to open file %s", files[i]);
+                rc = -1;
+            }
+        }
+
+        if (!rc && (repack == 2) && (tar_concat(fd, argc, in, verbosity) < 0))
+        {
+            rc = -1;
+        }
+        else if (!rc && (repack == 1) && (tar_repack(fd, argc, in, renames, renamecount, verbosity) < 0))
+        {
+            rc = -1;
+        }
+
+        for (int i = 0; i < argc; i++)
+        {
+            if (in[i] >= 0)
+            {
+                close(in[i]);
+            }
+        }
+        free(in);
+    }
+    else if (c)
     { // create new file
         if ((fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
         {
-            fprintf(stderr, "Error: Unable to open file %s\n", filename);
+            tar_error("Unable to open file %s", filename);
             return -1;
         }
 
@@ -140,25 +573,89 @@ int main(int argc, char *argv[])
             rc = -1;
         }
     }
+    else if (t)
+    {
+        // stdin when the archive is "-"
+        fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : dup(STDIN_FILENO);
+        if (fd < 0)
+        {
+            tar_error("Unable to open file %s", filename);
+            return -1;
+        }
+
+        // a pipe cannot be put back after peeking
+        if (strcmp(filename, "-") && tar_shard_is_manifest(fd))
+        {
+            tar_error("List the shard archives named in %s one at a time", filename);
+            rc = -1;
+        }
+        else if (tar_list(STDOUT_FILENO, fd, argc, files, list_format, verbosity) < 0)
+        {
+            fprintf(stderr, "Exiting with error due to previous error\n");
+            rc = -1;
+        }
+    }
     else
     {
         // open existing file
         if ((fd = open(filename, O_RDWR)) < 0)
         {
-            fprintf(stderr, "Error: Unable to open file %s\n", filename);
+            tar_error("Unable to open file %s", filename);
             return -1;
         }
 
+        // a manifest names the shard archives to extract
+        if (tar_shard_is_manifest(fd) && (verify || (range_offset >= 0)))
+        {
+            tar_error("Use the shard archives named in %s one at a time", filename);
+            rc = -1;
+        }
+        else if (tar_shard_is_manifest(fd) && journal_path)
+        {
+            tar_error("A journal cannot follow the shard archives named in %s", filename);
+            rc = -1;
+        }
+        else if (tar_shard_is_manifest(fd))
+        {
+            if (tar_shard_extract(filename, argc, files, verbosity) < 0)
+            {
+                fprintf(stderr, "Exiting with error due to previous error\n");
+                rc = -1;
+            }
+        }
+        // start reading headers at the journal's checkpoint
+        else if (x && journal_path && !verify && (range_offset < 0) && ((resume_open(journal_path, fd, &start, verbosity) < 0) || (lseek(fd, start, SEEK_SET) < 0)))
+        {
+            tar_error("Unable to use journal %s", journal_path);
+            rc = -1;
+        }
         // read in data
-        if (tar_read(fd, &archive, verbosity) < 0)
+        else if (tar_read(fd, &archive, verbosity) < 0)
         {
             tar_free(archive);
             close(fd);
             return -1;
         }
-
+        // write the requested byte range of each named member to stdout
+        else if (x && (range_offset >= 0))
+        {
+            if (print_ranges(fd, archive, range_offset, range_length, argc, files, verbosity) < 0)
+            {
+                fprintf(stderr, "Exiting with error due to previous error\n");
+                rc = -1;
+            }
+        }
+        // check member data without extracting
+        else if (x && verify)
+        {
+            if (tar_verify(fd, archive, verify_threads, verbosity) < 0)
+            {
+                fprintf(stderr, "Exiting with error due to previous error\n");
+                rc = -1;
+            }
+        }
         // perform operation
-        if ((x && (tar_extract(fd, archive, argc - 1, files, verbosity) < 0)) // extract entries
+        else if ((x && (tar_extract(fd, archive, argc, files, verbosity) < 0)) // extract entries
         )
         {
             fprintf(stderr, "Exiting with error due to previous error\n");
@@ -166,7 +663,180 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (resume_close(!rc) < 0)
+    {
+        tar_error("Unable to remove journal %s", journal_path);
+        rc = -1;
+    }
+
     tar_free(archive);
     close(fd); // don't bother checking for fd < 0
+
+    for (size_t i = 0; i < listcount; i++)
+    {
+        free(list[i]);
+    }
+    free(list);
+    free(renames);
+    tar_match_free(match);
+    options->match = NULL;
+
+    if (trace_path)
+    {
+        if (tar_trace_write(tar_ctx_current()->trace, trace_path) < 0)
+        {
+            tar_error("Unable to write trace file %s", trace_path);
+            rc = -1;
+        }
+        tar_trace_free(tar_ctx_current()->trace);
+        tar_ctx_current()->trace = NULL;
+    }
+
+    if (tar_ctx_current()->stats)
+    {
+        FILE *out = stats_path ? fopen(stats_path, "w") : stderr;
+        if (!out)
+        {
+            tar_error("Unable to open stats file %s", stats_path);
+            return -1;
+        }
+        tar_stats_print(out, &stats, stats_format);
+        if (out != stderr)
+        {
+            fclose(out);
+        }
+    }
     return rc;
-}
\ No newline at end of file
+}
+
+int parse_stats(const char *arg, enum stats_format *format, const char **path)
+{
+    *format = STATS_TEXT;
+    *path = NULL;
+    if (!*arg)
+    {
+        return 0;
+    }
+
+    // skip '='
+    arg++;
+    const char *colon = strchr(arg, ':');
+    const size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    if ((len == 4) && !strncmp(arg, "text", 4))
+    {
+        *format = STATS_TEXT;
+    }
+    else if ((len == 4) && !strncmp(arg, "json", 4))
+    {
+        *format = STATS_JSON;
+    }
+    else if ((len == 4) && !strncmp(arg, "prom", 4))
+    {
+        *format = STATS_PROM;
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (colon)
+    {
+        if (!colon[1])
+        {
+            return -1;
+        }
+        *path = colon + 1;
+    }
+    return 0;
+}
+int read_list(const char *filename, char ***list, size_t *count)
+{
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!f)
+    {
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) >= 0)
+    {
+        while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+        {
+            line[--len] = '\0';
+        }
+
+        if (len)
+        {
+            *list = realloc(*list, (*count + 1) * sizeof(char *));
+            (*list)[(*count)++] = strdup(line);
+        }
+    }
+
+    free(line);
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+    return 0;
+}
+
+int print_ranges(const int fd, struct tar_t *archive, const off_t offset, const off_t length, const int count, const char *names[], const char verbosity)
+{
+    struct tar_cache *cache = tar_cache_new(RANGE_BLOCK * RANGE_SHARDS * 4);
+    if (!cache)
+    {
+        tar_error("Unable to allocate block cache");
+        return -1;
+    }
+
+    int ret = 0;
+    char buf[1 << 16];
+    for (int i = 0; !ret && (i < count); i++)
+    {
+        struct tar_t *entry = archive;
+        while (entry && strncmp(entry->name, names[i], sizeof(entry->name)))
+        {
+            entry = entry->next;
+        }
+
+        if (!entry)
+        {
+            tar_error("No member named %s", names[i]);
+            ret = -1;
+            break;
+        }
+
+        // a negative length reads to the end of the member
+        off_t at = offset;
+        off_t left = length;
+        while (left)
+        {
+            const size_t want = (left < 0) ? sizeof(buf) : MIN((size_t)left, sizeof(buf));
+            const ssize_t got = tar_read_range(cache, fd, entry, at, buf, want);
+            if ((got < 0) || (got && (fwrite(buf, 1, got, stdout) != (size_t)got)))
+            {
+                ret = -1;
+            }
+
+            if (got <= 0)
+            {
+                break;
+            }
+            at += got;
+            left -= (left < 0) ? 0 : got;
+        }
+    }
+
+    struct tar_cache_stats stats;
+    tar_cache_stats(cache, &stats);
+    if (verbosity)
+    {
+        fprintf(stderr, "Block cache: %llu hits, %llu misses, %llu evictions, %zu of %zu octets\n",
+                stats.hits, stats.misses, stats.evictions, stats.bytes, stats.limit);
+    }
+    tar_cache_free(cache);
+    fflush(stdout);
+    return ret;
+}